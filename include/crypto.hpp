@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// 密码学原语（纯C++实现，无外部依赖）
+// X25519密钥交换(RFC 7748)、ChaCha20-Poly1305 AEAD(RFC 8439)、HMAC-SHA256 / HKDF(RFC 5869)
+
+static constexpr size_t X25519_BYTES = 32;
+static constexpr size_t AEAD_KEY_BYTES = 32;
+static constexpr size_t AEAD_NONCE_BYTES = 12;
+static constexpr size_t AEAD_TAG_BYTES = 16;
+
+// 操作系统提供的安全随机数
+bool random_bytes(uint8_t* out, size_t len);
+
+// X25519：out = scalar * point；返回false表示结果为全零（对端给出了低阶点）
+bool x25519(uint8_t out[32], const uint8_t scalar[32], const uint8_t point[32]);
+void x25519_public(uint8_t pub[32], const uint8_t priv[32]);
+
+// ChaCha20-Poly1305：data原地加密/解密，加密与认证在同一遍中按64字节块交替进行
+void aead_seal(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, size_t aad_len,
+               uint8_t* data, size_t len, uint8_t tag[16]);
+// 异地加密：读取in，密文写到out（逐块完成，不需要先把明文拷贝到输出缓冲区）
+void aead_seal(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, size_t aad_len,
+               const uint8_t* in, uint8_t* out, size_t len, uint8_t tag[16]);
+// 认证失败返回false，此时data内容无效（已被部分解密），调用方必须丢弃
+bool aead_open(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, size_t aad_len,
+               uint8_t* data, size_t len, const uint8_t tag[16]);
+
+// 单独的Poly1305（一次性密钥）
+void poly1305(const uint8_t key[32], const uint8_t* msg, size_t len, uint8_t tag[16]);
+
+void hmac_sha256(const uint8_t* key, size_t key_len, const uint8_t* data, size_t len, uint8_t out[32]);
+void hkdf_sha256(const uint8_t* salt, size_t salt_len, const uint8_t* ikm, size_t ikm_len,
+                 const uint8_t* info, size_t info_len, uint8_t* out, size_t out_len);
+
+// 常量时间比较
+bool ct_equal(const uint8_t* a, const uint8_t* b, size_t len);
@@ -0,0 +1,191 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <functional>
+#include <unordered_map>
+
+#include "protocol.hpp"
+#include "delivery.hpp"
+
+// 内容定义分块(CDC)与按分块去重的文件传输
+
+using ChunkHash = std::array<uint8_t, 32>;   // 分块的SHA-256
+struct ChunkHashHasher {
+    size_t operator()(const ChunkHash& h) const { size_t v; memcpy(&v, h.data(), sizeof(v)); return v; }
+};
+
+// 分块大小：最小/期望/最大（期望值附近使用归一化切分，分块大小更集中）
+static constexpr size_t CDC_MIN = 2 * 1024;
+static constexpr size_t CDC_AVG = 8 * 1024;
+static constexpr size_t CDC_MAX = 32 * 1024;
+
+struct ChunkRef {
+    ChunkHash hash{};
+    uint32_t len = 0;
+    uint64_t offset = 0;   // 在文件中的偏移（不在清单中传输，由长度累加得到）
+};
+
+// 在p[0..n)中寻找第一个切点，返回分块长度；n不足CDC_MAX且不是文件末尾时调用方需等待更多数据
+size_t cdc_cut(const uint8_t* p, size_t n);
+// 切分内存中的数据
+void cdc_split(const uint8_t* data, size_t len, std::vector<ChunkRef>& out);
+// 流式切分文件（不把整个文件读入内存）
+bool cdc_split_file(const std::string& path, std::vector<ChunkRef>& out, uint64_t& size);
+std::string chunk_hex(const ChunkHash& h);
+
+// 文件清单
+struct FileManifest {
+    uint32_t xfer_id = 0;
+    std::string name;
+    uint64_t size = 0;
+    std::vector<ChunkRef> chunks;
+};
+// 清单最多包含的分块数（按最小分块至少约400MB的文件），编码后的清单不超过单帧载荷上限
+static constexpr size_t MAX_MANIFEST_CHUNKS = 200000;
+static_assert(4 + 4 + 4 + 2 + 65535 + 8 + 4 + MAX_MANIFEST_CHUNKS * 36 + 16 <= MAX_PAYLOAD_BYTES, "manifest exceeds frame limit");
+std::vector<uint8_t> encode_manifest(uint32_t target, const FileManifest& m);
+bool decode_manifest(const uint8_t* p, size_t n, FileManifest& m);   // p为去掉发送者ID后的载荷
+
+// 本地分块仓库的默认容量（pack文件字节数）
+static constexpr uint64_t CHUNK_STORE_BYTES = 1ULL << 30;
+
+// 本地分块仓库：只追加的pack文件 [sha256:32][len:4][data]，打开时扫描建立内存索引
+// pack文件超过容量时压缩：按最近使用保留分块（固定的分块总是保留）重写到3/4容量以内，
+// 重写时从旧到新排列，重新打开后仍能恢复使用顺序
+class ChunkStore {
+public:
+    bool open(const std::string& dir, uint64_t max_bytes = CHUNK_STORE_BYTES);
+    bool has(const ChunkHash& h) const;   // 命中也算一次使用
+    bool put(const ChunkHash& h, const uint8_t* data, size_t len);
+    bool get(const ChunkHash& h, std::vector<uint8_t>& out) const;
+    // 固定/解除固定（可重入计数）：正在接收的文件用到的分块在压缩时不会被丢弃
+    void pin(const ChunkHash& h);
+    void unpin(const ChunkHash& h);
+    size_t size() const;
+    uint64_t bytes() const;
+
+private:
+    struct Loc { uint64_t offset; uint32_t len; std::list<ChunkHash>::iterator use; };
+    void touch(const Loc& l) const;
+    bool compact();   // 调用方持有mtx
+
+    mutable std::mutex mtx;
+    std::string path;
+    mutable std::fstream file;
+    uint64_t end = 0;
+    uint64_t cap = CHUNK_STORE_BYTES;
+    std::unordered_map<ChunkHash, Loc, ChunkHashHasher> index;
+    mutable std::list<ChunkHash> recent;   // 头部为最近使用
+    std::unordered_map<ChunkHash, uint32_t, ChunkHashHasher> pins;
+};
+
+// 服务器端分块缓存：按字节计容量的LRU，扇出发送同一文件时每个分块只需上传一次
+// 每个分块记录上传过它的客户端，只代替这些客户端发送（不能凭哈希取到别人上传的数据）
+class ChunkCache {
+public:
+    using Data = std::shared_ptr<const std::vector<uint8_t>>;
+    explicit ChunkCache(size_t max_bytes): cap(max_bytes) {}
+    Data get(const ChunkHash& h, uint32_t owner);
+    void put(const ChunkHash& h, Data d, uint32_t owner);
+
+private:
+    struct Entry {
+        ChunkHash hash;
+        Data data;
+        std::vector<uint32_t> owners;
+    };
+    std::mutex mtx;
+    std::list<Entry> lru;
+    std::unordered_map<ChunkHash, std::list<Entry>::iterator, ChunkHashHasher> map;
+    size_t used = 0;
+    size_t cap;
+};
+
+// 传输状态（用于界面显示）
+struct TransferStatus {
+    uint32_t peer = 0;
+    std::string name, out;
+    uint64_t size = 0;
+    uint64_t have = 0;         // 已就绪字节数（本地已有 + 已收到）
+    uint64_t fetched = 0;      // 实际经网络收到的分块字节数
+    bool done = false;
+    bool ok = false;
+    bool sending = false;      // 本端是发送方（只在发送失败时报告）
+    ChunkHash content_key{};   // 内容标识：全部分块哈希的SHA-256（用作图片预览缓存的key）
+};
+
+// 发送端同时提供的文件数上限：接收端不通知完成，只有超过接收端全部重试时间仍无请求的清单才视为结束并移除，
+// 仍在进行的传输达到上限时拒绝新的发送（而不是丢弃进行中的清单，使其接收端重试后失败）
+static constexpr size_t MAX_OUTGOING_TRANSFERS = 32;
+
+// 客户端去重传输
+// 发送端只发清单，按对方请求读取文件中的分块（经Delivery按窗口发送，窗口打开时才读文件）；
+// 接收端只请求本地仓库中没有的分块
+class DedupTransfer {
+public:
+    using SendFn = std::function<bool(uint8_t type, const std::vector<uint8_t>& payload)>;  // payload已含目标ID
+    using StatusFn = std::function<void(const TransferStatus&)>;
+
+    DedupTransfer(const std::string& store_dir, SendFn send, Delivery& link, StatusFn status,
+                  uint64_t store_bytes = CHUNK_STORE_BYTES);
+
+    // 发送端：切分文件并发送清单，失败时err为原因（读文件失败、文件过大、进行中的传输已达上限）
+    bool send_file(uint32_t target, const std::string& path, TransferStatus& st, std::string& err);
+    // 处理MT_FILE_MANIFEST / MT_CHUNK_REQUEST / MT_CHUNK_DATA（body为去掉发送者ID后的载荷）
+    void on_message(uint8_t type, uint32_t sender, const uint8_t* body, size_t len);
+    // 定时调用（与Delivery::tick同一线程即可）：长时间没有分块到达的接收任务重新请求缺少的分块，
+    // 多次重试仍无进展时以失败结束；移除已结束的发送
+    void tick();
+    // 对端已离线：来自它的接收任务以失败结束，不再响应它的请求
+    void drop_peer(uint32_t peer);
+    // 本端连接断开：全部接收任务以失败结束，清空发送中的清单
+    void reset();
+
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Outgoing {
+        uint32_t target = 0;   // 只响应清单接收者的请求
+        std::string path, name;
+        uint64_t size = 0;
+        std::unordered_map<ChunkHash, ChunkRef, ChunkHashHasher> chunks;
+        Clock::time_point last_active;   // 发出清单、收到请求或读取分块发送的时间
+    };
+    struct Assembly {
+        FileManifest m;
+        TransferStatus st;
+        std::unordered_map<ChunkHash, uint64_t, ChunkHashHasher> missing;  // 缺少的分块 -> 在文件中出现的总字节数
+        Clock::time_point last_progress;
+        int retries = 0;       // 连续无进展而重新请求的次数
+    };
+
+    void on_manifest(uint32_t sender, const uint8_t* body, size_t len);
+    void on_request(uint32_t sender, const uint8_t* body, size_t len);
+    void on_data(uint32_t sender, const uint8_t* body, size_t len);
+    void request_missing(uint32_t sender, const Assembly& a, std::vector<std::vector<uint8_t>>& reqs);
+    void send_failed(uint32_t target, uint32_t xfer);
+    void touch_outgoing(uint32_t xfer);
+    void expire_outgoing(Clock::time_point now);
+    void fail_incoming(std::vector<Assembly>& failed);
+    bool finish(Assembly& a);
+    void release(const Assembly& a);
+
+    ChunkStore store;
+    SendFn send;
+    Delivery& link;
+    StatusFn status;
+    std::mutex mtx;
+    uint32_t next_xfer = 1;
+    std::map<uint32_t, Outgoing> outgoing;        // xfer_id -> 正在提供的文件
+    std::map<std::pair<uint32_t, uint32_t>, Assembly> incoming;  // (发送者, xfer_id) -> 正在接收的文件
+};
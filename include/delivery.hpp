@@ -0,0 +1,139 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+// 端到端送达回执与文件分块的滑动窗口
+// 发送端给发往每个对端的文本和分块分配递增序号（FLAG_SEQ，载荷在ID之后带[seq:4]），
+// 接收端按对端累积确认，定时或每收到若干条时发送一个MT_RECEIPT：
+//   [peer:4][delivered_cum:4][read_cum:4][count:2] + count*[first:4][last:4]
+// delivered_cum之前的序号全部已收到，区间列出delivered_cum之后零散收到的序号（选择确认）；
+// read_cum之前的文本已被用户看到。接收端保留全部空缺，回执只列出最近的区间。
+// 未确认的消息超时重传（序号不变，接收端去重），重传多次仍未确认时放弃，并用MT_SKIP通知接收端不再等待该序号；分块按窗口发送，窗口大小由测得的RTT调整：
+// RTT接近最小RTT时增大，排队导致RTT升高时减小（与TCP Vegas相同的思路），超时时减半。
+
+enum class ReceiptState { DELIVERED, READ, FAILED };
+
+struct LinkStats {
+    double srtt_ms = 0;      // 平滑RTT
+    double min_rtt_ms = 0;   // 最近10秒内的最小RTT
+    size_t cwnd = 0;         // 窗口（字节）
+    size_t inflight = 0;     // 已发送未确认的分块字节数
+    size_t queued = 0;       // 等待窗口的分块数
+    uint64_t retransmits = 0;
+};
+
+class Delivery {
+public:
+    using SendFn = std::function<bool(uint8_t type, uint16_t flags, const std::vector<uint8_t>& payload)>;
+    // 追加消息体：调用时p已含[peer:4][seq:4]，重传时会再次调用
+    using Producer = std::function<bool(std::vector<uint8_t>& p)>;
+    using ReceiptFn = std::function<void(uint32_t peer, uint32_t seq, ReceiptState st)>;  // 只报告文本消息
+    using FailFn = std::function<void()>;   // 分块被放弃（重传超过上限、对端离线或连接断开）
+
+    Delivery(SendFn send, ReceiptFn on_receipt);
+
+    // 发送文本：立即发送，返回分配的序号
+    uint32_t send_text(uint32_t peer, uint8_t type, const uint8_t* body, size_t len);
+    // 发送分块：放入对端队列，窗口允许时发送；size为消息体字节数，放弃时调用failed
+    void send_windowed(uint32_t peer, uint8_t type, size_t size, Producer make, FailFn failed = nullptr);
+
+    // 收到带序号的消息：返回false表示重复（已处理过，调用方应丢弃）
+    bool on_sequenced(uint32_t sender, uint32_t seq);
+    // 已收到的该对端的文本全部已读
+    void mark_read(uint32_t sender);
+    void mark_read_all();
+    // 处理MT_RECEIPT（body为去掉发送者ID后的载荷）
+    void on_receipt(uint32_t sender, const uint8_t* body, size_t len);
+    // 处理MT_SKIP：发送端已放弃的序号视为已收到
+    void on_skip(uint32_t sender, const uint8_t* body, size_t len);
+
+    // 对端已离线：丢弃与它的收发状态，未确认的文本报告FAILED，未完成的分块调用失败回调
+    void drop_peer(uint32_t peer);
+    // 本端连接断开：对全部对端执行drop_peer
+    void reset();
+
+    // 定时调用（约10ms）：发送到期的回执、重传超时的消息
+    void tick();
+
+    bool stats(uint32_t peer, LinkStats& out);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // 发送方向（本端 -> 对端）
+    struct Pending {
+        uint8_t type;
+        bool windowed;
+        size_t size;
+        Producer make;
+        FailFn failed;
+        Clock::time_point sent;
+        int retries = 0;
+    };
+    struct Queued {
+        uint8_t type;
+        size_t size;
+        Producer make;
+        FailFn failed;
+    };
+    struct Outbound {
+        uint32_t next_seq = 1;
+        std::map<uint32_t, Pending> inflight;
+        std::deque<Queued> queue;
+        std::set<uint32_t> unread;       // 已送达、等待已读回执的文本序号
+        std::set<uint32_t> abandoned;    // 已放弃、接收端还未越过的序号（回执显示空缺仍在时重发MT_SKIP）
+        uint32_t read_cum = 0;
+
+        // RTT估计(RFC 6298)
+        double srtt = 0, rttvar = 0, rto;   // 秒
+        double min_rtt = 0;
+        Clock::time_point min_rtt_at;
+
+        // 窗口
+        size_t cwnd, inflight_bytes = 0;
+        bool slow_start = true;
+        uint32_t round_end = 0;          // 本轮最后发出的序号，确认到它时完成一轮
+        double round_min = 0;            // 本轮RTT样本的最小值
+        uint64_t retransmits = 0;
+        Outbound();
+    };
+    // 接收方向（对端 -> 本端）
+    struct Inbound {
+        uint32_t cum = 0;                          // 已连续收到的最大序号
+        std::map<uint32_t, uint32_t> ranges;       // cum之后收到的区间 first -> last（空缺保留到补齐或发送端放弃）
+        uint32_t highest = 0;
+        uint32_t read = 0;
+        uint32_t unacked = 0;                      // 上次回执之后收到的消息数
+        bool dirty = false;
+        Clock::time_point first_unacked;
+    };
+    struct Out {
+        uint32_t peer, seq;
+        uint8_t type;
+        Producer make;
+    };
+
+    static bool seen(const Inbound& in, uint32_t seq);
+    static void record(Inbound& in, uint32_t seq);
+    void pump(uint32_t peer, Outbound& o, Clock::time_point now, std::vector<Out>& out);
+    void rtt_sample(Outbound& o, double r, Clock::time_point now);
+    void on_round(Outbound& o);
+    std::vector<uint8_t> build_receipt(uint32_t peer, Inbound& in, uint32_t include = 0);
+    std::vector<uint8_t> build_skip(uint32_t peer, const std::set<uint32_t>& seqs);
+    void drop_locked(uint32_t peer, std::vector<std::pair<uint32_t, uint32_t>>& failed, std::vector<FailFn>& fails);
+    void transmit(std::vector<Out>& out);
+
+    SendFn send;
+    ReceiptFn notify;
+    std::mutex mtx;
+    std::map<uint32_t, Outbound> outbound;
+    std::map<uint32_t, Inbound> inbound;
+};
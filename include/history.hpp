@@ -0,0 +1,155 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <optional>
+#include <unordered_map>
+
+// 只读内存映射文件（Windows用CreateFileMapping，其他平台用mmap）
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile(){ unmap(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool map(const std::string& path);  // 映射文件当前的全部内容
+    void unmap();
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return len; }
+
+private:
+    const uint8_t* ptr = nullptr;
+    size_t len = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+// 一条历史消息
+struct HistoryRecord {
+    uint64_t index = 0;     // 在本会话中的序号
+    uint64_t ts_ms = 0;     // 毫秒时间戳
+    uint32_t sender = 0;    // HISTORY_SELF表示本端发出，否则为收到时对端的ID
+    std::string text;       // UTF-8
+};
+static constexpr uint32_t HISTORY_SELF = 0;
+
+// 单个会话的本地消息历史，会话以对端的稳定身份命名（服务器分配的ID每次连接都会变化）
+// 文件布局：
+//   conv_<key>.log        消息正文，依次拼接（只追加）
+//   conv_<key>.idx        定长索引项 [ts_ms:8][sender:4][len:4][offset:8]，按序号排列，可按时间二分查找（只追加）
+//   conv_<key>.<first>.pst 倒排表段，覆盖序号 [first, end) 的消息，内存映射后直接查询：
+//       [magic:4][version:4][first:4][end:4][terms:8][postings:8]
+//       + terms*[词元哈希:8][起始位置:4][数量:4]（按哈希排序） + postings*[序号:4]
+// 最近追加的消息的倒排表留在内存中，满TAIL_FLUSH_MESSAGES条或关闭时写成新段；
+// 相邻两段中后一段不小于前一段时把两段合并（与二进制计数相同，段数为对数级），合并在后台线程进行，
+// append最多被写出一个尾部段阻塞；打开时只需重建未写入段的尾部
+class HistoryStore {
+public:
+    HistoryStore() = default;
+    ~HistoryStore(){ close(); }
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    bool open(const std::string& dir, const std::string& key);
+    void close();
+
+    bool append(uint64_t ts_ms, uint32_t sender, const std::string& text);
+    size_t size() const;
+
+    // 分页读取：返回序号在 [end-count, end) 内的消息（按时间正序），end超过总数时按总数计
+    std::vector<HistoryRecord> load_page(size_t end, size_t count) const;
+    // 第一条时间戳 >= ts_ms 的消息序号
+    size_t lower_bound_time(uint64_t ts_ms) const;
+    // 全文检索，返回最新的至多limit条匹配（按时间倒序）；指定sender时只匹配该发送者（HISTORY_SELF为本端发出的消息）
+    std::vector<HistoryRecord> search(const std::string& query, size_t limit, std::optional<uint32_t> sender = std::nullopt) const;
+
+    static constexpr size_t TAIL_FLUSH_MESSAGES = 64 * 1024;
+
+private:
+#pragma pack(push,1)
+    struct IndexEntry {
+        uint64_t ts_ms;
+        uint32_t sender;
+        uint32_t len;
+        uint64_t offset;
+    };
+    struct SegmentHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t first;
+        uint32_t end;
+        uint64_t terms;
+        uint64_t postings;
+    };
+    struct SegmentTerm {
+        uint64_t hash;
+        uint32_t start;
+        uint32_t count;
+    };
+#pragma pack(pop)
+    struct Segment {
+        std::string path;
+        uint32_t first = 0, end = 0;
+        uint64_t terms = 0;
+        MappedFile map;
+        const uint32_t* postings() const { return (const uint32_t*)(map.data() + sizeof(SegmentHeader) + terms * sizeof(SegmentTerm)); }
+        SegmentTerm term_at(size_t i) const;
+        bool find(uint64_t h, const uint32_t*& p, size_t& n) const;
+    };
+    struct PostingSpan {
+        const uint32_t* p;
+        size_t n;
+    };
+    using PostingList = std::vector<PostingSpan>;   // 按序号递增的若干段
+
+    void index_tokens(uint32_t idx, const char* text, size_t len);
+    std::string segment_path(uint32_t first) const;
+    uint32_t load_segments();
+    bool flush_tail();
+    size_t merge_candidate() const;
+    void start_merges();
+    void merge_loop();
+    bool write_merged(const Segment& a, const Segment& b, const std::string& tmp_path, SegmentHeader& hdr) const;
+    bool install_merged(Segment* a, Segment* b, const std::string& tmp_path, const SegmentHeader& hdr);
+    PostingList lookup(uint64_t h) const;
+    bool ensure_mapped(uint64_t log_end, uint64_t idx_end) const;
+    IndexEntry entry_at(size_t i) const;
+    HistoryRecord record_at(size_t i) const;
+
+    mutable std::mutex mtx;
+    std::string base_path, log_path, idx_path;
+    FILE* log_out = nullptr;
+    FILE* idx_out = nullptr;
+    uint64_t log_size = 0;
+    uint64_t count = 0;
+    mutable bool dirty = false;
+    mutable MappedFile log_map, idx_map;
+    std::vector<std::unique_ptr<Segment>> segments;                // 按序号顺序，首尾相接
+    std::unordered_map<uint64_t, std::vector<uint32_t>> postings;  // 尚未写入段的消息：词元哈希 -> 消息序号（递增）
+    uint32_t tail_first = 0;                                       // postings覆盖 [tail_first, count)
+    std::thread merger;                                            // 后台合并线程（有待合并的段时才运行）
+    bool merging = false, stopping = false;
+};
+
+// 切分词元：ASCII字母数字串转小写为一个词，其余非ASCII字符（如汉字）每个字符一个词
+void history_tokenize(const char* text, size_t len, std::vector<std::string>& out);
+
+// 当前毫秒时间戳
+uint64_t history_now_ms();
+
+// 本端的稳定身份（8字节随机数的十六进制），首次调用时生成并保存在dir/self.id
+// 客户端首次给某对端发消息前用MT_HELLO告知对端，对端以此作为会话的key
+std::string history_self_identity(const std::string& dir);
+
+// 删除一个会话的全部文件（会话须已关闭）
+void history_remove(const std::string& dir, const std::string& key);
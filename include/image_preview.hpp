@@ -0,0 +1,99 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+
+// 图片预览流水线（与平台无关部分）：解码在工作线程完成，只缓存缩小后的图像
+
+static constexpr uint32_t THUMB_DIM   = 160;   // 缩略图最长边
+static constexpr uint32_t PREVIEW_DIM = 1024;  // 预览图最长边
+
+// 32位BGRA像素，自上而下逐行存放（可直接作为GDI的32位DIB使用）
+struct Image {
+    uint32_t width = 0, height = 0;
+    std::vector<uint8_t> pixels;
+    size_t bytes() const { return pixels.size(); }
+};
+
+// 按比例缩小到 max_w x max_h 以内（区域平均），图像本身更小时原样返回
+Image downscale_image(const Image& src, uint32_t max_w, uint32_t max_h);
+
+// 解码未压缩的24/32位BMP
+bool decode_bmp(const uint8_t* data, size_t len, Image& out);
+
+// 解码器：读取path并输出最长边不超过max_dim的图像（解码器可自行先缩小以节省内存）
+using ImageDecoder = std::function<bool(const std::string& path, uint32_t max_dim, Image& out)>;
+
+// 与平台无关的默认解码器（仅支持BMP）
+bool decode_bmp_file(const std::string& path, uint32_t max_dim, Image& out);
+
+// 预览缓存的key：图片内容的SHA-256（内容由对端决定，较短的哈希可被构造碰撞，使一张图片显示为另一张的预览）
+using PreviewKey = std::array<uint8_t, 32>;
+struct PreviewKeyHasher {
+    size_t operator()(const PreviewKey& k) const { size_t v; memcpy(&v, k.data(), sizeof(v)); return v; }
+};
+bool hash_file(const std::string& path, PreviewKey& out);
+
+// 同一图片的两种尺寸
+struct PreviewImages {
+    std::shared_ptr<const Image> thumb;
+    std::shared_ptr<const Image> preview;
+    size_t bytes() const { return (thumb ? thumb->bytes() : 0) + (preview ? preview->bytes() : 0); }
+};
+
+// 按内容哈希索引的LRU缓存，容量按字节计
+class PreviewCache {
+public:
+    explicit PreviewCache(size_t max_bytes): cap(max_bytes) {}
+    std::shared_ptr<const PreviewImages> get(const PreviewKey& key);
+    void put(const PreviewKey& key, std::shared_ptr<const PreviewImages> v);
+    size_t bytes() const;
+    size_t size() const;
+
+private:
+    using Entry = std::pair<PreviewKey, std::shared_ptr<const PreviewImages>>;
+    mutable std::mutex mtx;
+    std::list<Entry> lru;  // 头部为最近使用
+    std::unordered_map<PreviewKey, std::list<Entry>::iterator, PreviewKeyHasher> map;
+    size_t used = 0;
+    size_t cap;
+};
+
+// 固定大小的解码线程池；同一内容的并发请求只解码一次
+class PreviewPipeline {
+public:
+    // 回调在工作线程（缓存命中时在调用线程）执行，解码失败时参数为空
+    using Callback = std::function<void(const PreviewKey& key, std::shared_ptr<const PreviewImages>)>;
+
+    PreviewPipeline(ImageDecoder decoder, size_t cache_bytes, unsigned workers);
+    ~PreviewPipeline();
+    PreviewPipeline(const PreviewPipeline&) = delete;
+    PreviewPipeline& operator=(const PreviewPipeline&) = delete;
+
+    void request(const PreviewKey& key, const std::string& path, Callback cb);
+    PreviewCache& cache() { return lru; }
+
+private:
+    struct Job { PreviewKey key; std::string path; };
+    void worker_loop();
+
+    ImageDecoder decode;
+    PreviewCache lru;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    std::unordered_map<PreviewKey, std::vector<Callback>, PreviewKeyHasher> waiting;  // 正在解码的内容 -> 等待的回调
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <deque>
+#include <map>
+#include <utility>
+
+#include "mpsc_queue.hpp"
+
+// 日志视图的数据部分（与平台无关，GUI客户端和relay_sim的界面吞吐测试共用）
+// 接收线程只投递事件，界面线程按帧取出合并：同一传输的进度只占一行，内存中最多保留max_lines行
+class LogBuffer {
+public:
+    explicit LogBuffer(size_t max_lines): cap(max_lines) {}
+
+    // 追加一行（任意线程）
+    void append(std::wstring text){
+        Event ev;
+        ev.text = std::move(text);
+        events.push(std::move(ev));
+    }
+    // 更新某个传输的进度行（任意线程）；done为该进度行的最后一次更新
+    void progress(const std::string& key, std::wstring text, bool done){
+        Event ev;
+        ev.progress = true;
+        ev.done = done;
+        ev.key = key;
+        ev.text = std::move(text);
+        events.push(std::move(ev));
+    }
+
+    // 以下只由界面线程调用
+    // 取出全部事件合并，返回是否有变化；evicted为本次从头部淘汰的行数
+    bool drain(size_t& evicted){
+        uint64_t old_first = first;
+        bool changed = false;
+        Event ev;
+        while(events.pop(ev)){
+            changed = true;
+            if(ev.progress){
+                auto it = progress_lines.find(ev.key);
+                bool visible = it != progress_lines.end() && it->second >= first;
+                if(visible) lines[(size_t)(it->second - first)] = std::move(ev.text);
+                if(ev.done){
+                    if(it != progress_lines.end()) progress_lines.erase(it);
+                } else if(!visible){
+                    progress_lines[ev.key] = first + lines.size();
+                }
+                if(visible) continue;
+            }
+            lines.push_back(std::move(ev.text));
+            if(lines.size() > cap){
+                lines.pop_front();
+                first++;
+            }
+        }
+        evicted = (size_t)(first - old_first);
+        return changed;
+    }
+    size_t size() const { return lines.size(); }
+    const std::wstring& line(size_t i) const { return lines[i]; }
+
+private:
+    struct Event {
+        bool progress = false;
+        bool done = false;
+        std::string key;
+        std::wstring text;
+    };
+    MpscQueue<Event> events;
+    size_t cap;
+    std::deque<std::wstring> lines;
+    uint64_t first = 0;                               // lines.front()的绝对行号
+    std::map<std::string, uint64_t> progress_lines;   // 传输标识 -> 进度行绝对行号
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+// 无锁多生产者单消费者队列（Vyukov链表式）
+// push可在任意线程调用；pop只能由唯一的消费者线程调用
+template<typename T>
+class MpscQueue {
+public:
+    MpscQueue(){
+        Node* stub = new Node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+    ~MpscQueue(){
+        T v;
+        while(pop(v)) {}
+        delete tail;
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T v){
+        Node* n = new Node();
+        n->value = std::move(v);
+        Node* prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    // 队列为空（或生产者正在链接新节点）时返回false
+    bool pop(T& out){
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if(!next) return false;
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        T value{};
+    };
+    std::atomic<Node*> head;
+    Node* tail;
+};
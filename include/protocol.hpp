@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <cstring>
 #include <string>
 
 // 协议魔数
@@ -24,5 +25,31 @@ enum : uint8_t {
     MT_FILE_CHUNK = 3,
     MT_ACK = 4,
     MT_INVALID_SEMANTIC = 5,
-    MT_HEARTBEAT = 6
+    MT_HEARTBEAT = 6,
+    MT_THROTTLED = 7,   // 服务器限速通知：载荷为 [被限速的msg_type:1][建议重试等待毫秒:4]
+    // 去重文件传输（载荷前4字节与其他转发消息相同，为目标/发送者ID）
+    MT_FILE_MANIFEST = 8,  // 文件清单：[xfer_id:4][name_len:2][name][size:8][count:4] + count*[sha256:32][len:4]
+    MT_CHUNK_REQUEST = 9,  // 请求缺少的分块：[xfer_id:4][count:4] + count*[sha256:32]
+    MT_CHUNK_DATA = 10,    // 分块数据：[xfer_id:4][sha256:32][data]
+    MT_HANDSHAKE = 11,     // 加密握手（客户端与服务器之间，不转发），见secure_channel.hpp
+    MT_RECEIPT = 12,       // 送达/已读回执：[delivered_cum:4][read_cum:4][count:2] + count*[first:4][last:4]，见delivery.hpp
+    MT_HELLO = 13,         // 客户端的稳定身份：[identity:16]（十六进制），首次给某对端发消息前发送，对端据此命名会话历史
+    MT_SKIP = 14           // 发送端放弃重传的序号：[count:2] + count*[seq:4]，接收端不再等待这些空缺，见delivery.hpp
 };
+
+// 报文标志
+static constexpr uint16_t FLAG_ENCRYPTED = 0x0001;   // 载荷已加密并附16字节认证标签，crc32不使用
+static constexpr uint16_t FLAG_SEQ       = 0x0002;   // 载荷在目标/发送者ID之后带[seq:4]，接收端用MT_RECEIPT确认（服务器转发时保留）
+
+// 单帧载荷上限（含认证标签）：最大的报文是清单（最多MAX_MANIFEST_CHUNKS个分块，见dedup.hpp），
+// 其余报文都不超过一个分块加几十字节的头；接收方在分配缓冲区之前检查，超过时断开连接
+static constexpr uint32_t MAX_PAYLOAD_BYTES = 8 * 1024 * 1024;
+
+// 目标不在线时服务器回复的MT_INVALID_SEMANTIC载荷："target_not_online"[target:4]，客户端据此清理与该对端的收发状态
+static constexpr char TARGET_OFFLINE_TAG[] = "target_not_online";
+inline bool parse_target_offline(const uint8_t* p, size_t n, uint32_t& target){
+    size_t k = sizeof(TARGET_OFFLINE_TAG) - 1;
+    if(n != k + 4 || memcmp(p, TARGET_OFFLINE_TAG, k) != 0) return false;
+    memcpy(&target, p + k, 4);
+    return true;
+}
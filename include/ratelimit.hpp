@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+
+// 令牌桶限速器（rate为每秒补充的令牌数，burst为桶容量；rate<=0表示不限速）
+struct TokenBucket {
+    double rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+    TokenBucket() = default;
+    TokenBucket(double r, double b): rate(r), burst(b), tokens(b) {}
+
+    // 按流逝时间补充令牌
+    void refill(std::chrono::steady_clock::time_point now){
+        double dt = std::chrono::duration<double>(now - last).count();
+        last = now;
+        tokens = std::min(burst, tokens + dt * rate);
+    }
+
+    // 尝试取出n个令牌（n超过桶容量时按桶容量计，避免大帧永远无法通过）
+    bool try_take(double n, std::chrono::steady_clock::time_point now){
+        if(rate <= 0) return true;
+        refill(now);
+        n = std::min(n, burst);
+        if(tokens < n) return false;
+        tokens -= n;
+        return true;
+    }
+
+    // 距离可以取出n个令牌还需等待的毫秒数
+    uint32_t wait_ms(double n) const {
+        if(rate <= 0) return 0;
+        n = std::min(n, burst);
+        if(tokens >= n) return 0;
+        return (uint32_t)((n - tokens) * 1000.0 / rate) + 1;
+    }
+};
+
+// 一类流量的预算：消息数/秒 + 字节数/秒
+struct TrafficBudget {
+    TokenBucket msgs;
+    TokenBucket bytes;
+
+    TrafficBudget() = default;
+    TrafficBudget(double msg_rate, double msg_burst, double byte_rate, double byte_burst)
+        : msgs(msg_rate, msg_burst), bytes(byte_rate, byte_burst) {}
+
+    // 两个桶都满足时才扣除，失败时不消耗任何令牌
+    bool try_take(size_t frame_bytes, std::chrono::steady_clock::time_point now){
+        msgs.refill(now); bytes.refill(now);
+        if(msgs.wait_ms(1) || bytes.wait_ms((double)frame_bytes)) return false;
+        msgs.try_take(1, now);
+        bytes.try_take((double)frame_bytes, now);
+        return true;
+    }
+
+    uint32_t wait_ms(size_t frame_bytes) const {
+        return std::max(msgs.wait_ms(1), bytes.wait_ms((double)frame_bytes));
+    }
+};
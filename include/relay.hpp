@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+class TraceWriter;
+struct ServerIdentity;
+
+// 传输层抽象：服务器使用TCP套接字，relay_sim使用内存管道，转发逻辑与具体传输无关
+class Transport {
+public:
+    virtual ~Transport() = default;
+    virtual bool recv_all(void* buf, size_t len) = 0;
+    virtual bool send_all(const void* buf, size_t len) = 0;
+    virtual void shutdown() = 0;   // 关闭连接，使阻塞中的收发返回false
+};
+
+// 转发选项（在第一个连接到来之前设置）
+struct RelayOptions {
+    bool rate_limit = true;          // 按会话限速
+    double file_bytes_per_sec = 8 * 1024 * 1024;   // 限速时每个会话文件流量的字节速率上限
+    bool log_forward = true;         // 每条转发消息打印日志
+    TraceWriter* trace = nullptr;    // 非空时录制收到的每一帧
+    const ServerIdentity* identity = nullptr;  // 非空时接受客户端的加密握手
+};
+void relay_configure(const RelayOptions& opt);
+
+// 处理一个客户端连接直到断开（阻塞，调用方为每个连接开一个线程）
+void relay_client(std::shared_ptr<Transport> conn);
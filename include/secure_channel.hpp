@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "protocol.hpp"
+#include "crypto.hpp"
+
+// 加密传输：服务器发送ACK分配ID之后，客户端发起握手，此后该连接双向加密
+//   客户端 -> 服务器  MT_HANDSHAKE [e_c:32]
+//   服务器 -> 客户端  MT_HANDSHAKE [e_s:32][S_s:32][confirm:16]
+// 握手记录 T = SHA-256(标签 || 客户端ID || e_c || e_s || S_s)
+// 密钥 = HKDF(盐=T, DH(e_c,e_s) || DH(e_c,S_s))，上行/下行各一个
+// confirm为服务器用下行密钥（序号0）对T的认证标签，证明服务器持有S_s的私钥
+// 客户端记录首次见到的服务器公钥，之后公钥变化则拒绝连接（与SSH相同的首次信任）
+//
+// 加密帧：头部明文（flags含FLAG_ENCRYPTED，crc32为0，payload_len含16字节标签），作为附加数据参与认证；
+// 载荷原地加密，标签附在末尾。AEAD已保证完整性，加密帧不再计算CRC32。
+// 每个方向的随机数为64位递增序号，不随报文传输（TCP保证顺序）
+
+// 客户端复用的发送缓冲区超过该容量（偶尔的大清单）时发完即释放
+static constexpr size_t SEND_BUFFER_KEEP = 1024 * 1024;
+
+struct CipherState {
+    uint8_t key[AEAD_KEY_BYTES];
+    uint64_t seq = 0;
+
+    // frame为[头部][明文载荷]：改写头部、原地加密并在末尾追加标签（预留AEAD_TAG_BYTES容量时不重新分配）
+    void seal(std::vector<uint8_t>& frame);
+    // 由头部和明文载荷直接生成加密帧：frame = [头部][密文][标签]，载荷边加密边写入frame
+    // （frame可在多次调用间复用，容量足够时不重新分配）
+    void seal_into(AppHeader hdr, const uint8_t* payload, size_t len, std::vector<uint8_t>& frame);
+    // hdr为收到的头部，data为[密文][标签]：认证并原地解密，成功时plain_len为明文长度
+    bool open(const AppHeader& hdr, uint8_t* data, uint32_t& plain_len);
+};
+
+// 服务器长期密钥（私钥保存在文件中，首次启动时生成）
+struct ServerIdentity {
+    uint8_t priv[X25519_BYTES];
+    uint8_t pub[X25519_BYTES];
+    bool generate();
+    // 读取密钥文件，文件不存在时生成并写入；文件存在但长度不对或内容为全零时失败（err给出原因），不改动该文件
+    bool load_or_create(const std::string& path, std::string& err);
+};
+
+// 服务器：处理客户端握手载荷，生成回复载荷和两个方向的密钥
+bool handshake_respond(const ServerIdentity& id, uint32_t client_id, const uint8_t* hello, size_t len,
+                       std::vector<uint8_t>& reply, CipherState& rx, CipherState& tx);
+
+// 客户端：读取服务器分配的ID并完成握手（阻塞，在启动接收线程之前调用）
+// pin_path为记录服务器公钥的文件，为空时不检查；失败时err给出原因
+using ChannelRecv = std::function<bool(void* buf, size_t len)>;
+using ChannelSend = std::function<bool(const void* buf, size_t len)>;
+bool client_handshake(const ChannelRecv& recv_fn, const ChannelSend& send_fn, const std::string& pin_path,
+                      uint32_t& my_id, CipherState& tx, CipherState& rx, std::string& err);
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// SHA-256（可增量计算）
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t length);
+    void final(uint8_t out[32]);
+private:
+    void block(const uint8_t* p);
+    uint32_t h[8];
+    uint8_t buf[64];
+    size_t buf_len = 0;
+    uint64_t total = 0;
+};
+
+void sha256_calc(const void* data, size_t length, uint8_t out[32]);
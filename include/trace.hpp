@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+
+#include "protocol.hpp"
+
+// 流量录制文件（服务器 --capture 生成，replay / relay_sim 读取）
+// 文件头：[magic:4][version:2][reserved:2]
+// 记录：  [kind:1][距上一条记录的微秒数:varint][连接ID:varint]，kind为TR_FRAME时后跟收到的完整报文（头部+载荷）
+static constexpr uint32_t TRACE_MAGIC = 0x5254434C;  // "LCTR"
+static constexpr uint16_t TRACE_VERSION = 1;
+
+enum TraceKind : uint8_t {
+    TR_CONNECT = 1,
+    TR_FRAME = 2,
+    TR_DISCONNECT = 3,
+};
+
+struct TraceRecord {
+    uint8_t kind = 0;
+    uint64_t t_us = 0;            // 距录制开始的微秒数
+    uint32_t conn = 0;            // 录制时服务器分配的客户端ID
+    std::vector<uint8_t> frame;   // TR_FRAME：报文原样（含原始CRC）
+};
+
+// 录制器：多个连接线程并发写入，带缓冲，约每秒刷新一次
+class TraceWriter {
+public:
+    ~TraceWriter();
+    bool open(const std::string& path);
+    void close();
+
+    void connect(uint32_t conn);
+    void disconnect(uint32_t conn);
+    void frame(uint32_t conn, const AppHeader& hdr, const uint8_t* payload);
+
+private:
+    void begin(uint8_t kind, uint32_t conn);   // 调用方持有mtx
+    void maybe_flush();
+
+    std::mutex mtx;
+    FILE* fp = nullptr;
+    std::vector<char> buf;
+    std::chrono::steady_clock::time_point last, last_flush;
+};
+
+// 读取整个录制文件，文件尾部不完整的记录被忽略
+bool read_trace(const std::string& path, std::vector<TraceRecord>& out);
+
+// 把录制中的连接ID按首次出现顺序轮流映射到n个合成连接
+std::map<uint32_t, size_t> trace_assign_slots(const std::vector<TraceRecord>& recs, size_t n);
+
+// 改写报文的目标ID（载荷前4字节）并重新计算CRC
+void retarget_frame(std::vector<uint8_t>& frame, uint32_t target);
+
+// 录制中的加密握手帧（旧版服务器会录制）：回放连接是明文的，回放时跳过
+bool trace_is_handshake(const TraceRecord& r);
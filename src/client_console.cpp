@@ -3,16 +3,89 @@
 #include <ws2tcpip.h>
 #include <iostream>
 #include <thread>
+#include <chrono>
 #include <vector>
 #include <string>
 #include <cstring>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
 
 #include "../include/protocol.hpp"
-#include "../include/crc32.hpp"
+#include "../include/secure_channel.hpp"
 #include "../include/utils.hpp"
+#include "../include/history.hpp"
+#include "../include/dedup.hpp"
+#include "../include/delivery.hpp"
 
 #pragma comment(lib, "ws2_32.lib")
 
+// 本地消息历史（按对端的稳定身份分会话，服务器分配的ID每次连接都会变化）
+static std::atomic<uint32_t> myid{0};
+static std::mutex hist_mtx;
+static std::string self_ident;                      // 本端身份，首次给对端发消息前用MT_HELLO告知
+static std::map<uint32_t, std::string> peer_ident;  // 对端ID -> 对端身份
+static std::set<uint32_t> hello_sent;
+static std::map<std::string, std::shared_ptr<HistoryStore>> histories;
+
+static uint64_t session_ms = history_now_ms();
+
+// 会话key：对端身份未知（对方的MT_HELLO还未到达）时用本次运行内唯一的临时key，得知身份后并入正式会话
+std::string fallback_key(uint32_t peer) {
+    return "tmp" + std::to_string(session_ms) + "_" + std::to_string(peer);
+}
+std::string conv_key(uint32_t peer) {
+    auto it = peer_ident.find(peer);
+    return it != peer_ident.end() ? it->second : fallback_key(peer);
+}
+
+// 返回共享指针：得知对端身份时临时会话会被并入正式会话并移除，调用方持有期间仍然有效
+std::shared_ptr<HistoryStore> open_history(const std::string& key) {
+    auto& h = histories[key];
+    if(!h){
+        h = std::make_shared<HistoryStore>();
+        if(!h->open("history", key)) std::cout << "history open failed\n";
+    }
+    return h;
+}
+std::shared_ptr<HistoryStore> history_for(uint32_t peer) {
+    std::lock_guard<std::mutex> lk(hist_mtx);
+    return open_history(conv_key(peer));
+}
+
+// 收到对端身份：记录下来，之前记在临时会话中的消息并入正式会话
+void learn_identity(uint32_t peer, const std::string& ident) {
+    std::lock_guard<std::mutex> lk(hist_mtx);
+    peer_ident[peer] = ident;
+    auto it = histories.find(fallback_key(peer));
+    if(it == histories.end()) return;
+    auto h = open_history(ident);
+    for(auto& r : it->second->load_page(SIZE_MAX, SIZE_MAX)) h->append(r.ts_ms, r.sender, r.text);
+    it->second->close();
+    histories.erase(it);
+    history_remove("history", fallback_key(peer));
+}
+
+// 去重文件传输（接收线程会代发分块，发送需加锁保证报文不交错）
+static std::mutex send_mtx;
+static std::unique_ptr<DedupTransfer> transfers;
+
+// 送达回执与分块发送窗口（定时线程每10ms驱动一次）
+static std::unique_ptr<Delivery> delivery;
+
+// 握手得到的两个方向的密钥（tx_state在send_mtx下使用，rx_state只在接收线程中使用）
+static CipherState tx_state, rx_state;
+
+void print_history(const std::vector<HistoryRecord>& recs) {
+    for(auto& r : recs){
+        std::cout << "  #" << r.index << " [" << (r.sender == HISTORY_SELF ? std::string("me") : std::to_string(r.sender)) << "] " << r.text << "\n";
+    }
+    std::cout << std::flush;
+}
+
 // 发送/接收全部数据
 bool send_all(SOCKET s, const void* buf, int len) {
     const char* p = (const char*)buf; int rem=len;
@@ -33,12 +106,63 @@ bool recv_all(SOCKET s, void* buf, int len) {
     return true;
 }
 
+// 发送报文（头部与载荷放在同一缓冲区原地加密后一次发送；序号必须与发送顺序一致，加密在锁内进行）
+bool send_packet(SOCKET s, uint8_t type, const std::vector<uint8_t>& payload, uint16_t flags = 0) {
+    AppHeader h{};
+    h.magic=PROTO_MAGIC;
+    h.version=1;
+    h.msg_type=type;
+    h.flags=flags;
+    h.payload_len=(uint32_t)payload.size();
+    h.crc32=0;
+
+    // 发送缓冲区在锁内复用，载荷直接加密写入其中（不先拷贝明文）；偶尔的大清单发完后释放
+    static std::vector<uint8_t> frame;
+    std::lock_guard<std::mutex> lk(send_mtx);
+    tx_state.seal_into(h, payload.data(), payload.size(), frame);
+    bool ok = send_all(s, frame.data(), (int)frame.size());
+    if(frame.capacity() > SEND_BUFFER_KEEP) std::vector<uint8_t>().swap(frame);
+    return ok;
+}
+
+// 首次给对端发消息前告知本端身份（每个对端每次连接一次）
+void send_hello(SOCKET s, uint32_t peer) {
+    {
+        std::lock_guard<std::mutex> lk(hist_mtx);
+        if(self_ident.empty() || !hello_sent.insert(peer).second) return;
+    }
+    std::vector<uint8_t> p(4 + self_ident.size());
+    memcpy(p.data(), &peer, 4);
+    memcpy(p.data() + 4, self_ident.data(), self_ident.size());
+    send_packet(s, MT_HELLO, p);
+}
+
+// 去重传输状态：开始接收和完成时打印
+void on_transfer_status(const TransferStatus& st) {
+    if(st.sending){
+        std::cout << "[FILE] send to " << st.peer << " name=" << st.name << " failed" << std::endl;
+    } else if(st.done){
+        std::cout << "[FILE] from " << st.peer << " name=" << st.name << " size=" << st.size
+                  << " fetched=" << st.fetched << (st.ok ? " -> " + st.out : std::string(" failed")) << std::endl;
+    } else if(st.fetched == 0){
+        std::cout << "[FILE_MANIFEST] from " << st.peer << " name=" << st.name << " size=" << st.size
+                  << " local=" << st.have << std::endl;
+    }
+}
+
+// 文本回执：同一批中既送达又已读时只报告已读
+void on_receipt_status(uint32_t peer, uint32_t seq, ReceiptState st) {
+    const char* s = st == ReceiptState::READ ? "read" : st == ReceiptState::DELIVERED ? "delivered" : "NOT delivered";
+    std::cout << "[RECEIPT] #" << seq << " to " << peer << " " << s << std::endl;
+}
+
 // 接收循环函数
 void recv_loop(SOCKET sock) {
     while(true) {
         AppHeader hdr;
         if(!recv_all(sock, &hdr, sizeof(hdr))) break;
         if(hdr.magic != PROTO_MAGIC){ std::cout<<"bad magic\n"; break; }
+        if(hdr.payload_len > MAX_PAYLOAD_BYTES){ std::cout<<"frame too large\n"; break; }
 
         // 处理不同消息类型
         std::vector<uint8_t> payload;
@@ -46,14 +170,39 @@ void recv_loop(SOCKET sock) {
             payload.resize(hdr.payload_len);
             if(!recv_all(sock, payload.data(), hdr.payload_len)) break;
         }
+        // 握手之后服务器发来的每一帧都必须通过认证，否则连接已不可信
+        uint32_t plain_len;
+        if(!rx_state.open(hdr, payload.data(), plain_len)){ std::cout<<"authentication failed\n"; break; }
+        payload.resize(plain_len);
+        hdr.payload_len = plain_len;
+        // 带序号的消息：丢弃重复的，记录回执，去掉序号后按普通消息处理
+        if(hdr.flags & FLAG_SEQ) {
+            if(payload.size() < 8){ std::cout<<"bad sequenced message\n"; continue; }
+            uint32_t sender, seq;
+            memcpy(&sender, payload.data(), 4);
+            memcpy(&seq, payload.data()+4, 4);
+            if(!delivery->on_sequenced(sender, seq)) continue;
+            payload.erase(payload.begin()+4, payload.begin()+8);
+            hdr.payload_len -= 4;
+        }
         if(hdr.msg_type == MT_TEXT) {
             if(payload.size() < 4){ std::cout<<"[TEXT] malformed\n"; continue; }
             uint32_t sender; memcpy(&sender, payload.data(), 4);
             std::string s((char*)payload.data()+4, payload.size()-4);
             std::cout << "[" << sender << "] " << s << std::endl;
+            history_for(sender)->append(history_now_ms(), sender, s);
+            delivery->mark_read(sender);   // 控制台打印即视为已读
+        } else if(hdr.msg_type == MT_HELLO) {
+            if(payload.size() != 4 + 16) continue;
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            std::string ident((char*)payload.data()+4, 16);
+            if(ident.find_first_not_of("0123456789abcdef") != std::string::npos) continue;
+            learn_identity(sender, ident);
+            send_hello(sock, sender);
         } else if(hdr.msg_type == MT_ACK) {
             if(payload.size()==4) {
                 uint32_t id; memcpy(&id, payload.data(), 4);
+                myid = id;
                 std::cout << "[ACK] assigned id=" << id << std::endl;
             } else {
                 std::string s((char*)payload.data(), payload.size());
@@ -78,8 +227,32 @@ void recv_loop(SOCKET sock) {
             std::string out = "recv_from_" + std::to_string(sender) + ".bin";
             write_file_from_vec(out, d, true);
             std::cout << "[FILE_CHUNK] from " << sender << " seq=" << seq << " len=" << chlen << " -> " << out << std::endl;
+        } else if(hdr.msg_type == MT_FILE_MANIFEST || hdr.msg_type == MT_CHUNK_REQUEST || hdr.msg_type == MT_CHUNK_DATA) {
+            if(payload.size() < 4){ std::cout<<"bad dedup message\n"; continue; }
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            transfers->on_message(hdr.msg_type, sender, payload.data()+4, payload.size()-4);
+        } else if(hdr.msg_type == MT_RECEIPT) {
+            if(payload.size() < 4) continue;
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            delivery->on_receipt(sender, payload.data()+4, payload.size()-4);
+        } else if(hdr.msg_type == MT_SKIP) {
+            if(payload.size() < 4) continue;
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            delivery->on_skip(sender, payload.data()+4, payload.size()-4);
         } else if(hdr.msg_type == MT_INVALID_SEMANTIC) {
+            // 目标不在线：该对端的ID不会再出现，结束与它的未完成收发
+            uint32_t gone;
+            if(parse_target_offline(payload.data(), payload.size(), gone)){
+                std::cout << "[INVALID_SEMANTIC] target " << gone << " not online\n";
+                delivery->drop_peer(gone);
+                transfers->drop_peer(gone);
+                continue;
+            }
             std::cout << "[INVALID_SEMANTIC]\n";
+        } else if(hdr.msg_type == MT_THROTTLED) {
+            if(payload.size() < 5){ std::cout<<"[THROTTLED]\n"; continue; }
+            uint32_t retry_ms; memcpy(&retry_ms, payload.data()+1, 4);
+            std::cout << "[THROTTLED] type=" << (int)payload[0] << " retry after " << retry_ms << "ms" << std::endl;
         } else {
             std::cout << "[MSG] type=" << (int)hdr.msg_type << " len=" << hdr.payload_len << std::endl;
         }
@@ -106,99 +279,83 @@ int main(){
         std::cerr<<"connect failed\n"; closesocket(sock); WSACleanup(); return 1;
     }
 
-    // 5. 启动接收线程（独立处理服务器消息）
+    // 5. 加密握手（读取分配的ID，校验服务器公钥）
+    std::string err;
+    uint32_t id = 0;
+    if(!client_handshake([sock](void* b, size_t l){ return recv_all(sock, b, (int)l); },
+                         [sock](const void* b, size_t l){ return send_all(sock, b, (int)l); },
+                         "known_server.pub", id, tx_state, rx_state, err)){
+        std::cerr<<"handshake failed: "<<err<<"\n"; closesocket(sock); WSACleanup(); return 1;
+    }
+    myid = id;
+    std::cout << "[ACK] assigned id=" << id << " (encrypted)" << std::endl;
+    self_ident = history_self_identity("history");
+    if(self_ident.empty()) std::cout << "history/self.id unreadable, peers will file our messages by id\n";
+
+    // 6. 启动接收线程（独立处理服务器消息）和回执/重传定时线程
+    delivery = std::make_unique<Delivery>(
+        [sock](uint8_t type, uint16_t flags, const std::vector<uint8_t>& p){ return send_packet(sock, type, p, flags); },
+        on_receipt_status);
+    transfers = std::make_unique<DedupTransfer>("chunks",
+        [sock](uint8_t type, const std::vector<uint8_t>& p){ return send_packet(sock, type, p); },
+        *delivery, on_transfer_status);
     std::thread r(recv_loop, sock);
-    // 6. 获取目标客户端ID
+    std::thread([]{
+        while(true){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            delivery->tick();
+            transfers->tick();
+        }
+    }).detach();
+    // 7. 获取目标客户端ID
     uint32_t target;
     std::cout << "target's client_id:";
     std::cin >> target;
     std::cin.ignore();
 
-    // 7. 主输入循环
+    // 8. 主输入循环
     std::string line;
     while(true){
         std::getline(std::cin, line);
         if(line == "/quit") break;
+        // /history [n]：显示与目标最近n条消息；/search [-me] <关键词>：检索与目标的历史（-me只检索本端发出的）
+        if(line == "/history" || line.rfind("/history ",0)==0){
+            int n = line.size() > 9 ? atoi(line.c_str()+9) : 20;
+            if(n <= 0) n = 20;
+            print_history(history_for(target)->load_page(SIZE_MAX, (size_t)n));
+            continue;
+        }
+        if(line.rfind("/search ",0)==0){
+            std::string q = line.substr(8);
+            std::optional<uint32_t> who;
+            if(q.rfind("-me ",0)==0){ who = HISTORY_SELF; q = q.substr(4); }
+            auto res = history_for(target)->search(q, 20, who);
+            std::cout << "found " << res.size() << " message(s)\n";
+            print_history(res);
+            continue;
+        }
+        // /link：到目标的RTT和发送窗口
+        if(line == "/link"){
+            LinkStats ls;
+            if(!delivery->stats(target, ls)){ std::cout<<"nothing sent yet\n"; continue; }
+            std::cout<<"rtt "<<ls.srtt_ms<<"ms (min "<<ls.min_rtt_ms<<"ms), window "<<ls.cwnd/1024<<"KB, in flight "
+                     <<ls.inflight/1024<<"KB, queued "<<ls.queued<<" chunk(s), retransmits "<<ls.retransmits<<"\n";
+            continue;
+        }
+        // /sendfile <路径>：只发送分块清单，对方按需请求本地没有的分块
         if(line.rfind("/sendfile ",0)==0){
             std::string path = line.substr(10);
-            std::vector<uint8_t> buf;
-            if(!read_file_to_vec(path, buf)){ std::cout<<"read file failed\n"; continue; }
-            std::string fname = path;
-            uint16_t name_len = (uint16_t)fname.size();
-            uint64_t fsize = buf.size();
-            std::vector<uint8_t> meta;
-            meta.resize(4 + 2 + name_len + 8);
-            memcpy(meta.data(), &target, 4);
-            memcpy(meta.data()+4, &name_len, 2);
-            memcpy(meta.data()+6, fname.data(), name_len);
-            memcpy(meta.data()+6+name_len, &fsize, 8);
-            
-            AppHeader h{}; 
-            h.magic=PROTO_MAGIC; 
-            h.version=1; 
-            h.msg_type=MT_FILE_META; 
-            h.payload_len=(uint32_t)meta.size(); 
-            h.crc32=0;
-
-            AppHeader tmp = h; 
-            tmp.crc32=0;
-            std::vector<uint8_t> pack(sizeof(tmp)+meta.size());
-            memcpy(pack.data(), &tmp, sizeof(tmp)); 
-            memcpy(pack.data()+sizeof(tmp), meta.data(), meta.size());
-            h.crc32 = crc32_calc(pack.data(), pack.size());
-            send_all(sock, &h, sizeof(h)); 
-            send_all(sock, meta.data(), (int)meta.size());
-            const size_t CHUNK = 4096; uint32_t seq=0;
-            for(size_t pos=0; pos<buf.size(); pos+=CHUNK){
-                size_t take = std::min(CHUNK, buf.size()-pos);
-                std::vector<uint8_t> chunk; chunk.resize(4+4+4+take);
-                memcpy(chunk.data(), &target, 4);
-                memcpy(chunk.data()+4, &seq, 4);
-                uint32_t chlen = (uint32_t)take;
-                memcpy(chunk.data()+8, &chlen, 4);
-                memcpy(chunk.data()+12, buf.data()+pos, take);
-                
-                AppHeader ch{}; 
-                ch.magic=PROTO_MAGIC; 
-                ch.version=1; 
-                ch.msg_type=MT_FILE_CHUNK; 
-                ch.payload_len=(uint32_t)chunk.size();
-                ch.crc32=0;
-
-                AppHeader tmp2=ch; 
-                tmp2.crc32=0;
-
-                std::vector<uint8_t> pack2(sizeof(tmp2)+chunk.size());
-                memcpy(pack2.data(), &tmp2, sizeof(tmp2)); 
-                memcpy(pack2.data()+sizeof(tmp2), chunk.data(), chunk.size());
-                ch.crc32 = crc32_calc(pack2.data(), pack2.size());
-                send_all(sock, &ch, sizeof(ch)); send_all(sock, chunk.data(), (int)chunk.size());
-                seq++;
-            }
-            std::cout<<"file send done\n";
+            TransferStatus st;
+            std::string err;
+            if(!transfers->send_file(target, path, st, err)){ std::cout<<err<<"\n"; continue; }
+            std::cout<<"file manifest sent: "<<st.name<<" size="<<st.size<<"\n";
             continue;
         }
         std::string utf8 = line;
-        std::vector<uint8_t> payload; payload.resize(4 + utf8.size());
-        memcpy(payload.data(), &target, 4);
-        if(!utf8.empty()) memcpy(payload.data()+4, utf8.data(), utf8.size());
-        
-        AppHeader h{}; 
-        h.magic=PROTO_MAGIC; 
-        h.version=1; 
-        h.msg_type=MT_TEXT; 
-        h.payload_len=(uint32_t)payload.size(); 
-        h.crc32=0;
-
-        AppHeader tmp = h; 
-        tmp.crc32=0;
-
-        std::vector<uint8_t> pack(sizeof(tmp)+payload.size());
-        memcpy(pack.data(), &tmp, sizeof(tmp)); 
-        memcpy(pack.data()+sizeof(tmp), payload.data(), payload.size());
-        h.crc32 = crc32_calc(pack.data(), pack.size());
-        send_all(sock, &h, sizeof(h));
-        if(h.payload_len) send_all(sock, payload.data(), (int)payload.size());
+        send_hello(sock, target);
+        uint32_t seq = delivery->send_text(target, MT_TEXT, (const uint8_t*)utf8.data(), utf8.size());
+        std::cout << "  (#" << seq << ")" << std::endl;
+        history_for(target)->append(history_now_ms(), HISTORY_SELF, utf8);
     }
 
     closesocket(sock); 
@@ -3,33 +3,86 @@
 #include <windows.h>
 #include <ws2tcpip.h>
 #include <commdlg.h>
-#include <gdiplus.h>
+#include <wincodec.h>
 #include <thread>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <atomic>
 #include <mutex>
 #include <map>
+#include <set>
+#include <memory>
+#include <deque>
 
 #include "../include/protocol.hpp"
-#include "../include/crc32.hpp"
+#include "../include/secure_channel.hpp"
 #include "../include/utils.hpp"
+#include "../include/history.hpp"
+#include "../include/log_buffer.hpp"
+#include "../include/image_preview.hpp"
+#include "../include/sha256.hpp"
+#include "../include/dedup.hpp"
+#include "../include/delivery.hpp"
 
 #pragma comment(lib, "ws2_32.lib")
-#pragma comment(lib, "gdiplus.lib")
-
-using namespace Gdiplus;
+#pragma comment(lib, "ole32.lib")
+#pragma comment(lib, "windowscodecs.lib")
 
 HWND hMain, hLog, hInput, hIP, hTarget;
-SOCKET g_sock = INVALID_SOCKET;
-std::atomic<bool> g_run{false};
+SOCKET g_sock = INVALID_SOCKET;              // 在send_mtx下替换，只由连接线程关闭
+SOCKET g_pending = INVALID_SOCKET;           // 正在连接或握手的套接字，在send_mtx下替换
+std::atomic<bool> g_quit{false};            // 窗口已关闭，不再安装新连接（在send_mtx下置位）
+std::thread g_conn_thread;                  // 连接线程，只在界面线程中启动和回收
+std::atomic<bool> g_run{false};             // 已连接，接收与定时线程运行中
+std::atomic<bool> g_connected{false};       // 连接中或已连接（旧连接的线程全部结束后才清除）
 uint32_t myid = 0;
 
 // 接收文件管理
 std::mutex incoming_mtx;
-struct Incoming { uint64_t expected=0, received=0; std::string out; };
+struct Incoming {
+    uint64_t expected=0, received=0;
+    std::string out, fname;
+    std::ofstream ofs;            // 传输期间保持打开，避免每块重新打开文件
+    uint32_t reported = UINT32_MAX; // 上次上报的进度（千分比）
+    bool is_image = false;
+    Sha256 hash;                  // 图片内容的SHA-256随分块增量计算，接收完成即可查预览缓存
+};
 std::map<std::string, Incoming> incoming;
 
+// 日志视图：接收线程只投递事件，界面线程按帧合并后刷新虚拟列表框
+static constexpr size_t MAX_LOG_LINES = 5000;  // 内存中保留的最多行数，更早的可通过/history查看
+static constexpr UINT UI_TIMER_ID = 1;
+static constexpr UINT UI_FLUSH_MS = 16;
+static constexpr int LOG_LINE_H = 18;
+LogBuffer log_view(MAX_LOG_LINES);
+
+// 本地消息历史（按对端的稳定身份分会话，服务器分配的ID每次连接都会变化）
+std::mutex hist_mtx;
+std::string self_ident;                      // 本端身份，首次给对端发消息前用MT_HELLO告知
+std::map<uint32_t, std::string> peer_ident;  // 对端ID -> 对端身份（每次连接清空）
+std::set<uint32_t> hello_sent;
+std::map<std::string, std::shared_ptr<HistoryStore>> histories;
+uint64_t session_ms = history_now_ms();
+
+// 图片预览：固定线程池解码，缓存缩小后的图像
+static constexpr UINT WM_APP_PREVIEW = WM_APP + 1;        // lParam: new std::shared_ptr<const Image>
+static constexpr size_t PREVIEW_CACHE_BYTES = 64 * 1024 * 1024;
+std::unique_ptr<PreviewPipeline> previews;
+
+// 去重文件传输（接收线程会代发分块，发送需加锁保证报文不交错）
+std::mutex send_mtx;
+std::unique_ptr<DedupTransfer> transfers;
+std::mutex dd_mtx;
+std::map<std::string, uint32_t> dd_reported;  // 传输标识 -> 上次上报的进度（千分比），接收线程和定时线程都会更新
+
+// 送达回执与分块发送窗口（连接后由定时线程每10ms驱动一次）
+// 与transfers都在启动时创建、退出前不再替换，界面线程可随时使用；断开时reset清除按对端的状态
+std::unique_ptr<Delivery> delivery;
+
+// 握手得到的两个方向的密钥（tx_state在send_mtx下使用，rx_state只在接收线程中使用）
+CipherState tx_state, rx_state;
+
 // 字符类型转换
 std::string w2u(const std::wstring &ws){
     if(ws.empty()) return {};
@@ -46,12 +99,74 @@ std::wstring u2w(const std::string &s){
     return w;
 }
 
-// 添加日志
+// 添加日志（任意线程可调用）
 void append_log(const std::wstring& t){
-    int len = GetWindowTextLengthW(hLog);
-    SendMessageW(hLog, EM_SETSEL, len, len);
-    std::wstring s = t + L"\r\n";
-    SendMessageW(hLog, EM_REPLACESEL, FALSE, (LPARAM)s.c_str());
+    log_view.append(t);
+}
+// 更新某个传输的进度行（同一key只占一行）
+void post_progress(const std::string& key, const std::wstring& t, bool done){
+    log_view.progress(key, t, done);
+}
+
+// 界面线程定时调用：取出全部事件合并为一次刷新
+void flush_ui_events(){
+    size_t old_count = log_view.size();
+    size_t evicted;
+    if(!log_view.drain(evicted)) return;
+
+    // 原本停在底部则自动滚到底，否则保持当前位置（扣除被淘汰的行）
+    int top = (int)SendMessageW(hLog, LB_GETTOPINDEX, 0, 0);
+    RECT rc; GetClientRect(hLog, &rc);
+    int rows = (rc.bottom - rc.top) / LOG_LINE_H;
+    bool at_bottom = top + rows >= (int)old_count;
+    top -= (int)evicted;
+    if(top < 0) top = 0;
+    SendMessageW(hLog, WM_SETREDRAW, FALSE, 0);
+    SendMessageW(hLog, LB_SETCOUNT, log_view.size(), 0);
+    SendMessageW(hLog, LB_SETTOPINDEX, at_bottom ? log_view.size() - 1 : top, 0);
+    SendMessageW(hLog, WM_SETREDRAW, TRUE, 0);
+    InvalidateRect(hLog, NULL, FALSE);
+}
+
+// 会话key：对端身份未知（对方的MT_HELLO还未到达）时用本次运行内唯一的临时key，得知身份后并入正式会话
+std::string fallback_key(uint32_t peer){
+    return "tmp" + std::to_string(session_ms) + "_" + std::to_string(peer);
+}
+std::string conv_key(uint32_t peer){
+    auto it = peer_ident.find(peer);
+    return it != peer_ident.end() ? it->second : fallback_key(peer);
+}
+// 获取会话的历史记录（共享指针：临时会话并入正式会话后被移除，调用方持有期间仍然有效），需持有hist_mtx
+std::shared_ptr<HistoryStore> open_history(const std::string& key){
+    auto& h = histories[key];
+    if(!h){
+        h = std::make_shared<HistoryStore>();
+        if(!h->open("history", key)) append_log(L"历史记录打开失败");
+    }
+    return h;
+}
+// 获取与某个对端的历史记录
+std::shared_ptr<HistoryStore> history_for(uint32_t peer){
+    std::lock_guard<std::mutex> lk(hist_mtx);
+    return open_history(conv_key(peer));
+}
+// 收到对端身份：记录下来，之前记在临时会话中的消息并入正式会话
+void learn_identity(uint32_t peer, const std::string& ident){
+    std::lock_guard<std::mutex> lk(hist_mtx);
+    peer_ident[peer] = ident;
+    auto it = histories.find(fallback_key(peer));
+    if(it == histories.end()) return;
+    auto h = open_history(ident);
+    for(auto& r : it->second->load_page(SIZE_MAX, SIZE_MAX)) h->append(r.ts_ms, r.sender, r.text);
+    it->second->close();
+    histories.erase(it);
+    history_remove("history", fallback_key(peer));
+}
+void show_history(const std::vector<HistoryRecord>& recs){
+    for(auto& r : recs){
+        append_log(L"  #" + std::to_wstring(r.index) + L" [" + (r.sender == HISTORY_SELF ? std::wstring(L"我") : std::to_wstring(r.sender))
+                   + L"] " + u2w(r.text));
+    }
 }
 
 // 发送/接收全部数据
@@ -64,6 +179,35 @@ bool send_all(SOCKET s, const void* buf, int len){
     }
     return true;
 }
+// 发送报文（头部与载荷放在同一缓冲区原地加密后一次发送；序号必须与发送顺序一致，加密在锁内进行）
+bool send_packet(uint8_t type, const std::vector<uint8_t>& payload, uint16_t flags = 0){
+    AppHeader h{}; h.magic=PROTO_MAGIC; h.version=1; h.msg_type=type; h.flags=flags; h.payload_len=(uint32_t)payload.size(); h.crc32=0;
+    // 发送缓冲区在锁内复用，载荷直接加密写入其中（不先拷贝明文）；偶尔的大清单发完后释放
+    static std::vector<uint8_t> frame;
+    std::lock_guard<std::mutex> lk(send_mtx);
+    tx_state.seal_into(h, payload.data(), payload.size(), frame);
+    bool ok = send_all(g_sock, frame.data(), (int)frame.size());
+    if(frame.capacity() > SEND_BUFFER_KEEP) std::vector<uint8_t>().swap(frame);
+    return ok;
+}
+// 连接线程放弃正在建立的连接；窗口关闭时界面线程已关闭过的不再关闭
+void drop_pending(SOCKET s){
+    std::lock_guard<std::mutex> lk(send_mtx);
+    if(g_pending != s) return;
+    closesocket(s);
+    g_pending = INVALID_SOCKET;
+}
+// 首次给对端发消息前告知本端身份（每个对端每次连接一次）
+void send_hello(uint32_t peer){
+    {
+        std::lock_guard<std::mutex> lk(hist_mtx);
+        if(self_ident.empty() || !hello_sent.insert(peer).second) return;
+    }
+    std::vector<uint8_t> p(4 + self_ident.size());
+    memcpy(p.data(), &peer, 4);
+    memcpy(p.data() + 4, self_ident.data(), self_ident.size());
+    send_packet(MT_HELLO, p);
+}
 bool recv_all(SOCKET s, void* buf, int len){
     char* p = (char*)buf; int rem = len;
     while(rem>0){
@@ -74,39 +218,151 @@ bool recv_all(SOCKET s, void* buf, int len){
     return true;
 }
 
-// 显示图片预览
-void show_image_preview(const std::string &path){
-    // spawn thread to show a simple window and draw image using GDI+
-    std::thread([path](){
-        std::wstring wpath = u2w(path);
-        // create a window class
-        HINSTANCE hi = GetModuleHandle(NULL);
-        WNDCLASSW wc{}; wc.lpfnWndProc = DefWindowProcW; wc.hInstance = hi; wc.lpszClassName = L"ImgPreviewClass";
-        RegisterClassW(&wc);
-        Bitmap bmp(wpath.c_str());
-        UINT bw = bmp.GetWidth(), bh = bmp.GetHeight();
-        int winw = (int)std::min<UINT>(bw, 2000);
-        int winh = (int)std::min<UINT>(bh, 2000);
-        HWND wh = CreateWindowW(L"ImgPreviewClass", L"图片预览", WS_OVERLAPPEDWINDOW,
-                                CW_USEDEFAULT, CW_USEDEFAULT, winw+16, winh+39, NULL, NULL, hi, NULL);
-        ShowWindow(wh, SW_SHOW);
-        // paint once
-        HDC hdc = GetDC(wh);
-        Graphics g(hdc);
-        g.DrawImage(&bmp, Rect(0,0,winw,winh));
-        ReleaseDC(wh, hdc);
-        MSG msg;
-        while(GetMessageW(&msg, NULL, 0, 0)){
-            TranslateMessage(&msg); DispatchMessageW(&msg);
+// COM接口指针：离开作用域时Release
+template<class T> struct ComPtr {
+    T* p = nullptr;
+    ~ComPtr(){ if(p) p->Release(); }
+    T** operator&(){ return &p; }
+    T* operator->() const { return p; }
+};
+
+// WIC解码器：不生成全分辨率位图
+// 支持解码时缩放的格式（JPEG按1/2、1/4、1/8解码）经IWICBitmapSourceTransform直接输出接近max_dim的尺寸，
+// 其余格式由IWICBitmapScaler逐行拉取源数据缩放，内存中只有目标尺寸的像素
+bool wic_decode(const std::string& path, uint32_t max_dim, Image& out){
+    // 1. 每个解码线程初始化一次COM（多线程套间）
+    thread_local HRESULT com = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if(FAILED(com) && com != RPC_E_CHANGED_MODE) return false;
+    ComPtr<IWICImagingFactory> factory;
+    if(FAILED(CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory.p)))) return false;
+    ComPtr<IWICBitmapDecoder> dec;
+    if(FAILED(factory->CreateDecoderFromFilename(u2w(path).c_str(), NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, &dec))) return false;
+    ComPtr<IWICBitmapFrameDecode> frame;
+    if(FAILED(dec->GetFrame(0, &frame))) return false;
+    UINT bw = 0, bh = 0;
+    if(FAILED(frame->GetSize(&bw, &bh)) || !bw || !bh) return false;
+    double scale = std::min<double>(1.0, (double)max_dim / std::max<UINT>(bw, bh));
+    UINT w = std::max<UINT>(1, (UINT)(bw * scale)), h = std::max<UINT>(1, (UINT)(bh * scale));
+
+    // 2. 优先让解码器按缩小后的尺寸直接解码（不小于目标尺寸，剩余部分由调用方缩小）
+    ComPtr<IWICBitmapSourceTransform> xf;
+    if(SUCCEEDED(frame->QueryInterface(IID_PPV_ARGS(&xf.p)))){
+        // 解码器给出的可用尺寸可能小于请求，逐步放大请求直到不小于目标
+        UINT sw = 0, sh = 0;
+        for(UINT k = 1; k <= 8 && (sw < w || sh < h); k *= 2){
+            sw = std::min(bw, w * k); sh = std::min(bh, h * k);
+            if(FAILED(xf->GetClosestSize(&sw, &sh))) sw = sh = 0;
+        }
+        WICPixelFormatGUID fmt = GUID_WICPixelFormat32bppBGRA;
+        BOOL rot = FALSE;
+        if(sw >= w && sh >= h && sw <= bw && sh <= bh &&
+           SUCCEEDED(xf->GetClosestPixelFormat(&fmt)) && IsEqualGUID(fmt, GUID_WICPixelFormat32bppBGRA) &&
+           SUCCEEDED(xf->DoesSupportTransform(WICBitmapTransformRotate0, &rot)) && rot){
+            out.width = sw; out.height = sh;
+            out.pixels.resize((size_t)sw * sh * 4);
+            if(SUCCEEDED(xf->CopyPixels(NULL, sw, sh, &fmt, WICBitmapTransformRotate0, sw * 4, (UINT)out.pixels.size(), out.pixels.data()))){
+                out = downscale_image(out, max_dim, max_dim);
+                return true;
+            }
         }
-    }).detach();
+    }
+
+    // 3. 否则流式缩放并转换为32位BGRA
+    ComPtr<IWICBitmapScaler> scaler;
+    ComPtr<IWICFormatConverter> conv;
+    if(FAILED(factory->CreateBitmapScaler(&scaler)) ||
+       FAILED(scaler->Initialize(frame.p, w, h, WICBitmapInterpolationModeFant)) ||
+       FAILED(factory->CreateFormatConverter(&conv)) ||
+       FAILED(conv->Initialize(scaler.p, GUID_WICPixelFormat32bppBGRA, WICBitmapDitherTypeNone, NULL, 0.0, WICBitmapPaletteTypeCustom))) return false;
+    out.width = w; out.height = h;
+    out.pixels.resize((size_t)w * h * 4);
+    return SUCCEEDED(conv->CopyPixels(NULL, w * 4, (UINT)out.pixels.size(), out.pixels.data()));
 }
 
-// 处理文本信息
+// 显示图片预览：解码在线程池完成，结果投递给界面线程创建窗口
+void show_image_preview(const std::string &path, const PreviewKey& key){
+    previews->request(key, path, [path](const PreviewKey&, std::shared_ptr<const PreviewImages> r){
+        if(!r){ append_log(L"图片解码失败: " + u2w(path)); return; }
+        PostMessageW(hMain, WM_APP_PREVIEW, 0, (LPARAM)new std::shared_ptr<const Image>(r->preview));
+    });
+}
+
+// 预览窗口：GWLP_USERDATA保存图像，WM_PAINT时直接绘制已缩小的像素
+LRESULT CALLBACK PreviewProc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp){
+    auto img = (std::shared_ptr<const Image>*)GetWindowLongPtrW(hWnd, GWLP_USERDATA);
+    switch(msg){
+    case WM_CREATE:
+        SetWindowLongPtrW(hWnd, GWLP_USERDATA, (LONG_PTR)((CREATESTRUCTW*)lp)->lpCreateParams);
+        return 0;
+    case WM_PAINT:{
+        PAINTSTRUCT ps;
+        HDC hdc = BeginPaint(hWnd, &ps);
+        if(img && *img){
+            const Image& im = **img;
+            BITMAPINFO bi{};
+            bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+            bi.bmiHeader.biWidth = (LONG)im.width;
+            bi.bmiHeader.biHeight = -(LONG)im.height;   // 自上而下
+            bi.bmiHeader.biPlanes = 1;
+            bi.bmiHeader.biBitCount = 32;
+            bi.bmiHeader.biCompression = BI_RGB;
+            SetDIBitsToDevice(hdc, 0, 0, im.width, im.height, 0, 0, 0, im.height, im.pixels.data(), &bi, DIB_RGB_COLORS);
+        }
+        EndPaint(hWnd, &ps);
+        return 0;
+    }
+    case WM_NCDESTROY:
+        delete img;
+        SetWindowLongPtrW(hWnd, GWLP_USERDATA, 0);
+        break;
+    }
+    return DefWindowProcW(hWnd, msg, wp, lp);
+}
+
+// 按扩展名判断是否为可预览的图片
+bool is_image_name(std::string low){
+    for(auto &c: low) c = tolower(c);
+    return low.find(".jpg")!=std::string::npos || low.find(".png")!=std::string::npos || low.find(".bmp")!=std::string::npos || low.find(".jpeg")!=std::string::npos;
+}
+
+// 去重传输状态：显示为一行进度，完成后预览图片
+void on_transfer_status(const TransferStatus& st){
+    if(st.sending){
+        append_log(L"[我->" + std::to_wstring(st.peer) + L"] 文件发送失败: " + u2w(st.name));
+        return;
+    }
+    std::string key = "dd_" + std::to_string(st.peer) + "_" + st.name;
+    std::wstring who = L"[" + std::to_wstring(st.peer) + L"] ";
+    std::lock_guard<std::mutex> lk(dd_mtx);
+    if(st.done){
+        dd_reported.erase(key);
+        if(!st.ok){ post_progress(key, who + L"文件接收失败: " + u2w(st.name), true); return; }
+        post_progress(key, who + L"文件接收完成: " + u2w(st.out) + L" (" + std::to_wstring(st.size / 1024)
+                      + L" KB，实际传输 " + std::to_wstring(st.fetched / 1024) + L" KB)", true);
+        if(is_image_name(st.name)) show_image_preview(st.out, st.content_key);
+        return;
+    }
+    uint32_t permille = st.size ? (uint32_t)(st.have * 1000 / st.size) : 1000;
+    auto it = dd_reported.find(key);
+    if(it != dd_reported.end() && it->second == permille) return;
+    dd_reported[key] = permille;
+    post_progress(key, who + L"正在接收 " + u2w(st.name) + L": " + std::to_wstring(st.have / 1024) + L"/"
+                  + std::to_wstring(st.size / 1024) + L" KB (" + std::to_wstring(permille / 10) + L"%)", false);
+}
+
+// 文本回执：同一批中既送达又已读时只报告已读
+void on_receipt_status(uint32_t peer, uint32_t seq, ReceiptState st){
+    const wchar_t* s = st == ReceiptState::READ ? L"已读" : st == ReceiptState::DELIVERED ? L"已送达" : L"未送达";
+    append_log(L"  #" + std::to_wstring(seq) + L" -> " + std::to_wstring(peer) + L" " + s);
+}
+
+// 处理文本信息（窗口在前台时视为已读，否则在窗口激活时统一发送已读回执）
 void handle_text_forward(uint32_t sender, const std::vector<uint8_t>& body){
     std::string s((char*)body.data(), body.size());
     std::wstring ws = u2w(s);
     append_log(L"[" + std::to_wstring(sender) + L"] " + ws);
+    history_for(sender)->append(history_now_ms(), sender, s);
+    if(GetForegroundWindow() == hMain) delivery->mark_read(sender);
 }
 // 处理文件信息
 void handle_file_meta(uint32_t sender, const std::vector<uint8_t>& body){
@@ -118,31 +374,48 @@ void handle_file_meta(uint32_t sender, const std::vector<uint8_t>& body){
     std::string out = "recv_from_" + std::to_string(sender) + "_" + fname;
     {
         std::lock_guard<std::mutex> lk(incoming_mtx);
-        Incoming info; info.expected = fsize; info.received = 0; info.out = out;
-        incoming[std::to_string(sender)+"_"+fname] = info;
+        Incoming& info = incoming[std::to_string(sender)+"_"+fname];
+        info.expected = fsize; info.received = 0; info.out = out; info.fname = fname;
+        info.reported = UINT32_MAX;
+        info.is_image = is_image_name(fname);
+        info.hash = Sha256();
+        info.ofs.close();
+        info.ofs.clear();
+        info.ofs.open(out, std::ios::binary | std::ios::app);
     }
     append_log(u2w("[") + std::to_wstring(sender) + u2w("] incoming file: ") + u2w(fname));
 }
 void handle_file_chunk(uint32_t sender, const std::vector<uint8_t>& body){
     if(body.size() < 8) return;
-    uint32_t seq = *(uint32_t*)(body.data());
     uint32_t chlen = *(uint32_t*)(body.data()+4);
     if(body.size() < 8 + chlen) return;
-    std::vector<uint8_t> data(body.begin()+8, body.begin()+8+chlen);
+    const char* data = (const char*)body.data() + 8;
     bool saved=false;
     {
         std::lock_guard<std::mutex> lk(incoming_mtx);
         for(auto it = incoming.begin(); it!=incoming.end(); ++it){
             if(it->first.rfind(std::to_string(sender)+"_",0)==0){
-                write_file_from_vec(it->second.out, data, true);
-                it->second.received += chlen;
-                append_log(u2w("[") + std::to_wstring(sender) + u2w("] chunk ") + std::to_wstring(seq));
-                if(it->second.received >= it->second.expected){
-                    append_log(u2w("文件接收完成: ") + u2w(it->second.out));
-                    std::string low = it->second.out;
-                    for(auto &c: low) c = tolower(c);
-                    if(low.find(".jpg")!=std::string::npos || low.find(".png")!=std::string::npos || low.find(".bmp")!=std::string::npos || low.find(".jpeg")!=std::string::npos){
-                        show_image_preview(it->second.out);
+                Incoming& inc = it->second;
+                inc.ofs.write(data, chlen);
+                if(inc.is_image) inc.hash.update(data, chlen);
+                inc.received += chlen;
+                bool done = inc.received >= inc.expected;
+                // 进度以千分比为粒度上报，界面只保留一行进度
+                uint32_t permille = inc.expected ? (uint32_t)(inc.received * 1000 / inc.expected) : 1000;
+                if(permille != inc.reported && !done){
+                    inc.reported = permille;
+                    post_progress(it->first, L"[" + std::to_wstring(sender) + L"] 正在接收 " + u2w(inc.fname) + L": "
+                                  + std::to_wstring(inc.received / 1024) + L"/" + std::to_wstring(inc.expected / 1024) + L" KB ("
+                                  + std::to_wstring(permille / 10) + L"%)", false);
+                }
+                if(done){
+                    inc.ofs.close();
+                    post_progress(it->first, L"[" + std::to_wstring(sender) + L"] 文件接收完成: " + u2w(inc.out)
+                                  + L" (" + std::to_wstring(inc.received / 1024) + L" KB)", true);
+                    if(inc.is_image){
+                        PreviewKey key;
+                        inc.hash.final(key.data());
+                        show_image_preview(inc.out, key);
                     }
                     incoming.erase(it);
                 }
@@ -153,8 +426,10 @@ void handle_file_chunk(uint32_t sender, const std::vector<uint8_t>& body){
     }
     if(!saved){
         std::string out = "recv_from_" + std::to_string(sender) + ".bin";
-        write_file_from_vec(out, data, true);
-        append_log(u2w("[") + std::to_wstring(sender) + u2w("] chunk appended to ") + u2w(out));
+        std::ofstream ofs(out, std::ios::binary | std::ios::app);
+        ofs.write(data, chlen);
+        post_progress("bin_" + std::to_string(sender), L"[" + std::to_wstring(sender) + L"] 未知文件数据追加到 " + u2w(out)
+                      + L" (" + std::to_wstring((uint64_t)ofs.tellp() / 1024) + L" KB)", false);
     }
 }
 
@@ -163,12 +438,27 @@ void recv_thread(){
     while(g_run){
         AppHeader hdr;
         if(!recv_all(g_sock, &hdr, sizeof(hdr))) break;
-        if(hdr.magic != PROTO_MAGIC) break;
+        if(hdr.magic != PROTO_MAGIC || hdr.payload_len > MAX_PAYLOAD_BYTES) break;
         std::vector<uint8_t> payload;
         if(hdr.payload_len){
             payload.resize(hdr.payload_len);
             if(!recv_all(g_sock, payload.data(), hdr.payload_len)) break;
         }
+        // 握手之后服务器发来的每一帧都必须通过认证
+        uint32_t plain_len;
+        if(!rx_state.open(hdr, payload.data(), plain_len)){ append_log(L"认证失败，连接已断开"); break; }
+        payload.resize(plain_len);
+        hdr.payload_len = plain_len;
+        // 带序号的消息：丢弃重复的，记录回执，去掉序号后按普通消息处理
+        if(hdr.flags & FLAG_SEQ){
+            if(payload.size() < 8) continue;
+            uint32_t sender, seq;
+            memcpy(&sender, payload.data(), 4);
+            memcpy(&seq, payload.data()+4, 4);
+            if(!delivery->on_sequenced(sender, seq)) continue;
+            payload.erase(payload.begin()+4, payload.begin()+8);
+            hdr.payload_len -= 4;
+        }
         if(hdr.msg_type == MT_ACK){
             if(payload.size()==4){ memcpy(&myid, payload.data(), 4); append_log(u2w("assigned id=") + std::to_wstring(myid)); }
             else { std::string s((char*)payload.data(), payload.size()); append_log(u2w("[ACK] ") + u2w(s)); }
@@ -177,6 +467,13 @@ void recv_thread(){
             uint32_t sender; memcpy(&sender, payload.data(), 4);
             std::vector<uint8_t> body(payload.begin()+4, payload.end());
             handle_text_forward(sender, body);
+        } else if(hdr.msg_type == MT_HELLO){
+            if(payload.size() != 4 + 16) continue;
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            std::string ident((char*)payload.data()+4, 16);
+            if(ident.find_first_not_of("0123456789abcdef") != std::string::npos) continue;
+            learn_identity(sender, ident);
+            send_hello(sender);
         } else if(hdr.msg_type == MT_FILE_META){
             if(payload.size()<4) continue;
             uint32_t sender; memcpy(&sender, payload.data(), 4);
@@ -187,8 +484,32 @@ void recv_thread(){
             uint32_t sender; memcpy(&sender, payload.data(), 4);
             std::vector<uint8_t> body(payload.begin()+4, payload.end());
             handle_file_chunk(sender, body);
+        } else if(hdr.msg_type == MT_FILE_MANIFEST || hdr.msg_type == MT_CHUNK_REQUEST || hdr.msg_type == MT_CHUNK_DATA){
+            if(payload.size()<4) continue;
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            transfers->on_message(hdr.msg_type, sender, payload.data()+4, payload.size()-4);
+        } else if(hdr.msg_type == MT_RECEIPT){
+            if(payload.size()<4) continue;
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            delivery->on_receipt(sender, payload.data()+4, payload.size()-4);
+        } else if(hdr.msg_type == MT_SKIP){
+            if(payload.size()<4) continue;
+            uint32_t sender; memcpy(&sender, payload.data(), 4);
+            delivery->on_skip(sender, payload.data()+4, payload.size()-4);
         } else if(hdr.msg_type == MT_INVALID_SEMANTIC){
-            append_log(L"[服务器] invalid semantic / target offline");
+            // 目标不在线：该对端的ID不会再出现，结束与它的未完成收发
+            uint32_t gone;
+            if(parse_target_offline(payload.data(), payload.size(), gone)){
+                append_log(L"[服务器] " + std::to_wstring(gone) + L" 不在线");
+                delivery->drop_peer(gone);
+                transfers->drop_peer(gone);
+                continue;
+            }
+            append_log(L"[服务器] invalid semantic");
+        } else if(hdr.msg_type == MT_THROTTLED){
+            uint32_t retry_ms = 0;
+            if(payload.size() >= 5) memcpy(&retry_ms, payload.data()+1, 4);
+            append_log(L"[服务器] 发送过快已被限速，请" + std::to_wstring(retry_ms) + L"毫秒后重试");
         }
     }
     append_log(L"recv end");
@@ -197,8 +518,9 @@ void recv_thread(){
 LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp){
     switch(msg){
     case WM_CREATE:{
+        hMain = hWnd;
         CreateWindowW(L"STATIC", L"聊天记录：", WS_CHILD|WS_VISIBLE, 10,10,80,20, hWnd, NULL, NULL, NULL);
-        hLog = CreateWindowW(L"EDIT", L"", WS_CHILD|WS_VISIBLE|WS_VSCROLL|ES_MULTILINE|ES_AUTOVSCROLL|ES_READONLY, 10,35,600,320, hWnd, NULL, NULL, NULL);
+        hLog = CreateWindowW(L"LISTBOX", L"", WS_CHILD|WS_VISIBLE|WS_VSCROLL|WS_BORDER|LBS_NODATA|LBS_OWNERDRAWFIXED|LBS_NOINTEGRALHEIGHT|LBS_NOSEL, 10,35,600,320, hWnd, NULL, NULL, NULL);
         CreateWindowW(L"STATIC", L"输入：", WS_CHILD|WS_VISIBLE, 10,365,40,20, hWnd, NULL, NULL, NULL);
         hInput = CreateWindowW(L"EDIT", L"", WS_CHILD|WS_VISIBLE|ES_AUTOHSCROLL, 60,365,380,24, hWnd, NULL, NULL, NULL);
         CreateWindowW(L"BUTTON", L"发送", WS_CHILD|WS_VISIBLE, 450,365,60,24, hWnd, (HMENU)101, NULL, NULL);
@@ -208,27 +530,122 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp){
         CreateWindowW(L"STATIC", L"目标ID：", WS_CHILD|WS_VISIBLE, 260,395,60,20, hWnd, NULL, NULL, NULL);
         hTarget = CreateWindowW(L"EDIT", L"0", WS_CHILD|WS_VISIBLE|ES_AUTOHSCROLL, 320,395,80,24, hWnd, NULL, NULL, NULL);
         CreateWindowW(L"BUTTON", L"连接", WS_CHILD|WS_VISIBLE, 420,395,80,24, hWnd, (HMENU)103, NULL, NULL);
+        SetTimer(hWnd, UI_TIMER_ID, UI_FLUSH_MS, NULL);
+        break;
+    }
+    case WM_APP_PREVIEW:{
+        // 按预览图大小创建窗口，图像所有权交给窗口
+        auto img = (std::shared_ptr<const Image>*)lp;
+        RECT rc{0, 0, (LONG)(*img)->width, (LONG)(*img)->height};
+        AdjustWindowRect(&rc, WS_OVERLAPPEDWINDOW, FALSE);
+        HWND wh = CreateWindowW(L"ImgPreviewClass", L"图片预览", WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT,
+                                rc.right - rc.left, rc.bottom - rc.top, NULL, NULL, GetModuleHandle(NULL), img);
+        if(!wh){ delete img; return 0; }
+        ShowWindow(wh, SW_SHOW);
+        return 0;
+    }
+    case WM_TIMER:
+        if(wp == UI_TIMER_ID){ flush_ui_events(); return 0; }
+        break;
+    case WM_ACTIVATE:
+        if(LOWORD(wp) != WA_INACTIVE) delivery->mark_read_all();
         break;
+    case WM_MEASUREITEM:{
+        MEASUREITEMSTRUCT* mis = (MEASUREITEMSTRUCT*)lp;
+        mis->itemHeight = LOG_LINE_H;
+        return TRUE;
+    }
+    case WM_DRAWITEM:{
+        // 虚拟列表框只绘制可见行，内容直接取自log_view
+        DRAWITEMSTRUCT* dis = (DRAWITEMSTRUCT*)lp;
+        if(dis->hwndItem != hLog) break;
+        FillRect(dis->hDC, &dis->rcItem, (HBRUSH)(COLOR_WINDOW+1));
+        if(dis->itemID != (UINT)-1 && dis->itemID < log_view.size()){
+            const std::wstring& line = log_view.line(dis->itemID);
+            RECT rc = dis->rcItem; rc.left += 2;
+            SetBkMode(dis->hDC, TRANSPARENT);
+            SetTextColor(dis->hDC, GetSysColor(COLOR_WINDOWTEXT));
+            DrawTextW(dis->hDC, line.c_str(), (int)line.size(), &rc, DT_SINGLELINE|DT_VCENTER|DT_NOPREFIX|DT_END_ELLIPSIS);
+        }
+        return TRUE;
     }
     case WM_COMMAND:{
         int id = LOWORD(wp);
         if(id==103){
+            // 一次只有一个连接：连接中或已连接时不再发起，旧连接的接收和定时线程结束后才能重新连接
+            if(g_connected.exchange(true)){ append_log(L"已连接或正在连接"); return 0; }
+            // 旧连接线程清除g_connected后即结束，这里回收它
+            if(g_conn_thread.joinable()) g_conn_thread.join();
             wchar_t ipbuf[128]; GetWindowTextW(hIP, ipbuf, 128);
             std::wstring ip(ipbuf);
-            std::thread([ip](){
+            g_conn_thread = std::thread([ip](){
                 WSADATA w; WSAStartup(MAKEWORD(2,2), &w);
-                g_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+                SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+                {
+                    // 登记正在建立的连接，窗口关闭时由界面线程关闭它以中断connect和握手
+                    std::lock_guard<std::mutex> lk(send_mtx);
+                    if(g_quit){ closesocket(s); g_connected = false; return; }
+                    g_pending = s;
+                }
                 sockaddr_in srv{}; srv.sin_family = AF_INET; srv.sin_port = htons(8000);
                 std::string ip8 = w2u(ip);
                 inet_pton(AF_INET, ip8.c_str(), &srv.sin_addr);
-                if(connect(g_sock, (sockaddr*)&srv, sizeof(srv))==SOCKET_ERROR){
+                if(connect(s, (sockaddr*)&srv, sizeof(srv))==SOCKET_ERROR){
                     append_log(L"连接失败");
-                    closesocket(g_sock); g_sock=INVALID_SOCKET; return;
+                    drop_pending(s); g_connected = false; return;
                 }
+                // 加密握手：每个服务器地址单独记录公钥；密钥和套接字握手成功后才在send_mtx下替换
+                std::string err;
+                uint32_t id = 0;
+                CipherState tx, rx;
+                if(!client_handshake([s](void* b, size_t l){ return recv_all(s, b, (int)l); },
+                                     [s](const void* b, size_t l){ return send_all(s, b, (int)l); },
+                                     "known_server_" + ip8 + ".pub", id, tx, rx, err)){
+                    append_log(L"握手失败: " + u2w(err));
+                    drop_pending(s); g_connected = false; return;
+                }
+                {
+                    std::lock_guard<std::mutex> lk(send_mtx);
+                    // 窗口已关闭：套接字已由界面线程关闭，不能再使用或关闭这个号
+                    if(g_pending != s){ g_connected = false; return; }
+                    g_pending = INVALID_SOCKET;
+                    g_sock = s;
+                    tx_state = tx;
+                }
+                rx_state = rx;
+                myid = id;
+                append_log(u2w("assigned id=") + std::to_wstring(myid) + L" (encrypted)");
+                {
+                    // 新连接中的对端ID与之前无关
+                    std::lock_guard<std::mutex> lk(hist_mtx);
+                    if(self_ident.empty()) self_ident = history_self_identity("history");
+                    peer_ident.clear();
+                    hello_sent.clear();
+                }
+                if(self_ident.empty()) append_log(L"history/self.id无法读取，对方将按ID记录与本端的历史");
                 g_run = true;
                 append_log(L"connected to " + ip);
-                std::thread(recv_thread).detach();
-            }).detach();
+                std::thread ticker([](){
+                    while(g_run){
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                        delivery->tick();
+                        transfers->tick();
+                    }
+                });
+                // 接收在本线程进行；结束后停止定时线程，本次连接中未完成的收发以失败结束
+                recv_thread();
+                g_run = false;
+                ticker.join();
+                {
+                    std::lock_guard<std::mutex> lk(send_mtx);
+                    closesocket(g_sock);
+                    g_sock = INVALID_SOCKET;
+                }
+                delivery->reset();
+                transfers->reset();
+                append_log(L"连接已断开");
+                g_connected = false;
+            });
             return 0;
         } else if(id==101){
             wchar_t buf[1024]; GetWindowTextW(hInput, buf, 1024);
@@ -236,17 +653,30 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp){
             if(ws.empty()) return 0;
             wchar_t tbuf[64]; GetWindowTextW(hTarget, tbuf, 64);
             uint32_t target = (uint32_t)_wtoi(tbuf);
+            // /history [n]：显示与目标最近n条消息；/search [-me] <关键词>：检索与目标的历史（-me只检索本端发出的）
+            if(ws == L"/history" || ws.rfind(L"/history ",0)==0){
+                int n = ws.size() > 9 ? _wtoi(ws.c_str()+9) : 20;
+                if(n <= 0) n = 20;
+                show_history(history_for(target)->load_page(SIZE_MAX, (size_t)n));
+                SetWindowTextW(hInput, L"");
+                return 0;
+            }
+            if(ws.rfind(L"/search ",0)==0){
+                std::wstring q = ws.substr(8);
+                std::optional<uint32_t> who;
+                if(q.rfind(L"-me ",0)==0){ who = HISTORY_SELF; q = q.substr(4); }
+                auto res = history_for(target)->search(w2u(q), 20, who);
+                append_log(L"检索到 " + std::to_wstring(res.size()) + L" 条消息");
+                show_history(res);
+                SetWindowTextW(hInput, L"");
+                return 0;
+            }
+            if(!g_run){ append_log(L"未连接"); return 0; }
             std::string utf8 = w2u(ws);
-            std::vector<uint8_t> payload; payload.resize(4 + utf8.size());
-            memcpy(payload.data(), &target, 4);
-            if(!utf8.empty()) memcpy(payload.data()+4, utf8.data(), utf8.size());
-            AppHeader h{}; h.magic=PROTO_MAGIC; h.version=1; h.msg_type=MT_TEXT; h.payload_len=(uint32_t)payload.size(); h.crc32=0;
-            AppHeader tmp = h; tmp.crc32=0;
-            std::vector<uint8_t> pack(sizeof(tmp)+payload.size());
-            memcpy(pack.data(), &tmp, sizeof(tmp)); memcpy(pack.data()+sizeof(tmp), payload.data(), payload.size());
-            h.crc32 = crc32_calc(pack.data(), pack.size());
-            send_all(g_sock, &h, sizeof(h)); if(h.payload_len) send_all(g_sock, payload.data(), (int)payload.size());
-            append_log(L"[我->" + std::to_wstring(target) + L"] " + ws);
+            send_hello(target);
+            uint32_t seq = delivery->send_text(target, MT_TEXT, (const uint8_t*)utf8.data(), utf8.size());
+            append_log(L"[我->" + std::to_wstring(target) + L"] " + ws + L" (#" + std::to_wstring(seq) + L")");
+            history_for(target)->append(history_now_ms(), HISTORY_SELF, utf8);
             SetWindowTextW(hInput, L"");
             return 0;
         } else if(id==102){
@@ -257,58 +687,49 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp){
                 std::wstring pathw(fname);
                 append_log(L"选择文件：" + pathw);
                 std::string path8 = w2u(pathw);
-                std::vector<uint8_t> buf;
-                if(!read_file_to_vec(path8, buf)){ append_log(L"文件读失败"); return 0; }
                 wchar_t tbuf[64]; GetWindowTextW(hTarget, tbuf, 64); uint32_t target = (uint32_t)_wtoi(tbuf);
-                std::string fname8 = path8;
-                uint16_t name_len = (uint16_t)fname8.size();
-                uint64_t fsize = buf.size();
-                std::vector<uint8_t> meta; meta.resize(4 + 2 + name_len + 8);
-                memcpy(meta.data(), &target, 4);
-                memcpy(meta.data()+4, &name_len, 2);
-                memcpy(meta.data()+6, fname8.data(), name_len);
-                memcpy(meta.data()+6+name_len, &fsize, 8);
-                AppHeader h{}; h.magic=PROTO_MAGIC; h.version=1; h.msg_type=MT_FILE_META; h.payload_len=(uint32_t)meta.size(); h.crc32=0;
-                AppHeader tmp=h; tmp.crc32=0;
-                std::vector<uint8_t> pack(sizeof(tmp)+meta.size());
-                memcpy(pack.data(), &tmp, sizeof(tmp)); memcpy(pack.data()+sizeof(tmp), meta.data(), meta.size());
-                h.crc32 = crc32_calc(pack.data(), pack.size());
-                send_all(g_sock, &h, sizeof(h)); send_all(g_sock, meta.data(), (int)meta.size());
-                const size_t CHUNK = 4096; uint32_t seq=0;
-                for(size_t pos=0; pos<buf.size(); pos+=CHUNK){
-                    size_t take = std::min(CHUNK, buf.size()-pos);
-                    std::vector<uint8_t> chunk; chunk.resize(4+4+4+take);
-                    memcpy(chunk.data(), &target, 4);
-                    memcpy(chunk.data()+4, &seq, 4);
-                    uint32_t chlen = (uint32_t)take;
-                    memcpy(chunk.data()+8, &chlen, 4);
-                    memcpy(chunk.data()+12, buf.data()+pos, take);
-                    AppHeader ch{}; ch.magic=PROTO_MAGIC; ch.version=1; ch.msg_type=MT_FILE_CHUNK; ch.payload_len=(uint32_t)chunk.size(); ch.crc32=0;
-                    AppHeader tmp2=ch; tmp2.crc32=0;
-                    std::vector<uint8_t> pack2(sizeof(tmp2)+chunk.size());
-                    memcpy(pack2.data(), &tmp2, sizeof(tmp2)); memcpy(pack2.data()+sizeof(tmp2), chunk.data(), chunk.size());
-                    ch.crc32 = crc32_calc(pack2.data(), pack2.size());
-                    send_all(g_sock, &ch, sizeof(ch)); send_all(g_sock, chunk.data(), (int)chunk.size());
-                    seq++;
-                }
-                append_log(L"文件发送完成");
+                // 切分和计算哈希可能较慢，放到后台线程；只发送清单，对方按需请求分块
+                std::thread([path8, target](){
+                    TransferStatus st;
+                    std::string err;
+                    if(!g_run){ append_log(L"未连接"); return; }
+                    if(!transfers->send_file(target, path8, st, err)){ append_log(L"文件发送失败: " + u2w(err)); return; }
+                    append_log(L"已发送文件清单：" + u2w(st.name) + L" (" + std::to_wstring(st.size / 1024) + L" KB)");
+                }).detach();
             }
             return 0;
         }
         break;
     }
     case WM_DESTROY:
-        g_run=false;
-        if(g_sock!=INVALID_SOCKET) closesocket(g_sock);
+        KillTimer(hWnd, UI_TIMER_ID);
+        {
+            // 1. 正在连接或握手的套接字还没交给连接线程使用，直接关闭以中断阻塞的connect/recv
+            // 2. 已连接的只shutdown使recv返回，由连接线程在send_mtx下关闭，避免关闭已被复用的套接字号
+            std::lock_guard<std::mutex> lk(send_mtx);
+            g_quit = true;
+            if(g_pending!=INVALID_SOCKET){ closesocket(g_pending); g_pending = INVALID_SOCKET; }
+            if(g_sock!=INVALID_SOCKET) shutdown(g_sock, SD_BOTH);
+        }
         PostQuitMessage(0); return 0;
     }
     return DefWindowProcW(hWnd, msg, wp, lp);
 }
 
 int WINAPI wWinMain(HINSTANCE hInst, HINSTANCE, PWSTR, int nCmd){
-    GdiplusStartupInput gdipIn; ULONG_PTR token; GdiplusStartup(&token, &gdipIn, NULL);
     WNDCLASSW wc{}; wc.lpfnWndProc = WndProc; wc.hInstance = hInst; wc.lpszClassName = L"LanChatSimple";
     RegisterClassW(&wc);
+    WNDCLASSW pc{}; pc.lpfnWndProc = PreviewProc; pc.hInstance = hInst; pc.lpszClassName = L"ImgPreviewClass";
+    pc.hCursor = LoadCursor(NULL, IDC_ARROW); pc.hbrBackground = (HBRUSH)(COLOR_WINDOW+1);
+    RegisterClassW(&pc);
+    unsigned workers = std::max<unsigned>(1, std::min<unsigned>(4, std::thread::hardware_concurrency() / 2));
+    previews = std::make_unique<PreviewPipeline>(wic_decode, PREVIEW_CACHE_BYTES, workers);
+    delivery = std::make_unique<Delivery>(
+        [](uint8_t type, uint16_t flags, const std::vector<uint8_t>& p){ return send_packet(type, p, flags); },
+        on_receipt_status);
+    transfers = std::make_unique<DedupTransfer>("chunks",
+        [](uint8_t type, const std::vector<uint8_t>& p){ return send_packet(type, p); },
+        *delivery, on_transfer_status);
     HWND w = CreateWindowW(L"LanChatSimple", L"LAN Chat - 简洁白色版", WS_OVERLAPPEDWINDOW & ~WS_THICKFRAME,
                            CW_USEDEFAULT, CW_USEDEFAULT, 640,480, NULL, NULL, hInst, NULL);
     ShowWindow(w, nCmd);
@@ -316,6 +737,8 @@ int WINAPI wWinMain(HINSTANCE hInst, HINSTANCE, PWSTR, int nCmd){
     while(GetMessageW(&msg, NULL, 0,0)){
         TranslateMessage(&msg); DispatchMessageW(&msg);
     }
-    GdiplusShutdown(token);
+    // 连接线程使用delivery/transfers，等它关闭套接字并退出后再释放
+    if(g_conn_thread.joinable()) g_conn_thread.join();
+    previews.reset();
     return 0;
 }
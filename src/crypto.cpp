@@ -0,0 +1,462 @@
+#ifdef _WIN32
+#define _CRT_RAND_S   // rand_s：由系统RtlGenRandom提供的安全随机数
+#endif
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "../include/crypto.hpp"
+#include "../include/sha256.hpp"
+
+// ---------- 随机数 ----------
+
+bool random_bytes(uint8_t* out, size_t len){
+#ifdef _WIN32
+    while(len){
+        unsigned int v;
+        if(rand_s(&v) != 0) return false;
+        size_t k = len < sizeof(v) ? len : sizeof(v);
+        memcpy(out, &v, k);
+        out += k; len -= k;
+    }
+    return true;
+#else
+    FILE* f = fopen("/dev/urandom", "rb");
+    if(!f) return false;
+    bool ok = fread(out, 1, len, f) == len;
+    fclose(f);
+    return ok;
+#endif
+}
+
+bool ct_equal(const uint8_t* a, const uint8_t* b, size_t len){
+    uint8_t d = 0;
+    for(size_t i=0;i<len;i++) d |= a[i] ^ b[i];
+    return d == 0;
+}
+
+static inline uint32_t load32(const uint8_t* p){ uint32_t v; memcpy(&v, p, 4); return v; }   // 小端平台
+static inline void store32(uint8_t* p, uint32_t v){ memcpy(p, &v, 4); }
+static inline void store64(uint8_t* p, uint64_t v){ memcpy(p, &v, 8); }
+
+// ---------- ChaCha20 ----------
+
+static inline uint32_t rotl(uint32_t x, int n){ return (x << n) | (x >> (32 - n)); }
+
+#define QR(a,b,c,d) \
+    a += b; d ^= a; d = rotl(d,16); \
+    c += d; b ^= c; b = rotl(b,12); \
+    a += b; d ^= a; d = rotl(d,8);  \
+    c += d; b ^= c; b = rotl(b,7);
+
+// 生成一个64字节密钥流块（以32位字给出）
+static void chacha_block(const uint32_t in[16], uint32_t out[16]){
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+    for(int i=0;i<10;i++){
+        QR(x[0],x[4],x[8], x[12]); QR(x[1],x[5],x[9], x[13]);
+        QR(x[2],x[6],x[10],x[14]); QR(x[3],x[7],x[11],x[15]);
+        QR(x[0],x[5],x[10],x[15]); QR(x[1],x[6],x[11],x[12]);
+        QR(x[2],x[7],x[8], x[13]); QR(x[3],x[4],x[9], x[14]);
+    }
+    for(int i=0;i<16;i++) out[i] = x[i] + in[i];
+}
+
+static void chacha_init(uint32_t st[16], const uint8_t key[32], const uint8_t nonce[12], uint32_t counter){
+    st[0] = 0x61707865; st[1] = 0x3320646e; st[2] = 0x79622d32; st[3] = 0x6b206574;
+    for(int i=0;i<8;i++) st[4+i] = load32(key + 4*i);
+    st[12] = counter;
+    for(int i=0;i<3;i++) st[13+i] = load32(nonce + 4*i);
+}
+
+// 用当前块的密钥流异或n(<=64)字节写到out（可与in相同），并递增块计数
+static void chacha_xor(uint32_t st[16], const uint8_t* in, uint8_t* out, size_t n){
+    uint32_t ks[16];
+    chacha_block(st, ks);
+    st[12]++;
+    uint8_t kb[64];
+    memcpy(kb, ks, 64);
+    for(size_t i=0;i<n;i++) out[i] = in[i] ^ kb[i];
+}
+
+// 4个连续块并行计算：每个向量的4个通道分别对应4个块的同一个字（GCC向量扩展，x86-64上编译为SSE2）
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+static inline u32x4 rotl4(u32x4 x, int n){ return (x << n) | (x >> (32 - n)); }
+
+#define QR4(a,b,c,d) \
+    a += b; d ^= a; d = rotl4(d,16); \
+    c += d; b ^= c; b = rotl4(b,12); \
+    a += b; d ^= a; d = rotl4(d,8);  \
+    c += d; b ^= c; b = rotl4(b,7);
+
+// 异或256字节（4个块）写到out（可与in相同），块计数加4
+static void chacha_xor4(uint32_t st[16], const uint8_t* in, uint8_t* out){
+    u32x4 s0[16], x[16];
+    for(int i=0;i<16;i++){
+        u32x4 v = {st[i], st[i], st[i], st[i]};
+        s0[i] = v;
+    }
+    u32x4 ctr = {st[12], st[12] + 1, st[12] + 2, st[12] + 3};
+    s0[12] = ctr;
+    for(int i=0;i<16;i++) x[i] = s0[i];
+    for(int i=0;i<10;i++){
+        QR4(x[0],x[4],x[8], x[12]); QR4(x[1],x[5],x[9], x[13]);
+        QR4(x[2],x[6],x[10],x[14]); QR4(x[3],x[7],x[11],x[15]);
+        QR4(x[0],x[5],x[10],x[15]); QR4(x[1],x[6],x[11],x[12]);
+        QR4(x[2],x[7],x[8], x[13]); QR4(x[3],x[4],x[9], x[14]);
+    }
+    for(int i=0;i<16;i++) x[i] += s0[i];
+    for(int b=0;b<4;b++){
+        uint32_t w[16];
+        memcpy(w, in + 64*b, 64);
+        for(int i=0;i<16;i++) w[i] ^= x[i][b];
+        memcpy(out + 64*b, w, 64);
+    }
+    st[12] += 4;
+}
+
+// ---------- Poly1305（26位分段，64位乘法，可移植） ----------
+
+namespace {
+class Poly1305 {
+public:
+    explicit Poly1305(const uint8_t key[32]){
+        r[0] = (load32(key+0)     ) & 0x3ffffff;
+        r[1] = (load32(key+3) >> 2) & 0x3ffff03;
+        r[2] = (load32(key+6) >> 4) & 0x3ffc0ff;
+        r[3] = (load32(key+9) >> 6) & 0x3f03fff;
+        r[4] = (load32(key+12)>> 8) & 0x00fffff;
+        for(int i=0;i<4;i++) pad[i] = load32(key + 16 + 4*i);
+    }
+
+    void update(const uint8_t* m, size_t n){
+        if(left){
+            size_t k = 16 - left < n ? 16 - left : n;
+            memcpy(buf + left, m, k);
+            left += k; m += k; n -= k;
+            if(left < 16) return;
+            blocks(buf, 16, 1u << 24);
+            left = 0;
+        }
+        size_t full = n & ~(size_t)15;
+        if(full){ blocks(m, full, 1u << 24); m += full; n -= full; }
+        if(n){ memcpy(buf, m, n); left = n; }
+    }
+
+    // 补零到16字节边界（AEAD构造要求）
+    void pad16(){
+        if(!left) return;
+        memset(buf + left, 0, 16 - left);
+        blocks(buf, 16, 1u << 24);
+        left = 0;
+    }
+
+    void finish(uint8_t tag[16]){
+        if(left){
+            buf[left] = 1;
+            memset(buf + left + 1, 0, 15 - left);
+            blocks(buf, 16, 0);
+            left = 0;
+        }
+        uint32_t h0=h[0], h1=h[1], h2=h[2], h3=h[3], h4=h[4], c;
+        c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+        c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+        c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+        c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+        c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+        // 计算 h - p，若不为负则取之
+        uint32_t g0, g1, g2, g3, g4;
+        g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+        g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+        g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+        g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+        g4 = h4 + c - (1u << 26);
+        uint32_t mask = (g4 >> 31) - 1;
+        g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+        mask = ~mask;
+        h0 = (h0 & mask) | g0; h1 = (h1 & mask) | g1; h2 = (h2 & mask) | g2;
+        h3 = (h3 & mask) | g3; h4 = (h4 & mask) | g4;
+
+        // 转为128位并加上pad
+        h0 = (h0      ) | (h1 << 26);
+        h1 = (h1 >>  6) | (h2 << 20);
+        h2 = (h2 >> 12) | (h3 << 14);
+        h3 = (h3 >> 18) | (h4 <<  8);
+        uint64_t f;
+        f = (uint64_t)h0 + pad[0];             store32(tag+0,  (uint32_t)f);
+        f = (uint64_t)h1 + pad[1] + (f >> 32); store32(tag+4,  (uint32_t)f);
+        f = (uint64_t)h2 + pad[2] + (f >> 32); store32(tag+8,  (uint32_t)f);
+        f = (uint64_t)h3 + pad[3] + (f >> 32); store32(tag+12, (uint32_t)f);
+    }
+
+private:
+    void blocks(const uint8_t* m, size_t n, uint32_t hibit){
+        const uint32_t r0=r[0], r1=r[1], r2=r[2], r3=r[3], r4=r[4];
+        const uint32_t s1=r1*5, s2=r2*5, s3=r3*5, s4=r4*5;
+        uint32_t h0=h[0], h1=h[1], h2=h[2], h3=h[3], h4=h[4];
+        while(n >= 16){
+            h0 += (load32(m+0)     ) & 0x3ffffff;
+            h1 += (load32(m+3) >> 2) & 0x3ffffff;
+            h2 += (load32(m+6) >> 4) & 0x3ffffff;
+            h3 += (load32(m+9) >> 6) & 0x3ffffff;
+            h4 += (load32(m+12)>> 8) | hibit;
+
+            uint64_t d0 = (uint64_t)h0*r0 + (uint64_t)h1*s4 + (uint64_t)h2*s3 + (uint64_t)h3*s2 + (uint64_t)h4*s1;
+            uint64_t d1 = (uint64_t)h0*r1 + (uint64_t)h1*r0 + (uint64_t)h2*s4 + (uint64_t)h3*s3 + (uint64_t)h4*s2;
+            uint64_t d2 = (uint64_t)h0*r2 + (uint64_t)h1*r1 + (uint64_t)h2*r0 + (uint64_t)h3*s4 + (uint64_t)h4*s3;
+            uint64_t d3 = (uint64_t)h0*r3 + (uint64_t)h1*r2 + (uint64_t)h2*r1 + (uint64_t)h3*r0 + (uint64_t)h4*s4;
+            uint64_t d4 = (uint64_t)h0*r4 + (uint64_t)h1*r3 + (uint64_t)h2*r2 + (uint64_t)h3*r1 + (uint64_t)h4*r0;
+
+            uint32_t c;
+            c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+            d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+            d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+            d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+            d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+            h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+            h1 += c;
+            m += 16; n -= 16;
+        }
+        h[0]=h0; h[1]=h1; h[2]=h2; h[3]=h3; h[4]=h4;
+    }
+
+    uint32_t r[5], h[5] = {0,0,0,0,0}, pad[4];
+    uint8_t buf[16];
+    size_t left = 0;
+};
+}
+
+void poly1305(const uint8_t key[32], const uint8_t* msg, size_t len, uint8_t tag[16]){
+    Poly1305 p(key);
+    p.update(msg, len);
+    p.finish(tag);
+}
+
+// ---------- ChaCha20-Poly1305 AEAD ----------
+
+// 块0的密钥流前32字节作为Poly1305一次性密钥，数据从块1开始加密
+static Poly1305 aead_begin(uint32_t st[16], const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, size_t aad_len){
+    chacha_init(st, key, nonce, 0);
+    uint32_t ks[16];
+    chacha_block(st, ks);
+    st[12] = 1;
+    uint8_t otk[32];
+    memcpy(otk, ks, 32);
+    Poly1305 p(otk);
+    if(aad_len){ p.update(aad, aad_len); p.pad16(); }
+    return p;
+}
+
+static void aead_finish(Poly1305& p, size_t aad_len, size_t len, uint8_t tag[16]){
+    p.pad16();
+    uint8_t lens[16];
+    store64(lens, aad_len);
+    store64(lens + 8, len);
+    p.update(lens, 16);
+    p.finish(tag);
+}
+
+void aead_seal(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, size_t aad_len,
+               uint8_t* data, size_t len, uint8_t tag[16]){
+    aead_seal(key, nonce, aad, aad_len, data, data, len, tag);
+}
+
+void aead_seal(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, size_t aad_len,
+               const uint8_t* in, uint8_t* out, size_t len, uint8_t tag[16]){
+    uint32_t st[16];
+    Poly1305 p = aead_begin(st, key, nonce, aad, aad_len);
+    size_t off = 0;
+    for(; off + 256 <= len; off += 256){
+        chacha_xor4(st, in + off, out + off);
+        p.update(out + off, 256);
+    }
+    for(; off < len; off += 64){
+        size_t n = len - off < 64 ? len - off : 64;
+        chacha_xor(st, in + off, out + off, n);
+        p.update(out + off, n);
+    }
+    aead_finish(p, aad_len, len, tag);
+}
+
+bool aead_open(const uint8_t key[32], const uint8_t nonce[12], const uint8_t* aad, size_t aad_len,
+               uint8_t* data, size_t len, const uint8_t tag[16]){
+    uint32_t st[16];
+    Poly1305 p = aead_begin(st, key, nonce, aad, aad_len);
+    size_t off = 0;
+    for(; off + 256 <= len; off += 256){
+        p.update(data + off, 256);
+        chacha_xor4(st, data + off, data + off);
+    }
+    for(; off < len; off += 64){
+        size_t n = len - off < 64 ? len - off : 64;
+        p.update(data + off, n);
+        chacha_xor(st, data + off, data + off, n);
+    }
+    uint8_t calc[16];
+    aead_finish(p, aad_len, len, calc);
+    return ct_equal(calc, tag, 16);
+}
+
+// ---------- HMAC / HKDF ----------
+
+void hmac_sha256(const uint8_t* key, size_t key_len, const uint8_t* data, size_t len, uint8_t out[32]){
+    uint8_t k[64] = {0};
+    if(key_len > 64) sha256_calc(key, key_len, k);
+    else if(key_len) memcpy(k, key, key_len);
+    uint8_t ipad[64], opad[64];
+    for(int i=0;i<64;i++){ ipad[i] = k[i] ^ 0x36; opad[i] = k[i] ^ 0x5c; }
+    uint8_t inner[32];
+    Sha256 a;
+    a.update(ipad, 64);
+    a.update(data, len);
+    a.final(inner);
+    Sha256 b;
+    b.update(opad, 64);
+    b.update(inner, 32);
+    b.final(out);
+}
+
+void hkdf_sha256(const uint8_t* salt, size_t salt_len, const uint8_t* ikm, size_t ikm_len,
+                 const uint8_t* info, size_t info_len, uint8_t* out, size_t out_len){
+    uint8_t prk[32];
+    hmac_sha256(salt, salt_len, ikm, ikm_len, prk);
+    uint8_t t[32];
+    size_t t_len = 0;
+    uint8_t buf[32 + 256 + 1];
+    if(info_len > 256) info_len = 256;
+    for(uint8_t i = 1; out_len; i++){
+        memcpy(buf, t, t_len);
+        if(info_len) memcpy(buf + t_len, info, info_len);
+        buf[t_len + info_len] = i;
+        hmac_sha256(prk, 32, buf, t_len + info_len + 1, t);
+        t_len = 32;
+        size_t k = out_len < 32 ? out_len : 32;
+        memcpy(out, t, k);
+        out += k; out_len -= k;
+    }
+}
+
+// ---------- X25519（16个16位分段的域运算，常量时间） ----------
+
+typedef int64_t gf[16];
+
+static void car25519(gf o){
+    for(int i=0;i<16;i++){
+        o[i] += (int64_t)1 << 16;
+        int64_t c = o[i] >> 16;
+        o[(i+1) * (i<15)] += c - 1 + 37 * (c - 1) * (i == 15);
+        o[i] -= c * 65536;
+    }
+}
+
+static void sel25519(gf p, gf q, int64_t b){
+    int64_t c = ~(b - 1);
+    for(int i=0;i<16;i++){
+        int64_t t = c & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+static void pack25519(uint8_t o[32], const gf n){
+    gf m, t;
+    for(int i=0;i<16;i++) t[i] = n[i];
+    car25519(t); car25519(t); car25519(t);
+    for(int j=0;j<2;j++){
+        m[0] = t[0] - 0xffed;
+        for(int i=1;i<15;i++){
+            m[i] = t[i] - 0xffff - ((m[i-1] >> 16) & 1);
+            m[i-1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        int64_t b = (m[15] >> 16) & 1;
+        m[14] &= 0xffff;
+        sel25519(t, m, 1 - b);
+    }
+    for(int i=0;i<16;i++){
+        o[2*i] = (uint8_t)(t[i] & 0xff);
+        o[2*i+1] = (uint8_t)(t[i] >> 8);
+    }
+}
+
+static void unpack25519(gf o, const uint8_t n[32]){
+    for(int i=0;i<16;i++) o[i] = n[2*i] + ((int64_t)n[2*i+1] << 8);
+    o[15] &= 0x7fff;
+}
+
+static void fadd(gf o, const gf a, const gf b){ for(int i=0;i<16;i++) o[i] = a[i] + b[i]; }
+static void fsub(gf o, const gf a, const gf b){ for(int i=0;i<16;i++) o[i] = a[i] - b[i]; }
+
+static void fmul(gf o, const gf a, const gf b){
+    int64_t t[31] = {0};
+    for(int i=0;i<16;i++)
+        for(int j=0;j<16;j++) t[i+j] += a[i] * b[j];
+    for(int i=0;i<15;i++) t[i] += 38 * t[i+16];
+    for(int i=0;i<16;i++) o[i] = t[i];
+    car25519(o);
+    car25519(o);
+}
+
+static void finv(gf o, const gf in){
+    gf c;
+    for(int i=0;i<16;i++) c[i] = in[i];
+    for(int a=253;a>=0;a--){
+        fmul(c, c, c);
+        if(a != 2 && a != 4) fmul(c, c, in);
+    }
+    for(int i=0;i<16;i++) o[i] = c[i];
+}
+
+bool x25519(uint8_t out[32], const uint8_t scalar[32], const uint8_t point[32]){
+    static const gf k121665 = {0xDB41, 1};
+    uint8_t z[32];
+    memcpy(z, scalar, 32);
+    z[31] = (z[31] & 127) | 64;
+    z[0] &= 248;
+
+    gf x, a, b, c, d, e, f;
+    unpack25519(x, point);
+    for(int i=0;i<16;i++){ b[i] = x[i]; a[i] = c[i] = d[i] = 0; }
+    a[0] = d[0] = 1;
+    // 蒙哥马利阶梯
+    for(int i=254;i>=0;--i){
+        int64_t r = (z[i>>3] >> (i&7)) & 1;
+        sel25519(a, b, r);
+        sel25519(c, d, r);
+        fadd(e, a, c);
+        fsub(a, a, c);
+        fadd(c, b, d);
+        fsub(b, b, d);
+        fmul(d, e, e);
+        fmul(f, a, a);
+        fmul(a, c, a);
+        fmul(c, b, e);
+        fadd(e, a, c);
+        fsub(a, a, c);
+        fmul(b, a, a);
+        fsub(c, d, f);
+        fmul(a, c, k121665);
+        fadd(a, a, d);
+        fmul(c, c, a);
+        fmul(a, d, f);
+        fmul(d, b, x);
+        fmul(b, e, e);
+        sel25519(a, b, r);
+        sel25519(c, d, r);
+    }
+    finv(c, c);
+    fmul(a, a, c);
+    pack25519(out, a);
+
+    uint8_t zero = 0;
+    for(int i=0;i<32;i++) zero |= out[i];
+    return zero != 0;
+}
+
+void x25519_public(uint8_t pub[32], const uint8_t priv[32]){
+    static const uint8_t base[32] = {9};
+    x25519(pub, priv, base);
+}
@@ -0,0 +1,676 @@
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+#include "../include/dedup.hpp"
+#include "../include/sha256.hpp"
+#include "../include/protocol.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr size_t REQUEST_BATCH = 1024;   // 每个MT_CHUNK_REQUEST最多携带的哈希数
+// 接收端：超过该时间没有任何分块到达时重新请求缺少的分块，连续重试MAX_CHUNK_RETRIES次仍无进展则失败
+// （大于服务器等待上传的超时，服务器先有机会把等待者的请求重新转发给发送端）
+static constexpr auto   CHUNK_STALL_TIMEOUT = std::chrono::seconds(15);
+static constexpr int    MAX_CHUNK_RETRIES = 3;
+// 发送端：清单超过该时间没有任何活动时，接收端已完成或已放弃（超过其全部重试时间），移除该清单
+static constexpr auto   OUTGOING_IDLE_TIMEOUT = CHUNK_STALL_TIMEOUT * (MAX_CHUNK_RETRIES + 1);
+
+// 正在提供分块的源文件（接收线程和定时线程都可能读取）
+struct SourceFile {
+    std::mutex mtx;
+    std::ifstream ifs;
+};
+
+// ---------- 内容定义分块 ----------
+
+// Gear表：由固定种子生成，保证所有客户端对同一内容切出相同的分块
+struct GearTable {
+    uint64_t v[256];
+    GearTable(){
+        uint64_t x = 0x4C414E43ULL;
+        for(int i=0;i<256;i++){
+            x += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            v[i] = z ^ (z >> 31);
+        }
+    }
+};
+static const GearTable GEAR;
+
+// 期望长度之前用更难满足的掩码，之后用更易满足的掩码（归一化切分）
+static constexpr uint64_t MASK_S = ((1ULL << 15) - 1) << 49;
+static constexpr uint64_t MASK_L = ((1ULL << 11) - 1) << 53;
+
+size_t cdc_cut(const uint8_t* p, size_t n){
+    if(n <= CDC_MIN) return n;
+    size_t end = std::min(n, CDC_MAX);
+    size_t normal = std::min(end, CDC_AVG);
+    uint64_t h = 0;
+    size_t i = CDC_MIN;
+    for(; i < normal; i++){
+        h = (h << 1) + GEAR.v[p[i]];
+        if(!(h & MASK_S)) return i + 1;
+    }
+    for(; i < end; i++){
+        h = (h << 1) + GEAR.v[p[i]];
+        if(!(h & MASK_L)) return i + 1;
+    }
+    return end;
+}
+
+void cdc_split(const uint8_t* data, size_t len, std::vector<ChunkRef>& out){
+    size_t pos = 0;
+    while(pos < len){
+        size_t n = cdc_cut(data + pos, len - pos);
+        ChunkRef r;
+        r.len = (uint32_t)n;
+        r.offset = pos;
+        sha256_calc(data + pos, n, r.hash.data());
+        out.push_back(r);
+        pos += n;
+    }
+}
+
+bool cdc_split_file(const std::string& path, std::vector<ChunkRef>& out, uint64_t& size){
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs) return false;
+    out.clear();
+    std::vector<uint8_t> buf((1 << 20) + CDC_MAX);
+    size_t have = 0;      // 缓冲区中的有效字节
+    uint64_t base = 0;    // buf[0]在文件中的偏移
+    bool eof = false;
+    while(true){
+        // 1. 补满缓冲区
+        if(!eof){
+            ifs.read((char*)buf.data() + have, (std::streamsize)(buf.size() - have));
+            have += (size_t)ifs.gcount();
+            if(!ifs) eof = true;
+        }
+        // 2. 数据足够一个最大分块（或已到文件末尾）时切分
+        size_t pos = 0;
+        while(have - pos >= CDC_MAX || (eof && pos < have)){
+            size_t n = cdc_cut(buf.data() + pos, have - pos);
+            ChunkRef r;
+            r.len = (uint32_t)n;
+            r.offset = base + pos;
+            sha256_calc(buf.data() + pos, n, r.hash.data());
+            out.push_back(r);
+            pos += n;
+        }
+        // 3. 剩余不足一个最大分块的数据移到缓冲区开头
+        memmove(buf.data(), buf.data() + pos, have - pos);
+        base += pos;
+        have -= pos;
+        if(eof) break;
+    }
+    size = base;
+    return true;
+}
+
+std::string chunk_hex(const ChunkHash& h){
+    static const char* d = "0123456789abcdef";
+    std::string s(64, '0');
+    for(int i=0;i<32;i++){ s[i*2] = d[h[i] >> 4]; s[i*2+1] = d[h[i] & 15]; }
+    return s;
+}
+
+// ---------- 清单编解码 ----------
+
+std::vector<uint8_t> encode_manifest(uint32_t target, const FileManifest& m){
+    uint16_t name_len = (uint16_t)m.name.size();
+    uint32_t count = (uint32_t)m.chunks.size();
+    std::vector<uint8_t> p(4 + 4 + 2 + name_len + 8 + 4 + (size_t)count * 36);
+    uint8_t* w = p.data();
+    memcpy(w, &target, 4); w += 4;
+    memcpy(w, &m.xfer_id, 4); w += 4;
+    memcpy(w, &name_len, 2); w += 2;
+    memcpy(w, m.name.data(), name_len); w += name_len;
+    memcpy(w, &m.size, 8); w += 8;
+    memcpy(w, &count, 4); w += 4;
+    for(auto& c : m.chunks){
+        memcpy(w, c.hash.data(), 32); w += 32;
+        memcpy(w, &c.len, 4); w += 4;
+    }
+    return p;
+}
+
+bool decode_manifest(const uint8_t* p, size_t n, FileManifest& m){
+    if(n < 4 + 2) return false;
+    memcpy(&m.xfer_id, p, 4);
+    uint16_t name_len; memcpy(&name_len, p + 4, 2);
+    size_t off = 6;
+    if(n < off + name_len + 8 + 4) return false;
+    m.name.assign((const char*)p + off, name_len); off += name_len;
+    memcpy(&m.size, p + off, 8); off += 8;
+    uint32_t count; memcpy(&count, p + off, 4); off += 4;
+    if(count > MAX_MANIFEST_CHUNKS || (n - off) / 36 < count) return false;
+    m.chunks.resize(count);
+    uint64_t pos = 0;
+    for(auto& c : m.chunks){
+        memcpy(c.hash.data(), p + off, 32); off += 32;
+        memcpy(&c.len, p + off, 4); off += 4;
+        c.offset = pos;
+        pos += c.len;
+    }
+    return pos == m.size;
+}
+
+// ---------- 本地分块仓库 ----------
+
+bool ChunkStore::open(const std::string& dir, uint64_t max_bytes){
+    std::lock_guard<std::mutex> lk(mtx);
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    path = dir + "/pack.dat";
+    cap = max_bytes;
+    index.clear();
+    recent.clear();
+    end = 0;
+
+    // 1. 扫描已有pack文件建立索引，丢弃末尾不完整的记录（文件中越靠后的记录越近使用过）
+    uint64_t total = fs::exists(path, ec) ? fs::file_size(path, ec) : 0;
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        uint8_t hdr[36];
+        while(ifs && end + 36 <= total && ifs.read((char*)hdr, 36)){
+            ChunkHash h; memcpy(h.data(), hdr, 32);
+            uint32_t len; memcpy(&len, hdr + 32, 4);
+            uint64_t next = end + 36 + len;
+            if(next > total) break;
+            auto it = index.find(h);
+            if(it != index.end()){
+                it->second.offset = end + 36;
+                touch(it->second);
+            } else {
+                recent.push_front(h);
+                index[h] = Loc{end + 36, len, recent.begin()};
+            }
+            end = next;
+            ifs.seekg((std::streamoff)end);
+        }
+    }
+    if(total != end) fs::resize_file(path, end, ec);
+
+    // 2. 以读写方式打开（文件不存在时先创建）
+    if(!fs::exists(path, ec)) std::ofstream(path, std::ios::binary);
+    file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    return (bool)file;
+}
+
+void ChunkStore::touch(const Loc& l) const {
+    recent.splice(recent.begin(), recent, l.use);
+}
+
+bool ChunkStore::has(const ChunkHash& h) const {
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = index.find(h);
+    if(it == index.end()) return false;
+    touch(it->second);
+    return true;
+}
+
+bool ChunkStore::put(const ChunkHash& h, const uint8_t* data, size_t len){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = index.find(h);
+    if(it != index.end()){
+        touch(it->second);
+        return true;
+    }
+    if(!file) return false;
+    if(end + 36 + len > cap) compact();   // 压缩失败时继续追加，下次再试
+    uint32_t l = (uint32_t)len;
+    file.seekp((std::streamoff)end);
+    file.write((const char*)h.data(), 32);
+    file.write((const char*)&l, 4);
+    file.write((const char*)data, (std::streamsize)len);
+    file.flush();
+    if(!file){ file.clear(); return false; }
+    recent.push_front(h);
+    index[h] = Loc{end + 36, l, recent.begin()};
+    end += 36 + len;
+    return true;
+}
+
+bool ChunkStore::get(const ChunkHash& h, std::vector<uint8_t>& out) const {
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = index.find(h);
+    if(it == index.end() || !file) return false;
+    out.resize(it->second.len);
+    file.seekg((std::streamoff)it->second.offset);
+    file.read((char*)out.data(), it->second.len);
+    if(!file){ file.clear(); return false; }
+    touch(it->second);
+    return true;
+}
+
+bool ChunkStore::compact(){
+    // 1. 选出保留的分块：固定的全部保留，其余从最近使用的开始，直到3/4容量
+    uint64_t budget = cap / 4 * 3, kept = 0;
+    std::vector<std::pair<ChunkHash, uint32_t>> keep;
+    for(auto& h : recent){
+        uint32_t len = index[h].len;
+        if(pins.count(h) || kept + 36 + len <= budget){
+            keep.emplace_back(h, len);
+            kept += 36 + len;
+        }
+    }
+    if(keep.size() == index.size()) return false;
+
+    // 2. 按从旧到新的顺序写入临时文件
+    std::string tmp = path + ".tmp";
+    std::error_code ec;
+    {
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        std::vector<uint8_t> buf;
+        for(auto it = keep.rbegin(); it != keep.rend() && ofs; ++it){
+            buf.resize(it->second);
+            file.seekg((std::streamoff)index[it->first].offset);
+            if(!file.read((char*)buf.data(), it->second)){ file.clear(); ofs.setstate(std::ios::failbit); break; }
+            ofs.write((const char*)it->first.data(), 32);
+            ofs.write((const char*)&it->second, 4);
+            ofs.write((const char*)buf.data(), (std::streamsize)buf.size());
+        }
+        if(!ofs){
+            ofs.close();
+            fs::remove(tmp, ec);
+            return false;
+        }
+    }
+
+    // 3. 替换pack文件并重建索引
+    file.close();
+    fs::rename(tmp, path, ec);
+    file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    if(ec){
+        fs::remove(tmp, ec);
+        return false;
+    }
+    index.clear();
+    recent.clear();
+    end = 0;
+    for(auto it = keep.rbegin(); it != keep.rend(); ++it){
+        recent.push_front(it->first);
+        index[it->first] = Loc{end + 36, it->second, recent.begin()};
+        end += 36 + it->second;
+    }
+    return (bool)file;
+}
+
+void ChunkStore::pin(const ChunkHash& h){
+    std::lock_guard<std::mutex> lk(mtx);
+    pins[h]++;
+}
+
+void ChunkStore::unpin(const ChunkHash& h){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = pins.find(h);
+    if(it != pins.end() && --it->second == 0) pins.erase(it);
+}
+
+size_t ChunkStore::size() const {
+    std::lock_guard<std::mutex> lk(mtx);
+    return index.size();
+}
+
+uint64_t ChunkStore::bytes() const {
+    std::lock_guard<std::mutex> lk(mtx);
+    return end;
+}
+
+// ---------- 服务器分块缓存 ----------
+
+static constexpr size_t MAX_CHUNK_OWNERS = 16;   // 每个分块记录的上传者数
+
+ChunkCache::Data ChunkCache::get(const ChunkHash& h, uint32_t owner){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = map.find(h);
+    if(it == map.end()) return nullptr;
+    auto& owners = it->second->owners;
+    if(std::find(owners.begin(), owners.end(), owner) == owners.end()) return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->data;
+}
+
+void ChunkCache::put(const ChunkHash& h, Data d, uint32_t owner){
+    if(!d || d->size() > cap) return;
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = map.find(h);
+    if(it != map.end()){
+        auto& owners = it->second->owners;
+        if(std::find(owners.begin(), owners.end(), owner) == owners.end()){
+            if(owners.size() >= MAX_CHUNK_OWNERS) owners.erase(owners.begin());
+            owners.push_back(owner);
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        return;
+    }
+    used += d->size();
+    lru.push_front(Entry{h, std::move(d), {owner}});
+    map[h] = lru.begin();
+    while(used > cap){
+        auto& last = lru.back();
+        used -= last.data->size();
+        map.erase(last.hash);
+        lru.pop_back();
+    }
+}
+
+// ---------- 客户端去重传输 ----------
+
+DedupTransfer::DedupTransfer(const std::string& store_dir, SendFn s, Delivery& l, StatusFn st, uint64_t store_bytes)
+    : send(std::move(s)), link(l), status(std::move(st)) {
+    store.open(store_dir, store_bytes);
+}
+
+bool DedupTransfer::send_file(uint32_t target, const std::string& path, TransferStatus& st, std::string& err){
+    // 1. 切分文件，计算分块哈希
+    FileManifest m;
+    if(!cdc_split_file(path, m.chunks, m.size)){ err = "read file failed"; return false; }
+    if(m.chunks.size() > MAX_MANIFEST_CHUNKS){ err = "file too large"; return false; }
+    size_t slash = path.find_last_of("/\\");
+    m.name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+    // 2. 记住分块位置以便响应对方的请求；先移除已结束的清单，进行中的传输已达上限时拒绝
+    Outgoing og;
+    og.target = target;
+    og.path = path;
+    og.name = m.name;
+    og.size = m.size;
+    for(auto& c : m.chunks) og.chunks.emplace(c.hash, c);
+    og.last_active = Clock::now();
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        expire_outgoing(og.last_active);
+        if(outgoing.size() >= MAX_OUTGOING_TRANSFERS){ err = "too many file transfers in progress"; return false; }
+        m.xfer_id = next_xfer++;
+        outgoing[m.xfer_id] = std::move(og);
+    }
+
+    // 3. 只发送清单，分块等对方请求
+    st = TransferStatus{};
+    st.peer = target;
+    st.name = m.name;
+    st.size = m.size;
+    return send(MT_FILE_MANIFEST, encode_manifest(target, m));
+}
+
+void DedupTransfer::on_message(uint8_t type, uint32_t sender, const uint8_t* body, size_t len){
+    if(type == MT_FILE_MANIFEST) on_manifest(sender, body, len);
+    else if(type == MT_CHUNK_REQUEST) on_request(sender, body, len);
+    else if(type == MT_CHUNK_DATA) on_data(sender, body, len);
+}
+
+// 清单中的文件名只取最后一级，拒绝空名、"."和".."（对方不能借文件名写到当前目录之外）
+static bool safe_file_name(const std::string& name, std::string& out){
+    std::string n = name;
+    std::replace(n.begin(), n.end(), '\\', '/');
+    out = fs::u8path(n).filename().u8string();
+    return !out.empty() && out != "." && out != ".." && out.find(':') == std::string::npos;
+}
+
+void DedupTransfer::on_manifest(uint32_t sender, const uint8_t* body, size_t len){
+    Assembly a;
+    if(!decode_manifest(body, len, a.m)) return;
+    std::string name;
+    if(!safe_file_name(a.m.name, name)) return;
+    a.st.peer = sender;
+    a.st.name = name;
+    a.st.size = a.m.size;
+    a.st.out = "recv_from_" + std::to_string(sender) + "_" + name;
+
+    // 1. 内容标识：所有分块哈希的SHA-256
+    Sha256 kh;
+    for(auto& c : a.m.chunks) kh.update(c.hash.data(), 32);
+    kh.final(a.st.content_key.data());
+
+    // 2. 固定清单中的全部分块（拼装前不会被仓库压缩丢弃），找出本地仓库中缺少的分块
+    for(auto& c : a.m.chunks){
+        store.pin(c.hash);
+        if(store.has(c.hash)) a.st.have += c.len;
+        else a.missing[c.hash] += c.len;
+    }
+    if(a.missing.empty()){
+        finish(a);
+        release(a);
+        status(a.st);
+        return;
+    }
+
+    // 3. 分批请求缺少的分块
+    std::vector<std::vector<uint8_t>> reqs;
+    request_missing(sender, a, reqs);
+    a.last_progress = Clock::now();
+    TransferStatus st = a.st;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto key = std::make_pair(sender, a.m.xfer_id);
+        auto old = incoming.find(key);
+        if(old != incoming.end()){
+            release(old->second);
+            incoming.erase(old);
+        }
+        incoming[key] = std::move(a);
+    }
+    status(st);
+    for(auto& p : reqs) send(MT_CHUNK_REQUEST, p);
+}
+
+void DedupTransfer::request_missing(uint32_t sender, const Assembly& a, std::vector<std::vector<uint8_t>>& reqs){
+    std::vector<ChunkHash> want;
+    for(auto& kv : a.missing) want.push_back(kv.first);
+    for(size_t i = 0; i < want.size(); i += REQUEST_BATCH){
+        uint32_t count = (uint32_t)std::min(REQUEST_BATCH, want.size() - i);
+        std::vector<uint8_t> p(4 + 4 + 4 + (size_t)count * 32);
+        memcpy(p.data(), &sender, 4);
+        memcpy(p.data() + 4, &a.m.xfer_id, 4);
+        memcpy(p.data() + 8, &count, 4);
+        for(uint32_t k = 0; k < count; k++) memcpy(p.data() + 12 + k * 32, want[i + k].data(), 32);
+        reqs.push_back(std::move(p));
+    }
+}
+
+void DedupTransfer::on_request(uint32_t sender, const uint8_t* body, size_t len){
+    if(len < 8) return;
+    uint32_t xfer, count;
+    memcpy(&xfer, body, 4);
+    memcpy(&count, body + 4, 4);
+    if((len - 8) / 32 < count) return;
+
+    // 1. 查出请求的分块在文件中的位置
+    std::string path;
+    std::vector<ChunkRef> refs;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = outgoing.find(xfer);
+        if(it == outgoing.end() || it->second.target != sender) return;
+        it->second.last_active = Clock::now();
+        path = it->second.path;
+        for(uint32_t k = 0; k < count; k++){
+            ChunkHash h; memcpy(h.data(), body + 8 + k * 32, 32);
+            auto c = it->second.chunks.find(h);
+            if(c != it->second.chunks.end()) refs.push_back(c->second);
+        }
+    }
+    std::sort(refs.begin(), refs.end(), [](const ChunkRef& a, const ChunkRef& b){ return a.offset < b.offset; });
+
+    // 2. 按文件顺序放入发送窗口：[xfer_id:4][sha256:32][data]，窗口打开（或重传）时才读取文件；
+    //    分块被放弃（重传超过上限或对端离线）时该传输以失败结束；窗口排队期间每次读取都算作清单的活动
+    auto file = std::make_shared<SourceFile>();
+    file->ifs.open(path, std::ios::binary);
+    if(!file->ifs) return;
+    Delivery::FailFn failed = [this, sender, xfer]{ send_failed(sender, xfer); };
+    for(auto& r : refs){
+        link.send_windowed(sender, MT_CHUNK_DATA, 4 + 32 + r.len, [this, file, xfer, r](std::vector<uint8_t>& p){
+            touch_outgoing(xfer);
+            size_t off = p.size();
+            p.resize(off + 4 + 32 + r.len);
+            memcpy(p.data() + off, &xfer, 4);
+            memcpy(p.data() + off + 4, r.hash.data(), 32);
+            std::lock_guard<std::mutex> lk(file->mtx);
+            file->ifs.clear();
+            file->ifs.seekg((std::streamoff)r.offset);
+            return (bool)file->ifs.read((char*)p.data() + off + 36, r.len);
+        }, failed);
+    }
+}
+
+void DedupTransfer::on_data(uint32_t sender, const uint8_t* body, size_t len){
+    if(len < 36) return;
+    uint32_t xfer; memcpy(&xfer, body, 4);
+    ChunkHash h; memcpy(h.data(), body + 4, 32);
+    const uint8_t* data = body + 36;
+    size_t dlen = len - 36;
+
+    // 1. 校验哈希后存入仓库
+    ChunkHash actual;
+    sha256_calc(data, dlen, actual.data());
+    if(actual != h) return;
+    store.put(h, data, dlen);
+
+    // 2. 更新对应的接收任务，全部到齐时拼装文件
+    Assembly done;
+    TransferStatus st;
+    bool complete = false;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = incoming.find({sender, xfer});
+        if(it == incoming.end()) return;
+        Assembly& a = it->second;
+        auto m = a.missing.find(h);
+        if(m == a.missing.end()) return;
+        a.st.have += m->second;
+        a.st.fetched += dlen;
+        a.missing.erase(m);
+        a.last_progress = Clock::now();
+        a.retries = 0;
+        if(a.missing.empty()){
+            done = std::move(a);
+            incoming.erase(it);
+            complete = true;
+        } else {
+            st = a.st;
+        }
+    }
+    if(complete){
+        finish(done);
+        release(done);
+        st = done.st;
+    }
+    status(st);
+}
+
+void DedupTransfer::tick(){
+    auto now = Clock::now();
+    std::vector<std::vector<uint8_t>> reqs;
+    std::vector<Assembly> failed;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        expire_outgoing(now);
+        for(auto it = incoming.begin(); it != incoming.end();){
+            Assembly& a = it->second;
+            if(now - a.last_progress < CHUNK_STALL_TIMEOUT){ ++it; continue; }
+            if(a.retries >= MAX_CHUNK_RETRIES){
+                failed.push_back(std::move(a));
+                it = incoming.erase(it);
+                continue;
+            }
+            a.retries++;
+            a.last_progress = now;
+            request_missing(it->first.first, a, reqs);
+            ++it;
+        }
+    }
+    fail_incoming(failed);
+    for(auto& p : reqs) send(MT_CHUNK_REQUEST, p);
+}
+
+// 在锁外调用：解除固定并报告失败
+void DedupTransfer::fail_incoming(std::vector<Assembly>& failed){
+    for(auto& a : failed){
+        release(a);
+        a.st.done = true;
+        a.st.ok = false;
+        status(a.st);
+    }
+}
+
+// 发往target的分块被放弃：对方已无法收齐，停止提供该文件（之后的请求不再响应），只报告一次
+void DedupTransfer::send_failed(uint32_t target, uint32_t xfer){
+    TransferStatus st;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = outgoing.find(xfer);
+        if(it == outgoing.end() || it->second.target != target) return;
+        st.peer = target;
+        st.name = it->second.name;
+        st.size = it->second.size;
+        outgoing.erase(it);
+    }
+    st.done = true;
+    st.sending = true;
+    status(st);
+}
+
+// 窗口中的分块被读取发送：清单仍在使用
+void DedupTransfer::touch_outgoing(uint32_t xfer){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = outgoing.find(xfer);
+    if(it != outgoing.end()) it->second.last_active = Clock::now();
+}
+
+// 移除超过OUTGOING_IDLE_TIMEOUT没有活动的清单（调用方持有mtx）
+void DedupTransfer::expire_outgoing(Clock::time_point now){
+    for(auto it = outgoing.begin(); it != outgoing.end();){
+        if(now - it->second.last_active > OUTGOING_IDLE_TIMEOUT) it = outgoing.erase(it);
+        else ++it;
+    }
+}
+
+void DedupTransfer::drop_peer(uint32_t peer){
+    std::vector<Assembly> failed;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        for(auto it = incoming.begin(); it != incoming.end();){
+            if(it->first.first != peer){ ++it; continue; }
+            failed.push_back(std::move(it->second));
+            it = incoming.erase(it);
+        }
+        for(auto it = outgoing.begin(); it != outgoing.end();){
+            if(it->second.target != peer) ++it;
+            else it = outgoing.erase(it);
+        }
+    }
+    fail_incoming(failed);
+}
+
+void DedupTransfer::reset(){
+    std::vector<Assembly> failed;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        for(auto& kv : incoming) failed.push_back(std::move(kv.second));
+        incoming.clear();
+        outgoing.clear();
+    }
+    fail_incoming(failed);
+}
+
+void DedupTransfer::release(const Assembly& a){
+    for(auto& c : a.m.chunks) store.unpin(c.hash);
+}
+
+bool DedupTransfer::finish(Assembly& a){
+    a.st.done = true;
+    a.st.ok = false;
+    std::ofstream ofs(a.st.out, std::ios::binary | std::ios::trunc);
+    if(!ofs) return false;
+    std::vector<uint8_t> buf;
+    for(auto& c : a.m.chunks){
+        if(!store.get(c.hash, buf)) return false;
+        ofs.write((const char*)buf.data(), (std::streamsize)buf.size());
+    }
+    a.st.ok = (bool)ofs;
+    return a.st.ok;
+}
@@ -0,0 +1,446 @@
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "../include/delivery.hpp"
+#include "../include/protocol.hpp"
+#include "../include/dedup.hpp"
+
+// 回执：最多延迟5ms，或每收到8条消息立即发送一次；最多携带最近的16个选择确认区间
+static constexpr auto     ACK_DELAY = std::chrono::milliseconds(5);
+static constexpr uint32_t ACK_EVERY = 8;
+static constexpr size_t   MAX_SACK_RANGES = 16;
+static constexpr size_t   MAX_UNREAD = 4096;
+// 接收端保留的区间上限：正常时空缺会被补齐或由MT_SKIP放弃，超过说明对端异常，此时才跳过最早的空缺
+static constexpr size_t   MAX_GAPS = 4096;
+// 发送端记录的已放弃序号上限（也是一个MT_SKIP最多携带的序号数）
+static constexpr size_t   MAX_ABANDONED = 1024;
+
+// 重传：RTO范围（秒）和最多重传次数，超过后放弃（文本报告FAILED，分块调用失败回调，并通知接收端跳过）
+static constexpr double RTO_INIT = 0.5;
+static constexpr double RTO_MIN  = 0.2;
+static constexpr double RTO_MAX  = 5.0;
+static constexpr int    MAX_RETRIES = 5;
+static constexpr auto   MIN_RTT_WINDOW = std::chrono::seconds(10);
+
+// 窗口（字节）：每轮估计排队量 = cwnd * (1 - 最小RTT / 本轮RTT)，
+// 慢启动阶段排队量超过GAMMA时退出；之后低于ALPHA增大一步，高于BETA减小一步
+static constexpr size_t CWND_MIN  = 4 * CDC_MAX;
+static constexpr size_t CWND_INIT = 8 * CDC_MAX;
+static constexpr size_t CWND_MAX  = 16 * 1024 * 1024;
+static constexpr size_t CWND_STEP = 2 * CDC_AVG;
+static constexpr double VEGAS_ALPHA = 4 * CDC_AVG;
+static constexpr double VEGAS_BETA  = 12 * CDC_AVG;
+static constexpr double VEGAS_GAMMA = 8 * CDC_AVG;
+
+Delivery::Outbound::Outbound(): rto(RTO_INIT), cwnd(CWND_INIT) {}
+
+Delivery::Delivery(SendFn send, ReceiptFn on_receipt): send(std::move(send)), notify(std::move(on_receipt)) {}
+
+// ---------- 发送 ----------
+
+uint32_t Delivery::send_text(uint32_t peer, uint8_t type, const uint8_t* body, size_t len){
+    auto data = std::make_shared<std::vector<uint8_t>>(body, body + len);
+    Producer make = [data](std::vector<uint8_t>& p){ p.insert(p.end(), data->begin(), data->end()); return true; };
+    std::vector<Out> out;
+    uint32_t seq;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        Outbound& o = outbound[peer];
+        seq = o.next_seq++;
+        o.inflight[seq] = Pending{type, false, len, make, nullptr, Clock::now()};
+        out.push_back({peer, seq, type, std::move(make)});
+    }
+    transmit(out);
+    return seq;
+}
+
+void Delivery::send_windowed(uint32_t peer, uint8_t type, size_t size, Producer make, FailFn failed){
+    std::vector<Out> out;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        Outbound& o = outbound[peer];
+        o.queue.push_back({type, size, std::move(make), std::move(failed)});
+        pump(peer, o, Clock::now(), out);
+    }
+    transmit(out);
+}
+
+// 从队列中取出窗口允许的分块（窗口为空时至少发送一个，避免大于窗口的分块无法发送）
+void Delivery::pump(uint32_t peer, Outbound& o, Clock::time_point now, std::vector<Out>& out){
+    while(!o.queue.empty() && (o.inflight_bytes == 0 || o.inflight_bytes + o.queue.front().size <= o.cwnd)){
+        Queued q = std::move(o.queue.front());
+        o.queue.pop_front();
+        uint32_t seq = o.next_seq++;
+        o.inflight_bytes += q.size;
+        out.push_back({peer, seq, q.type, q.make});
+        o.inflight[seq] = Pending{q.type, true, q.size, std::move(q.make), std::move(q.failed), now};
+    }
+}
+
+// 在锁外组装并发送：[peer:4][seq:4][消息体]
+void Delivery::transmit(std::vector<Out>& out){
+    std::vector<uint8_t> p;
+    for(auto& m : out){
+        p.resize(8);
+        memcpy(p.data(), &m.peer, 4);
+        memcpy(p.data() + 4, &m.seq, 4);
+        if(!m.make(p)) continue;   // 数据已不可用，等待超时后放弃
+        send(m.type, FLAG_SEQ, p);
+    }
+}
+
+// ---------- 接收 ----------
+
+bool Delivery::seen(const Inbound& in, uint32_t seq){
+    if(seq <= in.cum) return true;
+    auto it = in.ranges.upper_bound(seq);
+    return it != in.ranges.begin() && std::prev(it)->second >= seq;
+}
+
+// 记录序号：紧接cum时推进cum并吸收后面相连的区间，否则与相邻区间合并
+void Delivery::record(Inbound& in, uint32_t seq){
+    if(seq == in.cum + 1){
+        in.cum = seq;
+        while(!in.ranges.empty() && in.ranges.begin()->first == in.cum + 1){
+            in.cum = in.ranges.begin()->second;
+            in.ranges.erase(in.ranges.begin());
+        }
+        return;
+    }
+    uint32_t first = seq, last = seq;
+    auto next = in.ranges.upper_bound(seq);
+    if(next != in.ranges.end() && next->first == seq + 1){
+        last = next->second;
+        next = in.ranges.erase(next);
+    }
+    if(next != in.ranges.begin() && std::prev(next)->second == seq - 1){
+        first = std::prev(next)->first;
+        in.ranges.erase(std::prev(next));
+    }
+    in.ranges[first] = last;
+    if(in.ranges.size() > MAX_GAPS){
+        in.cum = in.ranges.begin()->second;
+        in.ranges.erase(in.ranges.begin());
+    }
+}
+
+bool Delivery::on_sequenced(uint32_t sender, uint32_t seq){
+    std::vector<uint8_t> receipt;
+    bool fresh;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        Inbound& in = inbound[sender];
+        fresh = !seen(in, seq);
+        if(fresh){
+            record(in, seq);
+            in.highest = std::max(in.highest, seq);
+        }
+        // 累计到一定数量立即回执；重复消息说明回执丢失或发送端已超时，也立即回执（并确保包含该序号）
+        if(!in.dirty){ in.dirty = true; in.first_unacked = Clock::now(); }
+        in.unacked++;
+        if(in.unacked >= ACK_EVERY || !fresh) receipt = build_receipt(sender, in, fresh ? 0 : seq);
+    }
+    if(!receipt.empty()) send(MT_RECEIPT, 0, receipt);
+    return fresh;
+}
+
+void Delivery::on_skip(uint32_t sender, const uint8_t* body, size_t len){
+    if(len < 2) return;
+    uint16_t count;
+    memcpy(&count, body, 2);
+    if((len - 2) / 4 < count) return;
+    std::lock_guard<std::mutex> lk(mtx);
+    Inbound& in = inbound[sender];
+    for(uint16_t i = 0; i < count; i++){
+        uint32_t seq;
+        memcpy(&seq, body + 2 + i * 4, 4);
+        if(seq && !seen(in, seq)) record(in, seq);
+    }
+    // 尽快回执，发送端看到cum越过空缺后不再重发MT_SKIP
+    if(!in.dirty){ in.dirty = true; in.first_unacked = Clock::now(); }
+}
+
+void Delivery::mark_read(uint32_t sender){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = inbound.find(sender);
+    if(it == inbound.end() || it->second.read >= it->second.highest) return;
+    Inbound& in = it->second;
+    in.read = in.highest;
+    if(!in.dirty){ in.dirty = true; in.first_unacked = Clock::now(); }
+}
+
+void Delivery::mark_read_all(){
+    std::lock_guard<std::mutex> lk(mtx);
+    for(auto& kv : inbound){
+        Inbound& in = kv.second;
+        if(in.read >= in.highest) continue;
+        in.read = in.highest;
+        if(!in.dirty){ in.dirty = true; in.first_unacked = Clock::now(); }
+    }
+}
+
+// 只写入最近的MAX_SACK_RANGES个区间；include非0时（重复消息触发）保证包含它所在的区间
+std::vector<uint8_t> Delivery::build_receipt(uint32_t peer, Inbound& in, uint32_t include){
+    std::vector<std::pair<uint32_t, uint32_t>> sel;
+    for(auto it = in.ranges.rbegin(); it != in.ranges.rend() && sel.size() < MAX_SACK_RANGES; ++it) sel.push_back(*it);
+    if(include > in.cum && sel.size() == MAX_SACK_RANGES && include < sel.back().first){
+        auto it = in.ranges.upper_bound(include);
+        if(it != in.ranges.begin() && std::prev(it)->second >= include) sel.back() = *std::prev(it);
+    }
+    uint16_t count = (uint16_t)sel.size();
+    std::vector<uint8_t> p(4 + 4 + 4 + 2 + (size_t)count * 8);
+    memcpy(p.data(), &peer, 4);
+    memcpy(p.data() + 4, &in.cum, 4);
+    memcpy(p.data() + 8, &in.read, 4);
+    memcpy(p.data() + 12, &count, 2);
+    size_t off = 14;
+    for(auto& r : sel){
+        memcpy(p.data() + off, &r.first, 4);
+        memcpy(p.data() + off + 4, &r.second, 4);
+        off += 8;
+    }
+    in.dirty = false;
+    in.unacked = 0;
+    return p;
+}
+
+// MT_SKIP：[peer:4][count:2] + count*[seq:4]
+std::vector<uint8_t> Delivery::build_skip(uint32_t peer, const std::set<uint32_t>& seqs){
+    uint16_t count = (uint16_t)std::min(seqs.size(), MAX_ABANDONED);
+    std::vector<uint8_t> p(4 + 2 + (size_t)count * 4);
+    memcpy(p.data(), &peer, 4);
+    memcpy(p.data() + 4, &count, 2);
+    size_t off = 6;
+    for(auto it = seqs.begin(); it != seqs.end() && off < p.size(); ++it, off += 4) memcpy(p.data() + off, &*it, 4);
+    return p;
+}
+
+// ---------- 回执 ----------
+
+void Delivery::on_receipt(uint32_t sender, const uint8_t* body, size_t len){
+    if(len < 10) return;
+    uint32_t cum, read;
+    uint16_t count;
+    memcpy(&cum, body, 4);
+    memcpy(&read, body + 4, 4);
+    memcpy(&count, body + 8, 2);
+    if((len - 10) / 8 < count) return;
+
+    std::vector<Out> out;
+    std::vector<std::pair<uint32_t, ReceiptState>> events;
+    std::vector<uint8_t> skip;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto oit = outbound.find(sender);
+        if(oit == outbound.end()) return;
+        Outbound& o = oit->second;
+        auto now = Clock::now();
+
+        // 1. 移除被确认的消息：累积确认部分 + 各选择确认区间
+        uint32_t newest = 0;
+        double sample = -1;
+        auto ack = [&](std::map<uint32_t, Pending>::iterator it){
+            Pending& p = it->second;
+            if(p.retries == 0 && it->first >= newest){   // 重传过的消息无法区分是哪一次的回执，不取样
+                newest = it->first;
+                sample = std::chrono::duration<double>(now - p.sent).count();
+            }
+            if(p.windowed) o.inflight_bytes -= p.size;
+            else if(notify){
+                if(it->first <= read) events.push_back({it->first, ReceiptState::READ});
+                else {
+                    events.push_back({it->first, ReceiptState::DELIVERED});
+                    o.unread.insert(it->first);
+                    if(o.unread.size() > MAX_UNREAD) o.unread.erase(o.unread.begin());
+                }
+            }
+            return o.inflight.erase(it);
+        };
+        for(auto it = o.inflight.begin(); it != o.inflight.end() && it->first <= cum;) it = ack(it);
+        for(uint16_t i = 0; i < count; i++){
+            uint32_t first, last;
+            memcpy(&first, body + 10 + i * 8, 4);
+            memcpy(&last, body + 14 + i * 8, 4);
+            for(auto it = o.inflight.lower_bound(first); it != o.inflight.end() && it->first <= last;) it = ack(it);
+        }
+
+        // 2. 已放弃的序号：接收端越过的不再记录；cum停在已放弃的空缺之前说明MT_SKIP没有生效，重发
+        o.abandoned.erase(o.abandoned.begin(), o.abandoned.upper_bound(cum));
+        if(o.abandoned.count(cum + 1)) skip = build_skip(sender, o.abandoned);
+
+        // 3. 已读：之前已送达的文本
+        if(read > o.read_cum){
+            o.read_cum = read;
+            while(!o.unread.empty() && *o.unread.begin() <= read){
+                if(notify) events.push_back({*o.unread.begin(), ReceiptState::READ});
+                o.unread.erase(o.unread.begin());
+            }
+        }
+
+        // 4. 更新RTT，确认到本轮最后一个序号时按本轮RTT调整窗口
+        if(sample >= 0){
+            rtt_sample(o, sample, now);
+            if(newest >= o.round_end){
+                on_round(o);
+                o.round_end = o.next_seq - 1;
+                o.round_min = 0;
+            }
+        }
+        pump(sender, o, now, out);
+    }
+    if(!skip.empty()) send(MT_SKIP, 0, skip);
+    transmit(out);
+    for(auto& e : events) notify(sender, e.first, e.second);
+}
+
+void Delivery::rtt_sample(Outbound& o, double r, Clock::time_point now){
+    if(o.srtt == 0){
+        o.srtt = r;
+        o.rttvar = r / 2;
+    } else {
+        o.rttvar = 0.75 * o.rttvar + 0.25 * std::abs(o.srtt - r);
+        o.srtt = 0.875 * o.srtt + 0.125 * r;
+    }
+    o.rto = std::clamp(o.srtt + std::max(0.01, 4 * o.rttvar), RTO_MIN, RTO_MAX);
+    if(o.min_rtt == 0 || r < o.min_rtt || now - o.min_rtt_at > MIN_RTT_WINDOW){
+        o.min_rtt = r;
+        o.min_rtt_at = now;
+    }
+    if(o.round_min == 0 || r < o.round_min) o.round_min = r;
+}
+
+// 每轮一次：只有窗口被占满过半时才增大（发送端自身数据不足时窗口没有被检验）
+// 排队过多时按超出部分的一半减小；退出慢启动时直接减去估计的排队量（回到带宽时延积附近）
+void Delivery::on_round(Outbound& o){
+    if(o.round_min <= 0 || o.min_rtt <= 0) return;
+    double queued = (double)o.cwnd * (1.0 - o.min_rtt / o.round_min);
+    bool limited = !o.queue.empty() || o.inflight_bytes * 2 >= o.cwnd;
+    if(o.slow_start){
+        if(queued > VEGAS_GAMMA){
+            o.slow_start = false;
+            o.cwnd -= std::min(o.cwnd, (size_t)queued);
+        } else if(limited) o.cwnd *= 2;
+    } else if(queued < VEGAS_ALPHA){
+        if(limited) o.cwnd += CWND_STEP;
+    } else if(queued > VEGAS_BETA){
+        o.cwnd -= std::min(o.cwnd, (size_t)((queued - VEGAS_ALPHA) / 2));
+    }
+    o.cwnd = std::clamp(o.cwnd, CWND_MIN, CWND_MAX);
+}
+
+// ---------- 定时 ----------
+
+void Delivery::tick(){
+    std::vector<std::vector<uint8_t>> receipts;
+    std::vector<Out> out;
+    std::vector<std::pair<uint32_t, uint32_t>> failed;
+    std::vector<FailFn> fails;
+    std::vector<std::vector<uint8_t>> skips;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto now = Clock::now();
+
+        // 1. 到期的回执
+        for(auto& kv : inbound){
+            Inbound& in = kv.second;
+            if(in.dirty && now - in.first_unacked >= ACK_DELAY) receipts.push_back(build_receipt(kv.first, in));
+        }
+
+        // 2. 超时重传（每次重传RTO加倍），重传过多则放弃并通知接收端；分块超时说明拥塞，窗口减半
+        for(auto& kv : outbound){
+            Outbound& o = kv.second;
+            bool timeout = false;
+            std::set<uint32_t> gave_up;
+            for(auto it = o.inflight.begin(); it != o.inflight.end();){
+                Pending& p = it->second;
+                double wait = std::min(o.rto * (1 << p.retries), RTO_MAX);
+                if(now - p.sent < std::chrono::duration<double>(wait)){ ++it; continue; }
+                if(p.windowed) timeout = true;
+                if(p.retries >= MAX_RETRIES){
+                    if(!p.windowed) failed.push_back({kv.first, it->first});
+                    else {
+                        o.inflight_bytes -= p.size;
+                        if(p.failed) fails.push_back(std::move(p.failed));
+                    }
+                    gave_up.insert(it->first);
+                    o.abandoned.insert(it->first);
+                    if(o.abandoned.size() > MAX_ABANDONED) o.abandoned.erase(o.abandoned.begin());
+                    it = o.inflight.erase(it);
+                    continue;
+                }
+                p.retries++;
+                p.sent = now;
+                o.retransmits++;
+                out.push_back({kv.first, it->first, p.type, p.make});
+                ++it;
+            }
+            if(timeout){
+                o.cwnd = std::max(CWND_MIN, o.cwnd / 2);
+                o.slow_start = false;
+            }
+            if(!gave_up.empty()) skips.push_back(build_skip(kv.first, gave_up));
+            pump(kv.first, o, now, out);
+        }
+    }
+    for(auto& r : receipts) send(MT_RECEIPT, 0, r);
+    for(auto& k : skips) send(MT_SKIP, 0, k);
+    transmit(out);
+    if(notify) for(auto& f : failed) notify(f.first, f.second, ReceiptState::FAILED);
+    for(auto& f : fails) f();
+}
+
+// ---------- 离线与断开 ----------
+
+// 调用方持有mtx；回调在锁外调用
+void Delivery::drop_locked(uint32_t peer, std::vector<std::pair<uint32_t, uint32_t>>& failed, std::vector<FailFn>& fails){
+    auto oit = outbound.find(peer);
+    if(oit != outbound.end()){
+        for(auto& kv : oit->second.inflight){
+            if(!kv.second.windowed) failed.push_back({peer, kv.first});
+            else if(kv.second.failed) fails.push_back(std::move(kv.second.failed));
+        }
+        for(auto& q : oit->second.queue) if(q.failed) fails.push_back(std::move(q.failed));
+        outbound.erase(oit);
+    }
+    inbound.erase(peer);
+}
+
+void Delivery::drop_peer(uint32_t peer){
+    std::vector<std::pair<uint32_t, uint32_t>> failed;
+    std::vector<FailFn> fails;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        drop_locked(peer, failed, fails);
+    }
+    if(notify) for(auto& f : failed) notify(f.first, f.second, ReceiptState::FAILED);
+    for(auto& f : fails) f();
+}
+
+void Delivery::reset(){
+    std::vector<std::pair<uint32_t, uint32_t>> failed;
+    std::vector<FailFn> fails;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::set<uint32_t> peers;
+        for(auto& kv : outbound) peers.insert(kv.first);
+        for(auto& kv : inbound) peers.insert(kv.first);
+        for(uint32_t p : peers) drop_locked(p, failed, fails);
+    }
+    if(notify) for(auto& f : failed) notify(f.first, f.second, ReceiptState::FAILED);
+    for(auto& f : fails) f();
+}
+
+bool Delivery::stats(uint32_t peer, LinkStats& out){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = outbound.find(peer);
+    if(it == outbound.end()) return false;
+    const Outbound& o = it->second;
+    out.srtt_ms = o.srtt * 1000;
+    out.min_rtt_ms = o.min_rtt * 1000;
+    out.cwnd = o.cwnd;
+    out.inflight = o.inflight_bytes;
+    out.queued = o.queue.size();
+    out.retransmits = o.retransmits;
+    return true;
+}
@@ -0,0 +1,610 @@
+#include <cstring>
+#include <cctype>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../include/history.hpp"
+#include "../include/crypto.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr uint32_t SEGMENT_MAGIC = 0x54535048;   // "HPST"
+static constexpr uint32_t SEGMENT_VERSION = 1;
+
+// ---------- 内存映射 ----------
+
+bool MappedFile::map(const std::string& path){
+    unmap();
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(f == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER sz;
+    if(!GetFileSizeEx(f, &sz)){ CloseHandle(f); return false; }
+    file = f;
+    if(sz.QuadPart == 0) return true;   // 空文件无法映射
+    HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!m){ unmap(); return false; }
+    mapping = m;
+    void* p = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if(!p){ unmap(); return false; }
+    ptr = (const uint8_t*)p;
+    len = (size_t)sz.QuadPart;
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0){ unmap(); return false; }
+    if(st.st_size == 0) return true;
+    void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED){ unmap(); return false; }
+    ptr = (const uint8_t*)p;
+    len = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void MappedFile::unmap(){
+#ifdef _WIN32
+    if(ptr) UnmapViewOfFile(ptr);
+    if(mapping) CloseHandle((HANDLE)mapping);
+    if(file) CloseHandle((HANDLE)file);
+    mapping = nullptr; file = nullptr;
+#else
+    if(ptr) munmap((void*)ptr, len);
+    if(fd >= 0) ::close(fd);
+    fd = -1;
+#endif
+    ptr = nullptr; len = 0;
+}
+
+// ---------- 分词 ----------
+
+static uint64_t fnv1a(const std::string& s){
+    uint64_t h = 1469598103934665603ULL;
+    for(unsigned char c : s){ h ^= c; h *= 1099511628211ULL; }
+    return h;
+}
+
+void history_tokenize(const char* text, size_t len, std::vector<std::string>& out){
+    std::string word;
+    size_t i = 0;
+    while(i < len){
+        unsigned char c = (unsigned char)text[i];
+        if(c < 0x80 && isalnum(c)){
+            word.push_back((char)tolower(c));
+            i++;
+            continue;
+        }
+        if(!word.empty()){ out.push_back(word); word.clear(); }
+        if(c < 0x80){ i++; continue; }
+        // 非ASCII：按UTF-8字符切分
+        size_t n = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+        if(n > 1 && i + n <= len) out.emplace_back(text + i, n);
+        i += n;
+    }
+    if(!word.empty()) out.push_back(word);
+}
+
+uint64_t history_now_ms(){
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string history_self_identity(const std::string& dir){
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    std::string path = dir + "/self.id";
+    std::string id;
+    if(FILE* f = fopen(path.c_str(), "rb")){
+        char buf[16];
+        if(fread(buf, 1, sizeof(buf), f) == sizeof(buf)) id.assign(buf, sizeof(buf));
+        fclose(f);
+        if(id.size() == 16 && id.find_first_not_of("0123456789abcdef") == std::string::npos) return id;
+        return {};   // 文件损坏时不覆盖（否则已有会话都会换key）
+    }
+    uint8_t raw[8];
+    if(!random_bytes(raw, sizeof(raw))) return {};
+    static const char hex[] = "0123456789abcdef";
+    id.clear();
+    for(uint8_t b : raw){ id.push_back(hex[b >> 4]); id.push_back(hex[b & 15]); }
+    FILE* f = fopen(path.c_str(), "wb");
+    if(!f) return {};
+    bool ok = fwrite(id.data(), 1, id.size(), f) == id.size();
+    if(fclose(f) != 0 || !ok) return {};
+    return id;
+}
+
+void history_remove(const std::string& dir, const std::string& key){
+    std::error_code ec;
+    std::string prefix = "conv_" + key + ".";
+    std::vector<fs::path> victims;
+    for(auto& ent : fs::directory_iterator(dir, ec)){
+        std::string name = ent.path().filename().string();
+        if(name.compare(0, prefix.size(), prefix) == 0) victims.push_back(ent.path());
+    }
+    for(auto& p : victims) fs::remove(p, ec);
+}
+
+// ---------- 倒排表段 ----------
+
+HistoryStore::SegmentTerm HistoryStore::Segment::term_at(size_t i) const {
+    SegmentTerm t;
+    memcpy(&t, map.data() + sizeof(SegmentHeader) + i * sizeof(SegmentTerm), sizeof(t));
+    return t;
+}
+
+bool HistoryStore::Segment::find(uint64_t h, const uint32_t*& p, size_t& n) const {
+    size_t lo = 0, hi = (size_t)terms;
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(term_at(mid).hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo == terms) return false;
+    SegmentTerm t = term_at(lo);
+    if(t.hash != h) return false;
+    p = postings() + t.start;
+    n = t.count;
+    return true;
+}
+
+std::string HistoryStore::segment_path(uint32_t first) const {
+    return base_path + "." + std::to_string(first) + ".pst";
+}
+
+// 写出一个段：先写临时文件再改名，改名前已映射的同名旧段必须先解除映射
+static bool write_segment_file(const std::string& path, const void* hdr, size_t hdr_len,
+                               const std::vector<std::pair<const void*, size_t>>& parts){
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if(!f) return false;
+    bool ok = fwrite(hdr, 1, hdr_len, f) == hdr_len;
+    for(auto& part : parts){
+        if(!ok) break;
+        if(part.second) ok = fwrite(part.first, 1, part.second, f) == part.second;
+    }
+    if(fclose(f) != 0) ok = false;
+    std::error_code ec;
+    if(ok) fs::rename(tmp, path, ec);
+    if(!ok || ec){ fs::remove(tmp, ec); return false; }
+    return true;
+}
+
+// 扫描并映射已有的段，返回段覆盖到的序号；损坏、与前一段不衔接或超出索引的段被删除
+uint32_t HistoryStore::load_segments(){
+    segments.clear();
+    std::error_code ec;
+    fs::path dir = fs::path(base_path).parent_path();
+    std::string prefix = fs::path(base_path).filename().string() + ".";
+    std::vector<std::pair<uint32_t, std::string>> found;
+    for(auto& ent : fs::directory_iterator(dir, ec)){
+        std::string name = ent.path().filename().string();
+        if(name.size() <= prefix.size() + 4 || name.compare(0, prefix.size(), prefix) != 0) continue;
+        std::string num = name.substr(prefix.size());
+        if(num.size() < 5 || num.compare(num.size() - 4, 4, ".pst") != 0) continue;
+        num.resize(num.size() - 4);
+        if(num.empty() || num.find_first_not_of("0123456789") != std::string::npos) continue;
+        found.push_back({(uint32_t)std::stoul(num), ent.path().string()});
+    }
+    std::sort(found.begin(), found.end());
+
+    uint32_t covered = 0;
+    for(auto& [first, path] : found){
+        auto seg = std::make_unique<Segment>();
+        seg->path = path;
+        SegmentHeader h{};
+        bool ok = first == covered && seg->map.map(path) && seg->map.size() >= sizeof(h);
+        if(ok){
+            memcpy(&h, seg->map.data(), sizeof(h));
+            ok = h.magic == SEGMENT_MAGIC && h.version == SEGMENT_VERSION && h.first == first
+              && h.end > h.first && h.end <= count
+              && seg->map.size() == sizeof(h) + h.terms * sizeof(SegmentTerm) + h.postings * 4;
+        }
+        if(!ok){
+            // 合并改名后异常退出会留下已被覆盖的旧段，序号错开或损坏的段同样丢弃（其范围从日志重建）
+            seg->map.unmap();
+            fs::remove(path, ec);
+            continue;
+        }
+        seg->first = h.first;
+        seg->end = h.end;
+        seg->terms = h.terms;
+        covered = h.end;
+        segments.push_back(std::move(seg));
+    }
+    return covered;
+}
+
+// 把内存中的倒排表写成新段并映射，然后按需合并
+bool HistoryStore::flush_tail(){
+    if(tail_first >= count) return true;
+    std::vector<uint64_t> hs;
+    hs.reserve(postings.size());
+    for(auto& kv : postings) hs.push_back(kv.first);
+    std::sort(hs.begin(), hs.end());
+
+    std::vector<SegmentTerm> dir;
+    dir.reserve(hs.size());
+    std::vector<std::pair<const void*, size_t>> parts;
+    uint32_t pos = 0;
+    for(uint64_t h : hs){
+        const auto& v = postings[h];
+        dir.push_back({h, pos, (uint32_t)v.size()});
+        pos += (uint32_t)v.size();
+    }
+    parts.push_back({dir.data(), dir.size() * sizeof(SegmentTerm)});
+    for(uint64_t h : hs){
+        const auto& v = postings[h];
+        parts.push_back({v.data(), v.size() * 4});
+    }
+    SegmentHeader hdr{SEGMENT_MAGIC, SEGMENT_VERSION, tail_first, (uint32_t)count, dir.size(), pos};
+
+    auto seg = std::make_unique<Segment>();
+    seg->path = segment_path(tail_first);
+    if(!write_segment_file(seg->path, &hdr, sizeof(hdr), parts) || !seg->map.map(seg->path)) return false;
+    seg->first = hdr.first;
+    seg->end = hdr.end;
+    seg->terms = hdr.terms;
+    segments.push_back(std::move(seg));
+    postings.clear();
+    tail_first = (uint32_t)count;
+    start_merges();
+    return true;
+}
+
+// 需要合并的相邻两段（后一段不小于前一段），从末尾找起；没有时返回SIZE_MAX
+size_t HistoryStore::merge_candidate() const {
+    for(size_t k = segments.size(); k >= 2; k--){
+        const Segment& a = *segments[k - 2];
+        const Segment& b = *segments[k - 1];
+        if(b.end - b.first >= a.end - a.first) return k - 2;
+    }
+    return SIZE_MAX;
+}
+
+// 有待合并的段且没有合并线程在运行时启动合并线程（调用方持有mtx）
+void HistoryStore::start_merges(){
+    if(merging || stopping || merge_candidate() == SIZE_MAX) return;
+    if(merger.joinable()) merger.join();   // 上一个合并线程已在锁内置merging=false，退出时不再需要锁
+    merging = true;
+    merger = std::thread(&HistoryStore::merge_loop, this);
+}
+
+// 后台合并：归并和写文件时不持有锁（两段的映射只读，只有本线程替换或删除段，close会先等待本线程退出），
+// 只在替换段时持锁，append和检索不会被大段合并阻塞
+void HistoryStore::merge_loop(){
+    std::unique_lock<std::mutex> lk(mtx);
+    while(!stopping){
+        size_t k = merge_candidate();
+        if(k == SIZE_MAX) break;
+        Segment* a = segments[k].get();
+        Segment* b = segments[k + 1].get();
+        std::string tmp_path = a->path + ".merge";
+        SegmentHeader hdr{};
+        lk.unlock();
+        bool ok = write_merged(*a, *b, tmp_path, hdr);
+        lk.lock();
+        if(!ok || !install_merged(a, b, tmp_path, hdr)) break;
+    }
+    merging = false;
+}
+
+// 归并相邻两段写入临时文件：两段的词表都已排序，归并词表，同一词元的序号前段在前、后段在后，仍然递增
+bool HistoryStore::write_merged(const Segment& a, const Segment& b, const std::string& tmp_path, SegmentHeader& hdr) const {
+    std::vector<SegmentTerm> dir;
+    std::vector<std::pair<const void*, size_t>> parts;
+    dir.reserve((size_t)std::max(a.terms, b.terms));
+    size_t i = 0, j = 0;
+    uint32_t pos = 0;
+    // 1. 归并词表，记录每个词元在两段中的位置
+    std::vector<std::pair<std::pair<const uint32_t*, size_t>, std::pair<const uint32_t*, size_t>>> src;
+    while(i < a.terms || j < b.terms){
+        SegmentTerm ta{}, tb{};
+        if(i < a.terms) ta = a.term_at(i);
+        if(j < b.terms) tb = b.term_at(j);
+        bool use_a = i < a.terms && (j >= b.terms || ta.hash <= tb.hash);
+        bool use_b = j < b.terms && (i >= a.terms || tb.hash <= ta.hash);
+        std::pair<const uint32_t*, size_t> pa{nullptr, 0}, pb{nullptr, 0};
+        if(use_a){ pa = {a.postings() + ta.start, ta.count}; i++; }
+        if(use_b){ pb = {b.postings() + tb.start, tb.count}; j++; }
+        dir.push_back({use_a ? ta.hash : tb.hash, pos, (uint32_t)(pa.second + pb.second)});
+        pos += (uint32_t)(pa.second + pb.second);
+        src.push_back({pa, pb});
+    }
+    // 2. 写出合并后的段
+    parts.push_back({dir.data(), dir.size() * sizeof(SegmentTerm)});
+    for(auto& s : src){
+        if(s.first.second) parts.push_back({s.first.first, s.first.second * 4});
+        if(s.second.second) parts.push_back({s.second.first, s.second.second * 4});
+    }
+    hdr = SegmentHeader{SEGMENT_MAGIC, SEGMENT_VERSION, a.first, b.end, dir.size(), pos};
+    return write_segment_file(tmp_path, &hdr, sizeof(hdr), parts);
+}
+
+// 用合并后的段替换两段（调用方持有mtx）：与前一段同名，改名前解除两段的映射；改名失败时恢复原来的两段
+bool HistoryStore::install_merged(Segment* a, Segment* b, const std::string& tmp_path, const SegmentHeader& hdr){
+    a->map.unmap();
+    b->map.unmap();
+    std::error_code ec;
+    fs::rename(tmp_path, a->path, ec);
+    if(!ec) fs::remove(b->path, ec);
+    if(ec){
+        fs::remove(tmp_path, ec);
+        a->map.map(a->path);
+        b->map.map(b->path);
+        return false;
+    }
+    auto owner = [](const Segment* p){ return [p](const std::unique_ptr<Segment>& q){ return q.get() == p; }; };
+    segments.erase(std::find_if(segments.begin(), segments.end(), owner(b)));
+    if(!a->map.map(a->path)){
+        segments.erase(std::find_if(segments.begin(), segments.end(), owner(a)));
+        return false;
+    }
+    a->end = hdr.end;
+    a->terms = hdr.terms;
+    return true;
+}
+
+// 一个词元的全部倒排表：各段依次，最后是内存中的尾部
+HistoryStore::PostingList HistoryStore::lookup(uint64_t h) const {
+    PostingList out;
+    for(auto& seg : segments){
+        const uint32_t* p;
+        size_t n;
+        if(seg->find(h, p, n)) out.push_back({p, n});
+    }
+    auto it = postings.find(h);
+    if(it != postings.end()) out.push_back({it->second.data(), it->second.size()});
+    return out;
+}
+
+// ---------- 历史存储 ----------
+
+bool HistoryStore::open(const std::string& dir, const std::string& key){
+    close();
+    std::lock_guard<std::mutex> lk(mtx);
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    base_path = dir + "/conv_" + key;
+    log_path = base_path + ".log";
+    idx_path = base_path + ".idx";
+
+    // 1. 读取已有索引，丢弃末尾不完整的记录（上次异常退出时可能只写了一半）
+    uint64_t idx_bytes = fs::exists(idx_path, ec) ? fs::file_size(idx_path, ec) : 0;
+    uint64_t log_bytes = fs::exists(log_path, ec) ? fs::file_size(log_path, ec) : 0;
+    count = idx_bytes / sizeof(IndexEntry);
+    if(count && !idx_map.map(idx_path)) count = 0;
+    while(count){
+        IndexEntry e = entry_at((size_t)count - 1);
+        if(e.offset + e.len <= log_bytes) break;
+        count--;
+    }
+    log_size = 0;
+    if(count){
+        IndexEntry e = entry_at((size_t)count - 1);
+        log_size = e.offset + e.len;
+    }
+    idx_map.unmap();
+    if(idx_bytes != count * sizeof(IndexEntry)) fs::resize_file(idx_path, count * sizeof(IndexEntry), ec);
+    if(log_bytes != log_size) fs::resize_file(log_path, log_size, ec);
+
+    // 2. 映射已写入的倒排表段，只扫描其后的日志重建内存中的尾部
+    postings.clear();
+    tail_first = load_segments();
+    if(count > tail_first && idx_map.map(idx_path) && log_map.map(log_path)){
+        for(uint64_t i = tail_first; i < count; i++){
+            IndexEntry e = entry_at((size_t)i);
+            index_tokens((uint32_t)i, (const char*)log_map.data() + e.offset, e.len);
+        }
+    }
+
+    // 3. 以追加方式打开写入端
+    log_out = fopen(log_path.c_str(), "ab");
+    idx_out = fopen(idx_path.c_str(), "ab");
+    if(!log_out || !idx_out){
+        if(log_out) fclose(log_out);
+        if(idx_out) fclose(idx_out);
+        log_out = idx_out = nullptr;
+        return false;
+    }
+    dirty = false;
+    start_merges();   // 上次关闭时未合并的段
+    return true;
+}
+
+void HistoryStore::close(){
+    // 先等待进行中的后台合并完成（关闭期间不再启动新的合并，未合并的段在下次打开后合并）
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stopping = true;
+    }
+    if(merger.joinable()) merger.join();
+    std::lock_guard<std::mutex> lk(mtx);
+    if(log_out) fclose(log_out);
+    if(idx_out) fclose(idx_out);
+    // 正文和索引已关闭（写入磁盘）后再写倒排表段，段覆盖的消息总在索引中
+    if(log_out && idx_out) flush_tail();
+    log_out = idx_out = nullptr;
+    log_map.unmap();
+    idx_map.unmap();
+    segments.clear();
+    postings.clear();
+    tail_first = 0;
+    count = 0;
+    log_size = 0;
+    merging = false;
+    stopping = false;
+}
+
+bool HistoryStore::append(uint64_t ts_ms, uint32_t sender, const std::string& text){
+    std::lock_guard<std::mutex> lk(mtx);
+    if(!log_out || !idx_out) return false;
+    IndexEntry e{};
+    e.ts_ms = ts_ms;
+    e.sender = sender;
+    e.len = (uint32_t)text.size();
+    e.offset = log_size;
+    // 先写正文再写索引：索引项存在即表示正文完整
+    if(!text.empty() && fwrite(text.data(), 1, text.size(), log_out) != text.size()) return false;
+    if(fwrite(&e, sizeof(e), 1, idx_out) != 1) return false;
+    log_size += text.size();
+    index_tokens((uint32_t)count, text.data(), text.size());
+    count++;
+    dirty = true;
+    if(count - tail_first >= TAIL_FLUSH_MESSAGES){
+        // 段覆盖的消息必须已在磁盘上的索引中，否则异常退出后重新打开时会丢弃该段
+        fflush(log_out);
+        fflush(idx_out);
+        dirty = false;
+        flush_tail();
+    }
+    return true;
+}
+
+size_t HistoryStore::size() const {
+    std::lock_guard<std::mutex> lk(mtx);
+    return (size_t)count;
+}
+
+void HistoryStore::index_tokens(uint32_t idx, const char* text, size_t len){
+    std::vector<std::string> toks;
+    history_tokenize(text, len, toks);
+    std::vector<uint64_t> hs;
+    hs.reserve(toks.size());
+    for(auto& t : toks) hs.push_back(fnv1a(t));
+    std::sort(hs.begin(), hs.end());
+    hs.erase(std::unique(hs.begin(), hs.end()), hs.end());
+    for(uint64_t h : hs) postings[h].push_back(idx);
+}
+
+// 确保映射覆盖到指定长度，文件增长后才重新映射
+bool HistoryStore::ensure_mapped(uint64_t log_end, uint64_t idx_end) const {
+    bool need_log = log_map.size() < log_end;
+    bool need_idx = idx_map.size() < idx_end;
+    if(!need_log && !need_idx) return true;
+    if(dirty){
+        fflush(log_out);
+        fflush(idx_out);
+        dirty = false;
+    }
+    if(need_log && !log_map.map(log_path)) return false;
+    if(need_idx && !idx_map.map(idx_path)) return false;
+    return log_map.size() >= log_end && idx_map.size() >= idx_end;
+}
+
+HistoryStore::IndexEntry HistoryStore::entry_at(size_t i) const {
+    IndexEntry e;
+    memcpy(&e, idx_map.data() + i * sizeof(IndexEntry), sizeof(e));
+    return e;
+}
+
+HistoryRecord HistoryStore::record_at(size_t i) const {
+    IndexEntry e = entry_at(i);
+    HistoryRecord r;
+    r.index = i;
+    r.ts_ms = e.ts_ms;
+    r.sender = e.sender;
+    if(e.len) r.text.assign((const char*)log_map.data() + e.offset, e.len);
+    return r;
+}
+
+std::vector<HistoryRecord> HistoryStore::load_page(size_t end, size_t n) const {
+    std::lock_guard<std::mutex> lk(mtx);
+    std::vector<HistoryRecord> out;
+    end = std::min(end, (size_t)count);
+    size_t begin = end > n ? end - n : 0;
+    if(begin >= end || !ensure_mapped(log_size, count * sizeof(IndexEntry))) return out;
+    out.reserve(end - begin);
+    for(size_t i = begin; i < end; i++) out.push_back(record_at(i));
+    return out;
+}
+
+size_t HistoryStore::lower_bound_time(uint64_t ts_ms) const {
+    std::lock_guard<std::mutex> lk(mtx);
+    if(!count || !ensure_mapped(0, count * sizeof(IndexEntry))) return 0;
+    size_t lo = 0, hi = (size_t)count;
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(entry_at(mid).ts_ms < ts_ms) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+std::vector<HistoryRecord> HistoryStore::search(const std::string& query, size_t limit, std::optional<uint32_t> sender) const {
+    std::lock_guard<std::mutex> lk(mtx);
+    std::vector<HistoryRecord> out;
+
+    // 1. 查询切词，取出每个词的倒排表
+    std::vector<std::string> toks;
+    history_tokenize(query.data(), query.size(), toks);
+    if(toks.empty() || limit == 0) return out;
+    std::vector<uint64_t> hs;
+    for(auto& t : toks) hs.push_back(fnv1a(t));
+    std::sort(hs.begin(), hs.end());
+    hs.erase(std::unique(hs.begin(), hs.end()), hs.end());
+    std::vector<std::pair<size_t, PostingList>> lists;   // (总数, 倒排表)
+    for(uint64_t h : hs){
+        PostingList pl = lookup(h);
+        size_t total = 0;
+        for(auto& sp : pl) total += sp.n;
+        if(!total) return out;
+        lists.push_back({total, std::move(pl)});
+    }
+    std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b){ return a.first < b.first; });
+    auto contains = [](const PostingList& pl, uint32_t idx){
+        for(auto& sp : pl){
+            if(idx >= sp.p[0] && idx <= sp.p[sp.n - 1]) return std::binary_search(sp.p, sp.p + sp.n, idx);
+        }
+        return false;
+    };
+
+    // 2. 汉字等按单字索引，查询中连续的非ASCII片段需在正文中连续出现
+    std::vector<std::string> runs;
+    for(size_t i = 0; i < query.size();){
+        if((unsigned char)query[i] < 0x80){ i++; continue; }
+        size_t j = i;
+        while(j < query.size() && (unsigned char)query[j] >= 0x80) j++;
+        runs.push_back(query.substr(i, j - i));
+        i = j;
+    }
+
+    if(!ensure_mapped(log_size, count * sizeof(IndexEntry))) return out;
+
+    // 3. 从最短的倒排表由新到旧遍历，其余表二分确认（各段序号范围不重叠，先按范围选段）
+    const PostingList& base = lists[0].second;
+    size_t si = base.size(), pos = 0;   // 当前段及段内剩余个数
+    while(out.size() < limit){
+        if(pos == 0){
+            if(si == 0) break;
+            pos = base[--si].n;
+            continue;
+        }
+        uint32_t idx = base[si].p[--pos];
+        bool all = true;
+        for(size_t k = 1; k < lists.size() && all; k++){
+            all = contains(lists[k].second, idx);
+        }
+        if(!all) continue;
+        HistoryRecord r = record_at(idx);
+        if(sender && r.sender != *sender) continue;
+        bool ok = true;
+        for(auto& run : runs){
+            if(r.text.find(run) == std::string::npos){ ok = false; break; }
+        }
+        if(ok) out.push_back(std::move(r));
+    }
+    return out;
+}
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <cstdlib>
+#include <functional>
+
+#include "../include/history.hpp"
+
+// 消息历史基准：写入N条合成消息，测量写入速率、单次写入的最长阻塞时间、重新打开耗时、检索和分页读取延迟
+// 用法：history_bench [-n 消息数，默认10000000] [-d 目录，默认history_bench（会先清空）]
+// 合成消息由2万个伪词按Zipf分布组成，每条4~16个词，约10%带两个汉字；固定种子，结果可重复
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+static double ms_since(Clock::time_point t){
+    return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+}
+
+// 词表：编号越小出现越频繁
+struct Corpus {
+    std::vector<std::string> words;
+    std::vector<double> cdf;
+    std::vector<std::string> hanzi{"你", "好", "文", "件", "图", "片", "会", "议", "明", "天"};
+
+    Corpus(size_t n, std::mt19937& rng){
+        static const char* syl[] = {"ka", "lo", "mi", "ne", "ru", "ta", "shi", "po", "ve", "zu", "an", "el", "or", "qi", "xu", "be"};
+        double sum = 0;
+        for(size_t r = 0; r < n; r++){
+            std::string w;
+            size_t k = 2 + rng() % 3;
+            for(size_t j = 0; j < k; j++) w += syl[rng() % 16];
+            w += std::to_string(r % 97);
+            words.push_back(w);
+            sum += 1.0 / (double)(r + 1);
+            cdf.push_back(sum);
+        }
+        for(auto& c : cdf) c /= sum;
+    }
+
+    size_t pick(std::mt19937& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::min(words.size() - 1, (size_t)(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()));
+    }
+
+    std::string message(std::mt19937& rng) const {
+        std::string s;
+        size_t k = 4 + rng() % 13;
+        for(size_t j = 0; j < k; j++){
+            if(j) s.push_back(' ');
+            s += words[pick(rng)];
+        }
+        if(rng() % 10 == 0){
+            s.push_back(' ');
+            s += hanzi[rng() % hanzi.size()];
+            s += hanzi[rng() % hanzi.size()];
+        }
+        return s;
+    }
+};
+
+static void report(const char* what, std::vector<double>& ms, size_t hits){
+    std::sort(ms.begin(), ms.end());
+    std::cout << what << ": p50 " << ms[ms.size() / 2] << " ms, p99 " << ms[std::min(ms.size() - 1, ms.size() * 99 / 100)]
+              << " ms, max " << ms.back() << " ms, avg hits " << (double)hits / ms.size() << "\n";
+}
+
+int main(int argc, char** argv){
+    // 1. 解析参数，清空目录
+    size_t n = 10000000;
+    std::string dir = "history_bench";
+    for(int i = 1; i + 1 < argc; i++){
+        std::string k = argv[i];
+        if(k == "-n") n = (size_t)atoll(argv[++i]);
+        else if(k == "-d") dir = argv[++i];
+    }
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    std::mt19937 rng(1);
+    Corpus corpus(20000, rng);
+
+    // 2. 写入
+    HistoryStore store;
+    if(!store.open(dir, "bench")){ std::cerr << "open failed\n"; return 1; }
+    uint64_t bytes = 0, ts = 1700000000000ULL;
+    double max_pause = 0;   // 单次append的最长耗时（写倒排表段时接收线程被阻塞的时间）
+    size_t slow = 0;
+    auto t0 = Clock::now();
+    for(size_t i = 0; i < n; i++){
+        std::string s = corpus.message(rng);
+        bytes += s.size();
+        auto a0 = Clock::now();
+        if(!store.append(ts + i * 50, (i & 1) ? 7 : HISTORY_SELF, s)){ std::cerr << "append failed at " << i << "\n"; return 1; }
+        double a_ms = ms_since(a0);
+        max_pause = std::max(max_pause, a_ms);
+        if(a_ms > 10) slow++;
+    }
+    double ingest_ms = ms_since(t0);
+    t0 = Clock::now();
+    store.close();
+    double close_ms = ms_since(t0);
+    std::cout << "ingest " << n << " messages (" << bytes / (1024 * 1024) << " MB text) in " << ingest_ms / 1000 << " s: "
+              << (uint64_t)(n / (ingest_ms / 1000)) << " msg/s, " << bytes / (ingest_ms / 1000) / (1024 * 1024) << " MB/s"
+              << "; close " << close_ms << " ms\n";
+    std::cout << "append pause: max " << max_pause << " ms, " << slow << " append(s) over 10 ms\n";
+
+    uint64_t log_b = 0, idx_b = 0, pst_b = 0;
+    size_t pst_files = 0;
+    for(auto& ent : fs::directory_iterator(dir, ec)){
+        std::string ext = ent.path().extension().string();
+        uint64_t sz = fs::file_size(ent.path(), ec);
+        if(ext == ".log") log_b += sz;
+        else if(ext == ".idx") idx_b += sz;
+        else if(ext == ".pst"){ pst_b += sz; pst_files++; }
+    }
+    std::cout << "disk: log " << log_b / (1024 * 1024) << " MB, index " << idx_b / (1024 * 1024) << " MB, postings "
+              << pst_b / (1024 * 1024) << " MB in " << pst_files << " segment(s)\n";
+
+    // 3. 重新打开（只映射倒排表段，不扫描日志）
+    t0 = Clock::now();
+    if(!store.open(dir, "bench") || store.size() != n){ std::cerr << "reopen failed\n"; return 1; }
+    std::cout << "reopen " << ms_since(t0) << " ms\n";
+
+    // 4. 检索：罕见词、中频词、高频词、两个词同时出现、汉字片段，各200次，每次取最新20条
+    const size_t Q = 200;
+    struct Kind { const char* name; std::function<std::string()> make; };
+    std::vector<Kind> kinds = {
+        {"search rare   ", [&]{ return corpus.words[10000 + rng() % 10000]; }},
+        {"search medium ", [&]{ return corpus.words[100 + rng() % 900]; }},
+        {"search common ", [&]{ return corpus.words[rng() % 10]; }},
+        {"search 2 words", [&]{ return corpus.words[rng() % 100] + " " + corpus.words[100 + rng() % 900]; }},
+        {"search hanzi  ", [&]{ return corpus.hanzi[rng() % 10] + corpus.hanzi[rng() % 10]; }},
+    };
+    for(auto& k : kinds){
+        std::vector<double> ms;
+        size_t hits = 0;
+        for(size_t q = 0; q < Q; q++){
+            std::string query = k.make();
+            t0 = Clock::now();
+            hits += store.search(query, 20).size();
+            ms.push_back(ms_since(t0));
+        }
+        report(k.name, ms, hits);
+    }
+
+    // 5. 分页读取：最新一页和随机位置的一页（50条）
+    std::vector<double> last, random;
+    size_t got = 0;
+    for(size_t q = 0; q < Q; q++){
+        t0 = Clock::now();
+        got += store.load_page(SIZE_MAX, 50).size();
+        last.push_back(ms_since(t0));
+        t0 = Clock::now();
+        got += store.load_page((size_t)(rng() % n) + 1, 50).size();
+        random.push_back(ms_since(t0));
+    }
+    report("page latest   ", last, got / 2);
+    report("page random   ", random, got / 2);
+    store.close();
+    return 0;
+}
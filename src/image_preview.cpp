@@ -0,0 +1,226 @@
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+#include "../include/image_preview.hpp"
+#include "../include/sha256.hpp"
+
+// ---------- 缩放 ----------
+
+Image downscale_image(const Image& src, uint32_t max_w, uint32_t max_h){
+    if(src.width <= max_w && src.height <= max_h) return src;
+    if(src.width == 0 || src.height == 0 || max_w == 0 || max_h == 0) return Image{};
+
+    // 1. 按比例计算目标尺寸
+    double scale = std::min((double)max_w / src.width, (double)max_h / src.height);
+    Image dst;
+    dst.width  = std::max<uint32_t>(1, (uint32_t)(src.width * scale));
+    dst.height = std::max<uint32_t>(1, (uint32_t)(src.height * scale));
+    dst.pixels.resize((size_t)dst.width * dst.height * 4);
+
+    // 2. 预先计算每个目标列对应的源列区间
+    std::vector<uint32_t> xs(dst.width + 1);
+    for(uint32_t dx = 0; dx <= dst.width; dx++) xs[dx] = (uint32_t)((uint64_t)dx * src.width / dst.width);
+
+    // 3. 逐目标行：先把对应的源行按列累加，再按列区间求平均
+    std::vector<uint32_t> acc((size_t)src.width * 4);
+    for(uint32_t dy = 0; dy < dst.height; dy++){
+        uint32_t sy0 = (uint32_t)((uint64_t)dy * src.height / dst.height);
+        uint32_t sy1 = std::max(sy0 + 1, (uint32_t)((uint64_t)(dy + 1) * src.height / dst.height));
+        std::fill(acc.begin(), acc.end(), 0);
+        for(uint32_t sy = sy0; sy < sy1; sy++){
+            const uint8_t* row = src.pixels.data() + (size_t)sy * src.width * 4;
+            for(size_t i = 0; i < acc.size(); i++) acc[i] += row[i];
+        }
+        uint8_t* out = dst.pixels.data() + (size_t)dy * dst.width * 4;
+        for(uint32_t dx = 0; dx < dst.width; dx++){
+            uint32_t sx0 = xs[dx], sx1 = std::max(sx0 + 1, xs[dx + 1]);
+            uint32_t n = (sx1 - sx0) * (sy1 - sy0);
+            for(int c = 0; c < 4; c++){
+                uint64_t sum = 0;
+                for(uint32_t sx = sx0; sx < sx1; sx++) sum += acc[(size_t)sx * 4 + c];
+                out[(size_t)dx * 4 + c] = (uint8_t)((sum + n / 2) / n);
+            }
+        }
+    }
+    return dst;
+}
+
+// ---------- BMP解码 ----------
+
+static uint32_t rd32(const uint8_t* p){ uint32_t v; memcpy(&v, p, 4); return v; }
+static uint16_t rd16(const uint8_t* p){ uint16_t v; memcpy(&v, p, 2); return v; }
+
+bool decode_bmp(const uint8_t* data, size_t len, Image& out){
+    if(len < 54 || data[0] != 'B' || data[1] != 'M') return false;
+    uint32_t pix_off = rd32(data + 10);
+    uint32_t dib_size = rd32(data + 14);
+    if(dib_size < 40) return false;
+    int32_t w = (int32_t)rd32(data + 18);
+    int32_t h = (int32_t)rd32(data + 22);
+    uint16_t bpp = rd16(data + 28);
+    uint32_t comp = rd32(data + 30);
+    if(w <= 0 || h == 0 || (bpp != 24 && bpp != 32)) return false;
+    if(comp != 0 && !(comp == 3 && bpp == 32)) return false;   // 仅支持BI_RGB及标准BGRA位域
+
+    bool top_down = h < 0;
+    uint32_t uh = top_down ? (uint32_t)(-(int64_t)h) : (uint32_t)h;
+    size_t stride = (((size_t)w * bpp + 31) / 32) * 4;
+    if(pix_off > len || (len - pix_off) / stride < uh) return false;
+
+    out.width = (uint32_t)w;
+    out.height = uh;
+    out.pixels.resize((size_t)out.width * out.height * 4);
+    for(uint32_t y = 0; y < uh; y++){
+        const uint8_t* src = data + pix_off + stride * (top_down ? y : uh - 1 - y);
+        uint8_t* dst = out.pixels.data() + (size_t)y * out.width * 4;
+        if(bpp == 32){
+            memcpy(dst, src, (size_t)out.width * 4);
+        } else {
+            for(uint32_t x = 0; x < out.width; x++){
+                dst[x*4+0] = src[x*3+0];
+                dst[x*4+1] = src[x*3+1];
+                dst[x*4+2] = src[x*3+2];
+                dst[x*4+3] = 255;
+            }
+        }
+    }
+    return true;
+}
+
+bool decode_bmp_file(const std::string& path, uint32_t max_dim, Image& out){
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs) return false;
+    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    Image full;
+    if(!decode_bmp(buf.data(), buf.size(), full)) return false;
+    out = downscale_image(full, max_dim, max_dim);
+    return true;
+}
+
+// ---------- 内容哈希 ----------
+
+bool hash_file(const std::string& path, PreviewKey& out){
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs) return false;
+    Sha256 sh;
+    std::vector<char> buf(64 * 1024);
+    while(ifs){
+        ifs.read(buf.data(), buf.size());
+        sh.update(buf.data(), (size_t)ifs.gcount());
+    }
+    sh.final(out.data());
+    return true;
+}
+
+// ---------- LRU缓存 ----------
+
+std::shared_ptr<const PreviewImages> PreviewCache::get(const PreviewKey& key){
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = map.find(key);
+    if(it == map.end()) return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+void PreviewCache::put(const PreviewKey& key, std::shared_ptr<const PreviewImages> v){
+    if(!v) return;
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = map.find(key);
+    if(it != map.end()){
+        used -= it->second->second->bytes();
+        lru.erase(it->second);
+        map.erase(it);
+    }
+    used += v->bytes();
+    lru.emplace_front(key, std::move(v));
+    map[key] = lru.begin();
+    // 超出容量时从最久未使用的一端淘汰（至少保留刚放入的一项）
+    while(used > cap && lru.size() > 1){
+        auto& last = lru.back();
+        used -= last.second->bytes();
+        map.erase(last.first);
+        lru.pop_back();
+    }
+}
+
+size_t PreviewCache::bytes() const {
+    std::lock_guard<std::mutex> lk(mtx);
+    return used;
+}
+
+size_t PreviewCache::size() const {
+    std::lock_guard<std::mutex> lk(mtx);
+    return lru.size();
+}
+
+// ---------- 解码线程池 ----------
+
+PreviewPipeline::PreviewPipeline(ImageDecoder decoder, size_t cache_bytes, unsigned workers)
+    : decode(std::move(decoder)), lru(cache_bytes) {
+    if(workers == 0) workers = 1;
+    for(unsigned i = 0; i < workers; i++) threads.emplace_back(&PreviewPipeline::worker_loop, this);
+}
+
+PreviewPipeline::~PreviewPipeline(){
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for(auto& t : threads) t.join();
+}
+
+void PreviewPipeline::request(const PreviewKey& key, const std::string& path, Callback cb){
+    // 查缓存与登记等待在同一把锁下完成：工作线程放入缓存和取走等待者也持有该锁，
+    // 不会出现刚解码完成、等待表已清空，本次请求却未命中缓存而重复解码
+    std::shared_ptr<const PreviewImages> hit;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        hit = lru.get(key);
+        if(!hit){
+            auto& w = waiting[key];
+            w.push_back(std::move(cb));
+            if(w.size() > 1) return;   // 已在解码中，等待同一结果
+            jobs.push_back(Job{key, path});
+        }
+    }
+    if(hit){
+        cb(key, hit);
+        return;
+    }
+    cv.notify_one();
+}
+
+void PreviewPipeline::worker_loop(){
+    while(true){
+        Job job;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            cv.wait(lk, [&]{ return stopping || !jobs.empty(); });
+            if(stopping) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        // 1. 解码为预览尺寸，再由预览图生成缩略图
+        std::shared_ptr<const PreviewImages> result;
+        Image img;
+        if(decode(job.path, PREVIEW_DIM, img) && img.width && img.height){
+            auto v = std::make_shared<PreviewImages>();
+            v->thumb = std::make_shared<const Image>(downscale_image(img, THUMB_DIM, THUMB_DIM));
+            v->preview = std::make_shared<const Image>(downscale_image(img, PREVIEW_DIM, PREVIEW_DIM));
+            result = v;
+        }
+
+        // 2. 放入缓存并取走所有等待该内容的请求，再在锁外通知
+        std::vector<Callback> cbs;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if(result) lru.put(job.key, result);
+            cbs.swap(waiting[job.key]);
+            waiting.erase(job.key);
+        }
+        for(auto& cb : cbs) cb(job.key, result);
+    }
+}
@@ -0,0 +1,256 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include "../include/image_preview.hpp"
+
+// 图片预览的自检与基准（与平台无关部分）：缩放、BMP解码、LRU字节上限、解码线程池去重
+// 用法：preview_bench [-w 宽，默认6000] [-h 高，默认4000]
+// 任一检查失败时返回1
+
+using Clock = std::chrono::steady_clock;
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what){
+    std::cout << (ok ? "ok   " : "FAIL ") << what << "\n";
+    if(!ok) failures++;
+}
+
+// 测试用的缓存key：前8字节为n，其余为0
+static PreviewKey key(uint64_t n){
+    PreviewKey k{};
+    memcpy(k.data(), &n, sizeof(n));
+    return k;
+}
+
+static double ms_since(Clock::time_point t){
+    return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+}
+
+static Image solid(uint32_t w, uint32_t h, uint8_t b, uint8_t g, uint8_t r){
+    Image img;
+    img.width = w; img.height = h;
+    img.pixels.resize((size_t)w * h * 4);
+    for(size_t i = 0; i < img.pixels.size(); i += 4){
+        img.pixels[i] = b; img.pixels[i+1] = g; img.pixels[i+2] = r; img.pixels[i+3] = 255;
+    }
+    return img;
+}
+
+// 像素值由坐标决定，便于核对解码结果
+static void pattern(uint32_t x, uint32_t y, uint8_t px[4]){
+    px[0] = (uint8_t)(x * 7); px[1] = (uint8_t)(y * 13); px[2] = (uint8_t)(x + y); px[3] = (uint8_t)(255 - x);
+}
+
+static void put16(std::vector<uint8_t>& v, size_t off, uint16_t x){ memcpy(v.data() + off, &x, 2); }
+static void put32(std::vector<uint8_t>& v, size_t off, uint32_t x){ memcpy(v.data() + off, &x, 4); }
+
+// 生成BMP：bpp为24或32，top_down时高度写为负数，bitfields时使用BI_BITFIELDS
+static std::vector<uint8_t> make_bmp(uint32_t w, uint32_t h, uint16_t bpp, bool top_down, bool bitfields){
+    size_t stride = (((size_t)w * bpp + 31) / 32) * 4;
+    size_t pix_off = 54 + (bitfields ? 12 : 0);
+    std::vector<uint8_t> v(pix_off + stride * h, 0);
+    v[0] = 'B'; v[1] = 'M';
+    put32(v, 2, (uint32_t)v.size());
+    put32(v, 10, (uint32_t)pix_off);
+    put32(v, 14, 40);
+    put32(v, 18, w);
+    put32(v, 22, top_down ? (uint32_t)(-(int32_t)h) : h);
+    put16(v, 26, 1);
+    put16(v, 28, bpp);
+    put32(v, 30, bitfields ? 3 : 0);
+    if(bitfields){ put32(v, 54, 0x00FF0000); put32(v, 58, 0x0000FF00); put32(v, 62, 0x000000FF); }
+    for(uint32_t y = 0; y < h; y++){
+        uint8_t* row = v.data() + pix_off + stride * (top_down ? y : h - 1 - y);
+        for(uint32_t x = 0; x < w; x++){
+            uint8_t px[4];
+            pattern(x, y, px);
+            memcpy(row + (size_t)x * (bpp / 8), px, bpp / 8);
+        }
+    }
+    return v;
+}
+
+static bool matches_pattern(const Image& img, uint32_t w, uint32_t h, bool alpha){
+    if(img.width != w || img.height != h || img.pixels.size() != (size_t)w * h * 4) return false;
+    for(uint32_t y = 0; y < h; y++){
+        for(uint32_t x = 0; x < w; x++){
+            uint8_t px[4];
+            pattern(x, y, px);
+            if(!alpha) px[3] = 255;
+            if(memcmp(img.pixels.data() + ((size_t)y * w + x) * 4, px, 4) != 0) return false;
+        }
+    }
+    return true;
+}
+
+static std::shared_ptr<const PreviewImages> entry(size_t bytes){
+    auto v = std::make_shared<PreviewImages>();
+    auto img = std::make_shared<Image>();
+    img->pixels.resize(bytes);
+    v->preview = img;
+    return v;
+}
+
+int main(int argc, char** argv){
+    uint32_t big_w = 6000, big_h = 4000;
+    for(int i = 1; i + 1 < argc; i++){
+        std::string k = argv[i];
+        if(k == "-w") big_w = (uint32_t)atoi(argv[++i]);
+        else if(k == "-h") big_h = (uint32_t)atoi(argv[++i]);
+    }
+
+    // 1. 缩放：尺寸按比例、纯色保持纯色、小图原样返回
+    {
+        Image src = solid(4000, 3000, 10, 200, 30);
+        Image d = downscale_image(src, PREVIEW_DIM, PREVIEW_DIM);
+        check(d.width == 1024 && d.height == 768, "downscale 4000x3000 -> 1024x768");
+        bool uniform = true;
+        for(size_t i = 0; i < d.pixels.size(); i += 4){
+            if(d.pixels[i] != 10 || d.pixels[i+1] != 200 || d.pixels[i+2] != 30 || d.pixels[i+3] != 255){ uniform = false; break; }
+        }
+        check(uniform, "downscale keeps a solid colour");
+        Image t = downscale_image(solid(3, 1000, 0, 0, 0), THUMB_DIM, THUMB_DIM);
+        check(t.width == 1 && t.height == 160, "downscale keeps at least one column");
+        Image small = solid(100, 50, 1, 2, 3);
+        Image s2 = downscale_image(small, THUMB_DIM, THUMB_DIM);
+        check(s2.width == 100 && s2.height == 50 && s2.pixels == small.pixels, "downscale leaves small images unchanged");
+
+        // 2x2块求平均：左半黑右半白缩小一半后仍然左黑右白
+        Image half = solid(4, 2, 0, 0, 0);
+        for(uint32_t y = 0; y < 2; y++) for(uint32_t x = 2; x < 4; x++) memset(half.pixels.data() + ((size_t)y * 4 + x) * 4, 255, 4);
+        Image h2 = downscale_image(half, 2, 2);
+        check(h2.width == 2 && h2.height == 1 && h2.pixels[0] == 0 && h2.pixels[4] == 255, "downscale averages source blocks");
+    }
+
+    // 2. BMP解码：24位自下而上（行需补齐）、32位自上而下、BI_BITFIELDS，以及非法输入
+    {
+        Image img;
+        auto b24 = make_bmp(37, 11, 24, false, false);
+        check(decode_bmp(b24.data(), b24.size(), img) && matches_pattern(img, 37, 11, false), "decode 24-bit bottom-up BMP with row padding");
+        auto b32 = make_bmp(16, 9, 32, true, false);
+        check(decode_bmp(b32.data(), b32.size(), img) && matches_pattern(img, 16, 9, true), "decode 32-bit top-down BMP");
+        auto bf = make_bmp(5, 5, 32, false, true);
+        check(decode_bmp(bf.data(), bf.size(), img) && matches_pattern(img, 5, 5, true), "decode 32-bit BI_BITFIELDS BMP");
+        auto cut = b24;
+        cut.resize(cut.size() - 1);
+        check(!decode_bmp(cut.data(), cut.size(), img), "reject truncated BMP");
+        auto b8 = b24;
+        put16(b8, 28, 8);
+        check(!decode_bmp(b8.data(), b8.size(), img), "reject 8-bit BMP");
+        auto rle = b24;
+        put32(rle, 30, 1);
+        check(!decode_bmp(rle.data(), rle.size(), img), "reject compressed BMP");
+        check(!decode_bmp(b24.data(), 20, img), "reject short header");
+    }
+
+    // 3. LRU缓存：总字节不超过上限，淘汰最久未使用的一项，get会刷新顺序
+    {
+        PreviewCache cache(1000);
+        cache.put(key(1), entry(300));
+        cache.put(key(2), entry(300));
+        cache.put(key(3), entry(300));
+        cache.get(key(1));                  // 1变为最近使用
+        cache.put(key(4), entry(300));      // 应淘汰2
+        check(cache.bytes() == 900 && cache.size() == 3, "cache stays within its byte cap");
+        check(cache.get(key(1)) && !cache.get(key(2)) && cache.get(key(3)) && cache.get(key(4)), "cache evicts the least recently used entry");
+        cache.put(key(3), entry(100));
+        check(cache.bytes() == 700, "cache re-put replaces the old size");
+        cache.put(key(5), entry(5000));
+        check(cache.size() == 1 && cache.get(key(5)) && cache.bytes() == 5000, "cache keeps a single oversized entry alone");
+        bool bounded = true;
+        PreviewCache many(64 * 1024);
+        for(uint64_t k = 0; k < 10000; k++){
+            many.put(key(k), entry(1000 + (size_t)(k % 7) * 100));
+            if(many.bytes() > 64 * 1024) bounded = false;
+        }
+        check(bounded && many.size() <= 64, "cache bound holds over 10000 inserts");
+        PreviewCache full(1000);
+        PreviewKey k1 = key(7), k2 = key(7);
+        k2[31] = 1;
+        full.put(k1, entry(100));
+        check(!full.get(k2), "cache compares the whole SHA-256 key");
+    }
+
+    // 4. 解码线程池：同一内容并发请求只解码一次，完成后再请求命中缓存
+    {
+        std::atomic<int> decodes{0};
+        auto slow = [&](const std::string&, uint32_t, Image& out){
+            decodes++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            out = solid(2000, 1000, 1, 1, 1);
+            return true;
+        };
+        std::atomic<int> done{0}, ok{0};
+        {
+            PreviewPipeline pipe(slow, 64 * 1024 * 1024, 4);
+            auto cb = [&](const PreviewKey&, std::shared_ptr<const PreviewImages> r){
+                if(r && r->preview && r->preview->width == PREVIEW_DIM && r->thumb->width == THUMB_DIM) ok++;
+                done++;
+            };
+            // 多个线程在解码前、解码中、解码完成后持续请求同一内容
+            std::vector<std::thread> ts;
+            for(int t = 0; t < 4; t++){
+                ts.emplace_back([&]{
+                    for(int i = 0; i < 50; i++){
+                        pipe.request(key(42), "same", cb);
+                        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                    }
+                });
+            }
+            for(auto& t : ts) t.join();
+            while(done < 200) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            check(decodes == 1 && ok == 200, "pipeline decodes concurrent requests once (" + std::to_string(decodes.load()) + " decodes)");
+        }
+
+        std::atomic<int> fails{0};
+        {
+            PreviewPipeline pipe([](const std::string&, uint32_t, Image&){ return false; }, 1024, 1);
+            std::atomic<int> got{0};
+            for(int i = 0; i < 3; i++) pipe.request(key(9), "bad", [&](const PreviewKey&, std::shared_ptr<const PreviewImages> r){ if(!r) fails++; got++; });
+            while(got < 3) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        check(fails == 3, "pipeline reports decode failures to every waiter");
+    }
+
+    // 5. 基准：大图BMP文件解码并缩小到预览尺寸，再生成缩略图
+    {
+        std::string path = "preview_bench.bmp";
+        {
+            auto big = make_bmp(big_w, big_h, 24, false, false);
+            std::ofstream ofs(path, std::ios::binary);
+            ofs.write((const char*)big.data(), (std::streamsize)big.size());
+        }
+        Image full;
+        auto t0 = Clock::now();
+        bool dec_ok = decode_bmp_file(path, UINT32_MAX, full);
+        double full_ms = ms_since(t0);
+        Image pv;
+        t0 = Clock::now();
+        bool pv_ok = decode_bmp_file(path, PREVIEW_DIM, pv);
+        double pv_ms = ms_since(t0);
+        t0 = Clock::now();
+        Image th = downscale_image(pv, THUMB_DIM, THUMB_DIM);
+        double th_ms = ms_since(t0);
+        t0 = Clock::now();
+        Image direct = downscale_image(full, PREVIEW_DIM, PREVIEW_DIM);
+        double ds_ms = ms_since(t0);
+        check(dec_ok && pv_ok && matches_pattern(full, big_w, big_h, false) && pv.width == direct.width && pv.pixels == direct.pixels,
+              "large BMP decodes and downscales consistently");
+        std::cout << big_w << "x" << big_h << " BMP: decode " << full_ms << " ms, decode+preview " << pv_ms << " ms ("
+                  << pv.width << "x" << pv.height << ", " << pv.bytes() / 1024 << " KB kept of " << full.bytes() / (1024 * 1024)
+                  << " MB), downscale " << ds_ms << " ms, thumbnail " << th_ms << " ms (" << th.width << "x" << th.height << ")\n";
+        std::remove(path.c_str());
+    }
+
+    std::cout << (failures ? "FAILED: " + std::to_string(failures) + " check(s)\n" : std::string("all checks passed\n"));
+    return failures ? 1 : 0;
+}
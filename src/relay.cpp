@@ -0,0 +1,646 @@
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <unordered_set>
+#include <cstring>
+
+#include "../include/protocol.hpp"
+#include "../include/crc32.hpp"
+#include "../include/ratelimit.hpp"
+#include "../include/dedup.hpp"
+#include "../include/sha256.hpp"
+#include "../include/relay.hpp"
+#include "../include/trace.hpp"
+#include "../include/secure_channel.hpp"
+
+// 限速参数（每个会话独立计算，文本和文件流量分开）
+static constexpr double TEXT_MSGS_PER_SEC  = 20;
+static constexpr double TEXT_MSGS_BURST    = 40;
+static constexpr double TEXT_BYTES_PER_SEC = 64 * 1024;
+static constexpr double TEXT_BYTES_BURST   = 128 * 1024;
+static constexpr double FILE_MSGS_PER_SEC  = 4096;
+static constexpr double FILE_MSGS_BURST    = 512;
+static constexpr double FILE_BYTES_BURST   = 1024 * 1024;
+static constexpr auto   THROTTLE_EPISODE_GAP = std::chrono::seconds(1);
+
+// 公平调度参数：每轮每个来源可发送的字节配额，以及每个来源在目标处最多排队的字节数
+static constexpr int64_t DRR_QUANTUM      = 8 * 1024;
+static constexpr size_t  MAX_QUEUED_BYTES = 256 * 1024;
+// 服务器控制消息(src=0)在目标处最多排队的字节数，超过时丢弃新的控制消息（不读数据的客户端不能让服务器无限缓存回复）
+static constexpr size_t  MAX_CONTROL_BYTES = 64 * 1024;
+// 等待客户端握手的最长时间，超过后按明文连接转发
+static constexpr auto    HANDSHAKE_HOLD = std::chrono::seconds(5);
+// 错误回复(MT_INVALID_SEMANTIC)的速率上限
+static constexpr double ERROR_REPLIES_PER_SEC = 5;
+static constexpr double ERROR_REPLIES_BURST   = 10;
+
+// 去重传输：分块缓存容量，已向发送端请求、尚未到达的分块的等待超时，以及记录的清单数
+static constexpr size_t CHUNK_CACHE_BYTES = 64 * 1024 * 1024;
+static constexpr auto   CHUNK_PENDING_TIMEOUT = std::chrono::seconds(10);
+static constexpr size_t MAX_PENDING_CHUNKS = 65536;
+static constexpr size_t MAX_OFFERS = 1024;
+
+// 客户端会话：每个目标连接有一个发送线程，按来源分队列，用差额轮询(DRR)公平发送
+struct Session {
+    uint32_t id = 0;
+    std::shared_ptr<Transport> conn;
+
+    std::mutex mtx;
+    std::condition_variable data_cv;   // 发送线程等待数据
+    std::condition_variable space_cv;  // 来源等待队列空间
+    std::unordered_map<uint32_t, std::deque<std::vector<uint8_t>>> queues;  // 来源ID -> 待发帧
+    std::unordered_map<uint32_t, size_t> queued_bytes;
+    std::unordered_map<uint32_t, int64_t> deficit;
+    std::deque<uint32_t> active;       // 有待发数据的来源，轮询顺序
+    bool closed = false;
+    std::thread writer;
+
+    // 限速状态（只由该会话的接收线程访问）
+    TrafficBudget text_budget{TEXT_MSGS_PER_SEC, TEXT_MSGS_BURST, TEXT_BYTES_PER_SEC, TEXT_BYTES_BURST};
+    TrafficBudget file_budget;   // 字节速率取自RelayOptions，连接时设置
+    // 最近一次超限的时间：距上次超限超过THROTTLE_EPISODE_GAP才算进入新的一次限速并通知
+    std::chrono::steady_clock::time_point text_over{}, file_over{};
+    TokenBucket error_replies{ERROR_REPLIES_PER_SEC, ERROR_REPLIES_BURST};
+
+    // 加密发送状态：接收线程在握手时写入tx，发送线程发出握手回复之后启用（此后只由发送线程访问）
+    CipherState tx;
+    bool tx_secure = false;
+    // 服务器有身份时，握手完成（或客户端发来第一个非握手帧、或超时）之前只发送控制消息，
+    // 其他客户端发来的报文留在队列中，握手后加密发出（受mtx保护）
+    bool hold = false;
+    std::chrono::steady_clock::time_point hold_until;
+};
+
+// 全局变量定义
+static std::mutex cout_mtx;
+static std::mutex clients_mtx;
+static std::unordered_map<uint32_t, std::shared_ptr<Session>> clients;
+static std::atomic<uint32_t> next_id{1};
+static RelayOptions options;
+
+// 分块缓存，以及正在上传的分块 -> 等待同一分块的其他接收者
+// 等待者记录自己请求的发送端和xfer_id，分块到达后以该发送端的名义、按该xfer_id转发
+struct ChunkWaiter {
+    uint32_t requester, owner, xfer;
+};
+struct PendingChunk {
+    std::chrono::steady_clock::time_point since;
+    uint32_t owner = 0;        // 请求已转发给的发送端
+    uint32_t requester = 0;    // 该请求的接收者（分块随原请求直接转发给它）
+    std::vector<ChunkWaiter> waiters;
+};
+// 转发过的清单：(发送端, xfer_id) -> 接收者和清单中的分块，服务器只把分块代发给清单的接收者
+struct ChunkOffer {
+    uint32_t recipient = 0;
+    std::unordered_set<ChunkHash, ChunkHashHasher> chunks;
+};
+static ChunkCache chunk_cache(CHUNK_CACHE_BYTES);
+static std::mutex pending_mtx;   // 保护以下四项
+static std::unordered_map<ChunkHash, PendingChunk, ChunkHashHasher> pending_chunks;
+static std::map<uint32_t, std::chrono::steady_clock::time_point> last_upload;   // 发送端 -> 最近一次上传分块的时间
+static std::map<std::pair<uint32_t, uint32_t>, std::shared_ptr<const ChunkOffer>> offers;
+static std::deque<std::pair<uint32_t, uint32_t>> offer_order;
+
+// 日志函数
+void logw(const std::string &s) {
+    std::lock_guard<std::mutex> lk(cout_mtx);
+    std::cout << s << std::endl;
+}
+
+void expire_pending_chunks();
+
+// 设置选项，并在第一次调用时启动等待登记的清理线程
+void relay_configure(const RelayOptions& opt) {
+    options = opt;
+    static std::once_flag sweeper;
+    std::call_once(sweeper, []{
+        std::thread([]{
+            while(true){
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                expire_pending_chunks();
+            }
+        }).detach();
+    });
+}
+
+// 构建完整报文（头部 + 载荷），CRC或加密由发送线程在发送前直接在该缓冲区上完成（finish_frame）
+// 预留认证标签的容量，加密时无需重新分配；prefix_id非空时在载荷前加4字节（转发时的发送者ID）
+std::vector<uint8_t> make_frame(uint8_t type, const uint8_t* body, size_t body_len, const uint32_t* prefix_id = nullptr,
+                                uint16_t flags = 0) {
+    size_t plen = body_len + (prefix_id ? 4 : 0);
+    std::vector<uint8_t> buf;
+    buf.reserve(sizeof(AppHeader) + plen + AEAD_TAG_BYTES);
+    buf.resize(sizeof(AppHeader) + plen);
+
+    // 1. 初始化报文头（CRC字段先置0）
+    AppHeader hdr{};
+    hdr.magic = PROTO_MAGIC;
+    hdr.version = 1;
+    hdr.msg_type = type;
+    hdr.flags = flags;
+    hdr.payload_len = (uint32_t)plen;
+    hdr.crc32 = 0;
+    memcpy(buf.data(), &hdr, sizeof(hdr));
+
+    // 2. 填充载荷
+    uint8_t* p = buf.data() + sizeof(hdr);
+    if(prefix_id){ memcpy(p, prefix_id, 4); p += 4; }
+    if(body_len) memcpy(p, body, body_len);
+    return buf;
+}
+
+// 发送前完成报文：加密连接原地加密并追加标签，明文连接计算CRC32回填到头部
+void finish_frame(Session& s, std::vector<uint8_t>& f) {
+    if(s.tx_secure){
+        s.tx.seal(f);
+        return;
+    }
+    uint32_t c = crc32_calc(f.data(), f.size());
+    memcpy(f.data() + offsetof(AppHeader, crc32), &c, 4);
+}
+
+// 把一帧放入目标会话中某个来源的队列
+// 来源队列超过上限时阻塞调用者（只反压该来源自己）；src=0为服务器控制消息，由接收线程产生，
+// 不能阻塞，超过MAX_CONTROL_BYTES时丢弃该帧
+bool enqueue_frame(Session& dest, uint32_t src, std::vector<uint8_t> frame) {
+    std::unique_lock<std::mutex> lk(dest.mtx);
+    if(src != 0){
+        dest.space_cv.wait(lk, [&]{ return dest.closed || dest.queued_bytes[src] < MAX_QUEUED_BYTES; });
+    } else if(dest.queued_bytes[0] >= MAX_CONTROL_BYTES){
+        return false;
+    }
+    if(dest.closed) return false;
+    auto& q = dest.queues[src];
+    if(q.empty()) dest.active.push_back(src);
+    dest.queued_bytes[src] += frame.size();
+    q.push_back(std::move(frame));
+    lk.unlock();
+    dest.data_cv.notify_one();
+    return true;
+}
+
+// 发送报文函数（服务器自身产生的控制消息）
+void send_header_and_payload(Session& s, uint8_t type, const std::vector<uint8_t>& payload) {
+    enqueue_frame(s, 0, make_frame(type, payload.data(), payload.size()));
+}
+
+// 限速通知：[被限速的msg_type:1][建议重试等待毫秒:4]
+void send_throttled(Session& s, uint8_t type, uint32_t retry_ms) {
+    std::vector<uint8_t> p(5);
+    p[0] = type;
+    memcpy(p.data()+1, &retry_ms, 4);
+    send_header_and_payload(s, MT_THROTTLED, p);
+}
+
+// 错误回复：限速开启时按ERROR_REPLIES_PER_SEC限流，超出的直接丢弃（错误帧本身已计入文本预算）
+void send_error(Session& s, const std::vector<uint8_t>& payload) {
+    if(options.rate_limit && !s.error_replies.try_take(1, std::chrono::steady_clock::now())) return;
+    send_header_and_payload(s, MT_INVALID_SEMANTIC, payload);
+}
+
+// 结束握手等待，开始发送其他客户端的报文
+void release_hold(Session& s) {
+    {
+        std::lock_guard<std::mutex> lk(s.mtx);
+        if(!s.hold) return;
+        s.hold = false;
+    }
+    s.data_cv.notify_one();
+}
+
+// 发送线程：差额轮询各来源队列，一个来源每轮最多发送约DRR_QUANTUM字节
+void writer_loop(std::shared_ptr<Session> sp) {
+    Session& s = *sp;
+    std::vector<std::vector<uint8_t>> batch;
+    while(true){
+        batch.clear();
+        uint32_t src = 0;
+        {
+            std::unique_lock<std::mutex> lk(s.mtx);
+            if(s.hold){
+                // 握手完成之前只发送控制消息（src=0）
+                if(!s.data_cv.wait_until(lk, s.hold_until, [&]{ return s.closed || !s.hold || s.queues.count(0); })) s.hold = false;
+            } else {
+                s.data_cv.wait(lk, [&]{ return s.closed || !s.active.empty(); });
+            }
+            if(s.closed) return;
+            if(s.hold ? !s.queues.count(0) : s.active.empty()) continue;
+
+            // 1. 取出轮询队首的来源（握手前固定为控制消息）并增加其配额
+            if(s.hold){
+                s.active.erase(std::find(s.active.begin(), s.active.end(), 0u));
+            } else {
+                src = s.active.front();
+                s.active.pop_front();
+            }
+            auto& q = s.queues[src];
+            int64_t& d = s.deficit[src];
+            d += DRR_QUANTUM;
+
+            // 2. 配额足够时连续取帧
+            while(!q.empty() && (int64_t)q.front().size() <= d){
+                d -= (int64_t)q.front().size();
+                s.queued_bytes[src] -= q.front().size();
+                batch.push_back(std::move(q.front()));
+                q.pop_front();
+            }
+
+            // 3. 队列清空则退出轮询并清零配额，否则排到队尾
+            if(q.empty()){
+                s.queues.erase(src);
+                s.queued_bytes.erase(src);
+                s.deficit.erase(src);
+            } else {
+                s.active.push_back(src);
+            }
+        }
+        s.space_cv.notify_all();
+
+        // 4. 在锁外逐帧加密（或计算CRC）并发送，加密与上一帧的发送交替进行
+        for(auto& f : batch){
+            finish_frame(s, f);
+            if(!s.conn->send_all(f.data(), f.size())){
+                std::lock_guard<std::mutex> lk(s.mtx);
+                s.closed = true;
+                s.space_cv.notify_all();
+                return;
+            }
+            // 服务器自己的握手回复（src=0）以明文发出，之后的帧全部加密，暂缓的转发报文开始发送
+            if(!s.tx_secure && src == 0 && f[offsetof(AppHeader, msg_type)] == MT_HANDSHAKE){
+                s.tx_secure = true;
+                std::lock_guard<std::mutex> lk(s.mtx);
+                s.hold = false;
+            }
+        }
+    }
+}
+
+// 只由服务器产生的消息类型：客户端发来的这类报文不转发（否则可伪造ACK、限速通知，或用握手帧使目标连接错误地切换为加密）
+bool server_only_type(uint8_t type) {
+    return type == MT_ACK || type == MT_INVALID_SEMANTIC || type == MT_THROTTLED || type == MT_HANDSHAKE;
+}
+
+// 按文本预算检查一帧，超限时丢弃，进入限速时通知一次
+// 持续洪泛时预算每补充一个令牌就会放行一帧，所以限速的结束以超过THROTTLE_EPISODE_GAP没有再超限为准
+// 校验失败的帧和握手帧的类型不可信，也按文本计费
+bool admit_text(Session& s, uint8_t type, size_t frame_bytes) {
+    auto now = std::chrono::steady_clock::now();
+    if(s.text_budget.try_take(frame_bytes, now)) return true;
+    bool fresh = now - s.text_over > THROTTLE_EPISODE_GAP;
+    s.text_over = now;
+    if(fresh) send_throttled(s, type, s.text_budget.wait_ms(frame_bytes));
+    return false;
+}
+
+// 对一帧进行限速检查，返回false表示该帧被丢弃
+// 文本类消息超限直接丢弃；文件数据不能丢，超限时暂停读取该连接（TCP反压）；两者都只在进入限速时通知一次
+// 回执随分块数据的速率产生，同样按文件流量处理（丢弃回执会使对方的发送窗口停顿到超时）；
+// 放弃通知(MT_SKIP)丢失会使接收端一直等待空缺，也不能丢弃
+bool admit_frame(Session& s, const AppHeader& hdr) {
+    size_t frame_bytes = sizeof(AppHeader) + hdr.payload_len;
+    bool is_file = hdr.msg_type == MT_FILE_META || hdr.msg_type == MT_FILE_CHUNK || hdr.msg_type == MT_FILE_MANIFEST
+                || hdr.msg_type == MT_CHUNK_REQUEST || hdr.msg_type == MT_CHUNK_DATA || hdr.msg_type == MT_RECEIPT
+                || hdr.msg_type == MT_SKIP;
+    if(!is_file) return admit_text(s, hdr.msg_type, frame_bytes);
+    auto now = std::chrono::steady_clock::now();
+    if(s.file_budget.try_take(frame_bytes, now)) return true;
+    if(now - s.file_over > THROTTLE_EPISODE_GAP) send_throttled(s, hdr.msg_type, s.file_budget.wait_ms(frame_bytes));
+    while(!s.file_budget.try_take(frame_bytes, now)){
+        std::this_thread::sleep_for(std::chrono::milliseconds(s.file_budget.wait_ms(frame_bytes)));
+        now = std::chrono::steady_clock::now();
+    }
+    s.file_over = now;
+    return true;
+}
+
+// 查找在线会话
+std::shared_ptr<Session> find_session(uint32_t id) {
+    std::lock_guard<std::mutex> lk(clients_mtx);
+    auto it = clients.find(id);
+    return it != clients.end() ? it->second : nullptr;
+}
+
+// 以owner的名义向接收者发送一个分块：[xfer_id:4][sha256:32][data]
+void send_cached_chunk(Session& dest, uint32_t owner, uint32_t xfer, const ChunkHash& h, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> body(4 + 32 + data.size());
+    memcpy(body.data(), &xfer, 4);
+    memcpy(body.data()+4, h.data(), 32);
+    if(!data.empty()) memcpy(body.data()+36, data.data(), data.size());
+    enqueue_frame(dest, owner, make_frame(MT_CHUNK_DATA, body.data(), body.size(), &owner));
+}
+
+// 记录转发的清单（body为去掉目标ID后的载荷）
+void record_offer(uint32_t owner, uint32_t recipient, const uint8_t* body, size_t len) {
+    FileManifest m;
+    if(!decode_manifest(body, len, m)) return;
+    auto o = std::make_shared<ChunkOffer>();
+    o->recipient = recipient;
+    for(auto& c : m.chunks) o->chunks.insert(c.hash);
+    std::lock_guard<std::mutex> lk(pending_mtx);
+    auto key = std::make_pair(owner, m.xfer_id);
+    if(!offers.count(key)) offer_order.push_back(key);
+    offers[key] = std::move(o);
+    while(offer_order.size() > MAX_OFFERS){
+        offers.erase(offer_order.front());
+        offer_order.pop_front();
+    }
+}
+
+// 过滤分块请求：发送端向该接收者提供过的分块，若缓存中有该发送端上传的同一分块则由服务器直接代发，
+// 若该发送端正在为其他接收者上传则登记等待；其余保留在请求中转发给发送端。返回false表示请求已全部处理，无需转发
+bool filter_chunk_request(Session& requester, uint32_t owner, uint8_t* body, size_t len, size_t& new_len) {
+    if(len < 8) return true;
+    uint32_t xfer, count;
+    memcpy(&xfer, body, 4);
+    memcpy(&count, body+4, 4);
+    if((len - 8) / 32 < count) return true;
+
+    std::shared_ptr<const ChunkOffer> offer;
+    {
+        std::lock_guard<std::mutex> lk(pending_mtx);
+        auto it = offers.find({owner, xfer});
+        if(it != offers.end() && it->second->recipient == requester.id) offer = it->second;
+    }
+    uint32_t keep = 0;
+    auto now = std::chrono::steady_clock::now();
+    for(uint32_t i = 0; i < count; i++){
+        ChunkHash h;
+        memcpy(h.data(), body + 8 + i*32, 32);
+        bool offered = offer && offer->chunks.count(h);
+        if(offered){
+            if(auto data = chunk_cache.get(h, owner)){
+                send_cached_chunk(requester, owner, xfer, h, *data);
+                continue;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lk(pending_mtx);
+            auto it = pending_chunks.find(h);
+            if(it != pending_chunks.end() && it->second.owner == owner){
+                // 同一发送端正在上传：登记等待；已在等待的接收者再次请求（它的重试）时直接转发
+                auto& ws = it->second.waiters;
+                bool again = it->second.requester == requester.id;
+                for(auto& w : ws) again = again || (w.requester == requester.id && w.xfer == xfer);
+                if(offered && !again){
+                    ws.push_back(ChunkWaiter{requester.id, owner, xfer});
+                    continue;
+                }
+                it->second.since = now;
+                it->second.requester = requester.id;
+            } else if(it == pending_chunks.end() && pending_chunks.size() < MAX_PENDING_CHUNKS){
+                pending_chunks[h] = PendingChunk{now, owner, requester.id, {}};
+            }
+        }
+        memmove(body + 8 + keep*32, body + 8 + i*32, 32);
+        keep++;
+    }
+    if(keep == 0) return false;
+    memcpy(body+4, &keep, 4);
+    new_len = 8 + (size_t)keep * 32;
+    return true;
+}
+
+// 分块数据：校验哈希后以上传者的名义放入缓存，并分发给向该上传者请求同一分块的等待者
+void cache_chunk_data(uint32_t owner, const uint8_t* body, size_t len) {
+    if(len < 36) return;
+    ChunkHash h, actual;
+    memcpy(h.data(), body+4, 32);
+    sha256_calc(body+36, len-36, actual.data());
+    if(actual != h) return;   // 哈希不符的数据不进入缓存，避免污染其他用户
+    auto data = std::make_shared<const std::vector<uint8_t>>(body+36, body+len);
+    chunk_cache.put(h, data, owner);
+
+    std::vector<ChunkWaiter> waiters;
+    {
+        std::lock_guard<std::mutex> lk(pending_mtx);
+        last_upload[owner] = std::chrono::steady_clock::now();
+        auto it = pending_chunks.find(h);
+        if(it == pending_chunks.end() || it->second.owner != owner) return;
+        waiters.swap(it->second.waiters);
+        pending_chunks.erase(it);
+    }
+    for(auto& w : waiters){
+        if(auto dest = find_session(w.requester)) send_cached_chunk(*dest, w.owner, w.xfer, h, *data);
+    }
+}
+
+// 清理过期的等待登记：发送端超过CHUNK_PENDING_TIMEOUT既没有上传该分块也没有上传其他分块时，
+// 把等待者的请求以等待者的名义重新转发给发送端；发送端已离线时丢弃（接收端重试几次后自行失败）
+void expire_pending_chunks() {
+    auto now = std::chrono::steady_clock::now();
+    std::map<std::tuple<uint32_t, uint32_t, uint32_t>, std::vector<ChunkHash>> reforward;   // (等待者, 发送端, xfer_id) -> 分块
+    {
+        std::lock_guard<std::mutex> lk(pending_mtx);
+        for(auto it = pending_chunks.begin(); it != pending_chunks.end();){
+            auto up = last_upload.find(it->second.owner);
+            bool active = up != last_upload.end() && now - up->second < CHUNK_PENDING_TIMEOUT;
+            if(now - it->second.since < CHUNK_PENDING_TIMEOUT || active){ ++it; continue; }
+            for(auto& w : it->second.waiters) reforward[std::make_tuple(w.requester, w.owner, w.xfer)].push_back(it->first);
+            it = pending_chunks.erase(it);
+        }
+        for(auto it = last_upload.begin(); it != last_upload.end();){
+            if(now - it->second >= CHUNK_PENDING_TIMEOUT) it = last_upload.erase(it);
+            else ++it;
+        }
+    }
+    for(auto& kv : reforward){
+        uint32_t requester = std::get<0>(kv.first), xfer = std::get<2>(kv.first);
+        auto owner = find_session(std::get<1>(kv.first));
+        if(!owner || !find_session(requester)) continue;
+        auto& hs = kv.second;
+        for(size_t i = 0; i < hs.size(); i += 1024){
+            uint32_t n = (uint32_t)std::min<size_t>(1024, hs.size() - i);
+            std::vector<uint8_t> body(8 + (size_t)n * 32);
+            memcpy(body.data(), &xfer, 4);
+            memcpy(body.data()+4, &n, 4);
+            for(uint32_t k = 0; k < n; k++) memcpy(body.data() + 8 + k*32, hs[i+k].data(), 32);
+            enqueue_frame(*owner, requester, make_frame(MT_CHUNK_REQUEST, body.data(), body.size(), &requester));
+        }
+    }
+}
+
+// 录制一帧：解密后的帧按明文记录并补上CRC，回放工具可直接以明文连接重放
+void trace_frame(uint32_t id, AppHeader hdr, std::vector<uint8_t>& frame, bool decrypted) {
+    if(decrypted){
+        hdr.crc32 = 0;
+        memcpy(frame.data(), &hdr, sizeof(hdr));
+        hdr.crc32 = crc32_calc(frame.data(), sizeof(hdr) + hdr.payload_len);
+    }
+    options.trace->frame(id, hdr, frame.data() + sizeof(hdr));
+}
+
+// 客户端处理线程函数
+void relay_client(std::shared_ptr<Transport> conn) {
+    // 分配唯一ID
+    uint32_t myid = next_id.fetch_add(1);
+    auto self = std::make_shared<Session>();
+    self->id = myid;
+    self->conn = conn;
+    self->hold = options.identity != nullptr;
+    self->hold_until = std::chrono::steady_clock::now() + HANDSHAKE_HOLD;
+    self->file_budget = TrafficBudget{FILE_MSGS_PER_SEC, FILE_MSGS_BURST, options.file_bytes_per_sec, FILE_BYTES_BURST};
+    self->writer = std::thread(writer_loop, self);
+
+    // 注册客户端到全局列表
+    {
+        std::lock_guard<std::mutex> lk(clients_mtx);
+        clients[myid] = self;
+    }
+
+    // 日志记录
+    logw("Client connected id=" + std::to_string(myid));
+    if(options.trace) options.trace->connect(myid);
+    // 发送ACK消息告知客户端其ID
+    std::vector<uint8_t> ack(4);
+    memcpy(ack.data(), &myid, 4);
+    send_header_and_payload(*self, MT_ACK, ack);
+
+    // 主接收循环（握手完成后该连接只接受加密帧）
+    bool secure = false, plain_started = false;
+    CipherState rx;
+    while(true){
+        // 1. 接收报文头
+        AppHeader hdr;
+        if(!conn->recv_all(&hdr, sizeof(hdr))){
+            logw("client " + std::to_string(myid) + " disconnected");
+            break;
+        }
+        // 2. 验证魔数
+        if(hdr.magic != PROTO_MAGIC){
+            logw("bad magic from " + std::to_string(myid)); break;
+        }
+        // 载荷长度在校验之前不可信，超过上限时不分配缓冲区，直接断开
+        if(hdr.payload_len > MAX_PAYLOAD_BYTES){
+            logw("frame too large from " + std::to_string(myid) + " (" + std::to_string(hdr.payload_len) + " bytes)"); break;
+        }
+        // 3. 接收报文（头部 + 载荷放在同一缓冲区，CRC校验和解密都无需再拷贝）
+        std::vector<uint8_t> frame(sizeof(hdr) + hdr.payload_len);
+        AppHeader tmp = hdr; tmp.crc32 = 0;
+        memcpy(frame.data(), &tmp, sizeof(tmp));
+        if(hdr.payload_len){
+            if(!conn->recv_all(frame.data()+sizeof(hdr), hdr.payload_len)){
+                logw("recv payload failed"); break;
+            }
+        }
+        uint8_t* payload = frame.data() + sizeof(hdr);
+        // 4. 加密连接：认证并原地解密（AEAD已保证完整性，跳过CRC）；明文连接：验证CRC32
+        if(secure){
+            uint32_t plain_len;
+            if(!rx.open(hdr, payload, plain_len)){
+                logw("decrypt failed from " + std::to_string(myid));
+                break;   // 序号已无法同步，只能断开
+            }
+            hdr.flags &= ~FLAG_ENCRYPTED;
+            hdr.payload_len = plain_len;
+            if(options.trace) trace_frame(myid, hdr, frame, true);
+        } else {
+            // 握手帧不录制：回放连接是明文的，重放握手只会使有身份的服务器进入加密状态
+            if(options.trace && hdr.msg_type != MT_HANDSHAKE) trace_frame(myid, hdr, frame, false);
+            uint32_t c = crc32_calc(frame.data(), frame.size());
+            if(c != hdr.crc32){
+                // 先计入文本预算再回复，错误回复本身也限流
+                if(options.rate_limit && !admit_text(*self, hdr.msg_type, frame.size())) continue;
+                logw("crc mismatch from " + std::to_string(myid));
+                // reply invalid semantic
+                send_error(*self, {});
+                continue;
+            }
+            // 加密握手：回复以明文发出，发送线程发出回复后切换为加密
+            if(hdr.msg_type == MT_HANDSHAKE){
+                if(options.rate_limit && !admit_text(*self, hdr.msg_type, frame.size())) continue;
+                std::vector<uint8_t> reply;
+                CipherState tx;
+                if(!options.identity || !handshake_respond(*options.identity, myid, payload, hdr.payload_len, reply, rx, tx)){
+                    send_error(*self, {});
+                    continue;
+                }
+                self->tx = tx;
+                send_header_and_payload(*self, MT_HANDSHAKE, reply);
+                secure = true;
+                logw("client " + std::to_string(myid) + " encrypted");
+                continue;
+            }
+            // 明文客户端（不握手）：从第一个非握手帧起正常转发
+            if(!plain_started){
+                plain_started = true;
+                release_hold(*self);
+            }
+        }
+        // 5. 限速检查
+        if(options.rate_limit && !admit_frame(*self, hdr)){
+            continue;
+        }
+        // 6. 丢弃只由服务器产生的消息类型（加密连接上的握手帧也在此丢弃），提取目标客户端ID
+        if(server_only_type(hdr.msg_type)){
+            logw("dropped control type=" + std::to_string(hdr.msg_type) + " from " + std::to_string(myid));
+            continue;
+        }
+        if(hdr.payload_len < 4){
+            // 空载荷的心跳发给服务器本身（明文客户端连接后以此结束握手等待），不转发
+            if(hdr.msg_type == MT_HEARTBEAT && hdr.payload_len == 0) continue;
+            logw("payload too short from " + std::to_string(myid));
+            continue;
+        }
+        uint32_t target;
+        memcpy(&target, payload, 4);
+
+        // 7. 查找目标客户端是否在线
+        std::shared_ptr<Session> dest;
+        {
+            std::lock_guard<std::mutex> lk(clients_mtx);
+            auto it = clients.find(target);
+            if(it != clients.end()) dest = it->second;
+        }
+        // 8. 目标不在线的处理
+        if(!dest){
+            logw("target " + std::to_string(target) + " not online (from " + std::to_string(myid) + ")");
+            std::vector<uint8_t> p(TARGET_OFFLINE_TAG, TARGET_OFFLINE_TAG + sizeof(TARGET_OFFLINE_TAG) - 1);
+            p.insert(p.end(), payload, payload + 4);
+            send_error(*self, p);
+            continue;
+        }
+        // 9. 去重传输：分块请求先查服务器缓存，分块数据放入缓存，记录清单的接收者（带序号时跳过序号）
+        size_t body_len = hdr.payload_len - 4;
+        uint16_t seq_flag = hdr.flags & FLAG_SEQ;
+        if(hdr.msg_type == MT_CHUNK_REQUEST){
+            if(!filter_chunk_request(*self, target, frame.data()+sizeof(hdr)+4, body_len, body_len)) continue;
+        } else if(hdr.msg_type == MT_CHUNK_DATA){
+            size_t skip = seq_flag ? 4 : 0;
+            if(body_len >= skip) cache_chunk_data(myid, payload+4+skip, body_len-skip);
+        } else if(hdr.msg_type == MT_FILE_MANIFEST){
+            size_t skip = seq_flag ? 4 : 0;
+            if(body_len >= skip) record_offer(myid, target, payload+4+skip, body_len-skip);
+        }
+        // 10. 转发消息（发送者ID替换目标ID作为前缀，序号原样保留，回执由接收端经同一路径发回），放入目标的本来源队列
+        enqueue_frame(*dest, myid, make_frame(hdr.msg_type, payload+4, body_len, &myid, seq_flag));
+        // 11. 日志记录
+        if(options.log_forward) logw("forwarded type=" + std::to_string(hdr.msg_type) + " from " + std::to_string(myid) + " -> " + std::to_string(target));
+    }
+
+    // 12. 从客户端列表中移除
+    {
+        std::lock_guard<std::mutex> lk(clients_mtx);
+        clients.erase(myid);
+    }
+    // 13. 停止发送线程（唤醒所有等待本会话队列空间的来源），关闭连接
+    {
+        std::lock_guard<std::mutex> lk(self->mtx);
+        self->closed = true;
+    }
+    self->data_cv.notify_all();
+    self->space_cv.notify_all();
+    conn->shutdown();
+    self->writer.join();
+    // 14. 日志记录
+    if(options.trace) options.trace->disconnect(myid);
+    logw("client handler exit " + std::to_string(myid));
+}
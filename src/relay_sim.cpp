@@ -0,0 +1,1215 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+
+#include "../include/protocol.hpp"
+#include "../include/crc32.hpp"
+#include "../include/relay.hpp"
+#include "../include/trace.hpp"
+#include "../include/secure_channel.hpp"
+#include "../include/delivery.hpp"
+#include "../include/dedup.hpp"
+#include "../include/log_buffer.hpp"
+
+// 进程内转发仿真：relay_client 运行在内存管道上，不经过套接字，用于单独测量路由/CRC/分帧的开销
+// 用法：relay_sim <录制文件> [-n 连接数] [-e]
+//       relay_sim -n 连接数 [-m 每连接消息数] [-b 载荷字节数] [-e]   （固定种子生成的随机文本流量）
+//       relay_sim -f 探测消息数 [-n 连接数]   （洪泛下的延迟：开启限速，测量正常客户端的消息延迟）
+//       relay_sim -g 文件MB数 [-e]            （界面吞吐：文件接收时不更新界面、按帧合并更新、每个事件同步更新的对比）
+//       relay_sim -l 消息数 [-b 载荷字节数] [-e]   （单条消息延迟：逐条发送，测量发送到对端解密完成的时间）
+//       relay_sim -d 文件MB数 [-c 仓库MB数] [-e]（去重传输的线路流量：首次发送、重发、小幅修改后发送、扇出，任一阶段失败时返回1）
+//       relay_sim -r 单向延迟毫秒 [-e]        （回执与发送窗口：注入延迟和丢包，检查空缺处理、放弃通知、窗口和离线清理，任一检查失败时返回1）
+//       relay_sim -x 轮数 [-e]                （伪造控制消息：检查服务器不转发握手、ACK、限速通知和错误回复，目标连接不受影响，超长帧使连接断开，失败时返回1）
+// -e：各连接先完成加密握手，测量加密转发（服务器解密+加密代替两次CRC）
+// 除-f外限速和逐条转发日志在仿真中关闭，结果只取决于输入
+
+// 有界字节管道（模拟TCP：写满时阻塞，关闭后收发都返回false）
+class MemPipe {
+public:
+    explicit MemPipe(size_t cap = 1024 * 1024): ring(cap) {}
+
+    bool write(const uint8_t* p, size_t n){
+        std::unique_lock<std::mutex> lk(mtx);
+        while(n){
+            can_write.wait(lk, [&]{ return closed || used < ring.size(); });
+            if(closed) return false;
+            size_t tail = (head + used) % ring.size();
+            size_t k = std::min(n, std::min(ring.size() - used, ring.size() - tail));
+            memcpy(&ring[tail], p, k);
+            used += k; p += k; n -= k;
+            written += k;
+            can_read.notify_one();
+        }
+        return true;
+    }
+
+    bool read(uint8_t* p, size_t n){
+        std::unique_lock<std::mutex> lk(mtx);
+        while(n){
+            can_read.wait(lk, [&]{ return closed || used > 0; });
+            if(closed) return false;
+            size_t k = std::min(n, std::min(used, ring.size() - head));
+            memcpy(p, &ring[head], k);
+            head = (head + k) % ring.size();
+            used -= k; p += k; n -= k;
+            can_write.notify_one();
+        }
+        return true;
+    }
+
+    // 累计写入的字节数（用于统计线路上的流量）
+    uint64_t bytes_written(){
+        std::lock_guard<std::mutex> lk(mtx);
+        return written;
+    }
+
+    void close(){
+        std::lock_guard<std::mutex> lk(mtx);
+        closed = true;
+        can_read.notify_all();
+        can_write.notify_all();
+    }
+
+private:
+    std::mutex mtx;
+    std::condition_variable can_read, can_write;
+    std::vector<uint8_t> ring;
+    size_t head = 0, used = 0;
+    uint64_t written = 0;
+    bool closed = false;
+};
+
+// 服务器一侧的内存传输：up为客户端->服务器，down为服务器->客户端
+class MemTransport : public Transport {
+public:
+    MemTransport(std::shared_ptr<MemPipe> u, std::shared_ptr<MemPipe> d): up(u), down(d) {}
+    bool recv_all(void* buf, size_t len) override { return up->read((uint8_t*)buf, len); }
+    bool send_all(const void* buf, size_t len) override { return down->write((const uint8_t*)buf, len); }
+    void shutdown() override { up->close(); down->close(); }
+private:
+    std::shared_ptr<MemPipe> up, down;
+};
+
+// 延迟线：把src中的报文整帧转到dst，每帧在到达后delay才写出（模拟传播延迟，不限制带宽）
+// src关闭后写完剩余的帧再关闭dst
+class DelayLine {
+public:
+    DelayLine(std::shared_ptr<MemPipe> s, std::shared_ptr<MemPipe> d, std::chrono::microseconds delay): src(s), dst(d), lag(delay) {
+        in = std::thread([this]{ read_loop(); });
+        out = std::thread([this]{ write_loop(); });
+    }
+    void join(){
+        if(in.joinable()) in.join();
+        if(out.joinable()) out.join();
+    }
+    ~DelayLine(){ join(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    void read_loop(){
+        while(true){
+            std::vector<uint8_t> f(sizeof(AppHeader));
+            if(!src->read(f.data(), f.size())) break;
+            AppHeader hdr;
+            memcpy(&hdr, f.data(), sizeof(hdr));
+            f.resize(sizeof(hdr) + hdr.payload_len);
+            if(hdr.payload_len && !src->read(f.data() + sizeof(hdr), hdr.payload_len)) break;
+            std::lock_guard<std::mutex> lk(mtx);
+            q.push_back({Clock::now() + lag, std::move(f)});
+            cv.notify_one();
+        }
+        std::lock_guard<std::mutex> lk(mtx);
+        closed = true;
+        cv.notify_one();
+    }
+    void write_loop(){
+        while(true){
+            std::pair<Clock::time_point, std::vector<uint8_t>> f;
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [&]{ return closed || !q.empty(); });
+                if(q.empty()) break;
+                f = std::move(q.front());
+                q.pop_front();
+            }
+            std::this_thread::sleep_until(f.first);
+            if(!dst->write(f.second.data(), f.second.size())) break;
+        }
+        dst->close();
+    }
+
+    std::shared_ptr<MemPipe> src, dst;
+    std::chrono::microseconds lag;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::pair<Clock::time_point, std::vector<uint8_t>>> q;
+    bool closed = false;
+    std::thread in, out;
+};
+
+static const char FENCE[] = "relay_sim_fence";
+
+// 仿真客户端：接收线程统计报文，收齐所有来源的结束标记后通知主线程
+struct SimConn {
+    std::shared_ptr<MemPipe> up, down;
+    std::thread relay, reader;
+    uint32_t id = 0;
+    std::atomic<uint64_t> frames{0}, bytes{0}, errors{0}, auth_fail{0};   // 接收线程写，主线程读
+    size_t fences = 0;
+    bool secure = false;
+    CipherState tx, rx;
+};
+
+static std::mutex done_mtx;
+static std::condition_variable done_cv;
+static size_t conns_done = 0;
+
+// 加密模式下只解密结束标记（校验服务器加密流的序号和完整性），其余报文只计数，不计入客户端解密开销
+void reader_loop(SimConn* c, size_t n){
+    std::vector<uint8_t> payload;
+    const uint32_t fence_len = 4 + sizeof(FENCE) + (c->secure ? AEAD_TAG_BYTES : 0);
+    while(true){
+        AppHeader hdr;
+        if(!c->down->read((uint8_t*)&hdr, sizeof(hdr))) return;
+        payload.resize(hdr.payload_len);
+        if(hdr.payload_len && !c->down->read(payload.data(), hdr.payload_len)) return;
+        bool fence = hdr.msg_type == MT_HEARTBEAT && hdr.payload_len == fence_len;
+        if(c->secure){
+            uint32_t plain_len;
+            if(!fence) c->rx.seq++;
+            else if(!c->rx.open(hdr, payload.data(), plain_len)) c->auth_fail++;
+        }
+        if(fence && memcmp(payload.data() + 4, FENCE, sizeof(FENCE)) == 0){
+            if(++c->fences == n){
+                std::lock_guard<std::mutex> lk(done_mtx);
+                conns_done++;
+                done_cv.notify_all();
+            }
+            continue;
+        }
+        if(hdr.msg_type == MT_INVALID_SEMANTIC) c->errors++;
+        else c->frames++;
+        c->bytes += sizeof(hdr) + hdr.payload_len;
+    }
+}
+
+// 等待所有连接的接收都停止增长（quiet时间内没有新报文）：服务器的错误回复走控制队列，
+// 可能晚于结束标记到达，统计前先排空
+void drain_conns(const std::vector<std::unique_ptr<SimConn>>& conns, std::chrono::milliseconds quiet){
+    uint64_t last = UINT64_MAX;
+    while(true){
+        uint64_t total = 0;
+        for(auto& c : conns) total += c->bytes;
+        if(total == last) return;
+        last = total;
+        std::this_thread::sleep_for(quiet);
+    }
+}
+
+// 待发送的报文：来源连接、目标连接（-1表示录制中不存在的目标）
+struct SimFrame {
+    size_t src;
+    long dst;
+    std::vector<uint8_t> frame;
+};
+
+std::vector<uint8_t> build_frame(uint8_t type, const uint8_t* payload, size_t len, uint16_t flags = 0){
+    AppHeader h{};
+    h.magic = PROTO_MAGIC; h.version = 1; h.msg_type = type; h.flags = flags; h.payload_len = (uint32_t)len; h.crc32 = 0;
+    std::vector<uint8_t> f(sizeof(h) + len);
+    memcpy(f.data(), &h, sizeof(h));
+    if(len) memcpy(f.data() + sizeof(h), payload, len);
+    h.crc32 = crc32_calc(f.data(), f.size());
+    memcpy(f.data() + offsetof(AppHeader, crc32), &h.crc32, 4);
+    return f;
+}
+
+// 启动转发线程：明文连接读取ACK得到ID，加密连接完成握手
+bool start_conn(SimConn& c, bool encrypt = false){
+    c.up = std::make_shared<MemPipe>();
+    c.down = std::make_shared<MemPipe>();
+    c.relay = std::thread(relay_client, std::make_shared<MemTransport>(c.up, c.down));
+    if(encrypt){
+        std::string err;
+        auto up = c.up, down = c.down;
+        c.secure = client_handshake([down](void* b, size_t l){ return down->read((uint8_t*)b, l); },
+                                    [up](const void* b, size_t l){ return up->write((const uint8_t*)b, l); },
+                                    "", c.id, c.tx, c.rx, err);
+        if(!c.secure) std::cerr<<"handshake fail: "<<err<<"\n";
+        return c.secure;
+    }
+    AppHeader hdr;
+    if(!c.down->read((uint8_t*)&hdr, sizeof(hdr)) || hdr.msg_type != MT_ACK || hdr.payload_len != 4
+       || !c.down->read((uint8_t*)&c.id, 4)) return false;
+    // 明文连接与replay相同，先发一个空心跳结束服务器的握手等待
+    auto hb = build_frame(MT_HEARTBEAT, nullptr, 0);
+    return c.up->write(hb.data(), hb.size());
+}
+
+// 配置转发核心；与server相同，始终配置服务器身份（明文连接也经过握手等待）
+static ServerIdentity sim_identity;
+bool configure_relay(bool rate_limit){
+    RelayOptions opt;
+    opt.rate_limit = rate_limit;
+    opt.log_forward = false;
+    if(!sim_identity.generate()){ std::cerr<<"no random source\n"; return false; }
+    opt.identity = &sim_identity;
+    relay_configure(opt);
+    return true;
+}
+
+// 端到端模式的仿真客户端：与控制台客户端相同的收发路径（加密、序号去重、回执、去重传输），
+// 各端点使用自己的分块仓库目录
+struct SimPeer {
+    SimConn c;
+    std::mutex send_mtx;
+    std::unique_ptr<Delivery> delivery;
+    std::unique_ptr<DedupTransfer> transfers;
+    std::thread recv, ticker;
+    std::atomic<bool> run{true};
+    Delivery::ReceiptFn on_receipt = [](uint32_t, uint32_t, ReceiptState){};
+    DedupTransfer::StatusFn on_status = [](const TransferStatus&){};
+    std::unique_ptr<DelayLine> delay;                                            // 下行注入延迟时使用
+    std::function<bool(uint8_t type, const std::vector<uint8_t>& payload)> drop;  // 返回true时丢弃（模拟丢包）
+    std::function<void(const AppHeader& hdr, const std::vector<uint8_t>& payload)> tap;  // 解密后的每一帧
+
+    std::vector<uint8_t> frame;   // 加密时复用的发送缓冲区（受send_mtx保护）
+
+    bool send_packet(uint8_t type, const std::vector<uint8_t>& payload, uint16_t flags = 0){
+        if(drop && drop(type, payload)) return true;
+        if(!c.secure){
+            std::vector<uint8_t> f = build_frame(type, payload.data(), payload.size(), flags);
+            std::lock_guard<std::mutex> lk(send_mtx);
+            return c.up->write(f.data(), f.size());
+        }
+        AppHeader h{};
+        h.magic = PROTO_MAGIC; h.version = 1; h.msg_type = type; h.flags = flags; h.payload_len = (uint32_t)payload.size();
+        std::lock_guard<std::mutex> lk(send_mtx);
+        c.tx.seal_into(h, payload.data(), payload.size(), frame);
+        return c.up->write(frame.data(), frame.size());
+    }
+};
+
+void peer_recv_loop(SimPeer* p){
+    std::vector<uint8_t> payload;
+    while(true){
+        AppHeader hdr;
+        if(!p->c.down->read((uint8_t*)&hdr, sizeof(hdr))) return;
+        payload.resize(hdr.payload_len);
+        if(hdr.payload_len && !p->c.down->read(payload.data(), hdr.payload_len)) return;
+        if(p->c.secure){
+            uint32_t plain_len;
+            if(!p->c.rx.open(hdr, payload.data(), plain_len)){ p->c.auth_fail++; return; }
+            payload.resize(plain_len);
+        }
+        if(p->tap) p->tap(hdr, payload);
+        uint32_t gone;
+        if(hdr.msg_type == MT_INVALID_SEMANTIC && parse_target_offline(payload.data(), payload.size(), gone)){
+            p->delivery->drop_peer(gone);
+            p->transfers->drop_peer(gone);
+            continue;
+        }
+        if(payload.size() < 4) continue;
+        uint32_t sender; memcpy(&sender, payload.data(), 4);
+        if(hdr.flags & FLAG_SEQ){
+            if(payload.size() < 8) continue;
+            uint32_t seq; memcpy(&seq, payload.data() + 4, 4);
+            if(!p->delivery->on_sequenced(sender, seq)) continue;
+            payload.erase(payload.begin() + 4, payload.begin() + 8);
+        }
+        if(hdr.msg_type == MT_TEXT) p->delivery->mark_read(sender);
+        else if(hdr.msg_type == MT_RECEIPT) p->delivery->on_receipt(sender, payload.data() + 4, payload.size() - 4);
+        else if(hdr.msg_type == MT_SKIP) p->delivery->on_skip(sender, payload.data() + 4, payload.size() - 4);
+        else if(hdr.msg_type == MT_FILE_MANIFEST || hdr.msg_type == MT_CHUNK_REQUEST || hdr.msg_type == MT_CHUNK_DATA){
+            p->transfers->on_message(hdr.msg_type, sender, payload.data() + 4, payload.size() - 4);
+        }
+    }
+}
+
+// delay非0时服务器到该端点的报文经过延迟线
+bool start_peer(SimPeer& p, const std::string& store_dir, bool encrypt, uint64_t store_bytes = CHUNK_STORE_BYTES,
+                std::chrono::microseconds delay = {}){
+    if(!start_conn(p.c, encrypt)) return false;
+    if(delay.count()){
+        auto delayed = std::make_shared<MemPipe>();
+        p.delay = std::make_unique<DelayLine>(p.c.down, delayed, delay);
+        p.c.down = delayed;
+    }
+    SimPeer* pp = &p;
+    p.delivery = std::make_unique<Delivery>(
+        [pp](uint8_t type, uint16_t flags, const std::vector<uint8_t>& b){ return pp->send_packet(type, b, flags); },
+        [pp](uint32_t peer, uint32_t seq, ReceiptState st){ pp->on_receipt(peer, seq, st); });
+    p.transfers = std::make_unique<DedupTransfer>(store_dir,
+        [pp](uint8_t type, const std::vector<uint8_t>& b){ return pp->send_packet(type, b); },
+        *p.delivery, [pp](const TransferStatus& st){ pp->on_status(st); }, store_bytes);
+    p.recv = std::thread(peer_recv_loop, pp);
+    p.ticker = std::thread([pp]{
+        while(pp->run){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            pp->delivery->tick();
+            pp->transfers->tick();
+        }
+    });
+    return true;
+}
+
+void stop_peer(SimPeer& p){
+    p.run = false;
+    p.c.up->close();
+    p.c.relay.join();
+    p.recv.join();
+    p.ticker.join();
+    if(p.delay){
+        p.c.down->close();
+        p.delay->join();
+    }
+}
+
+// 写一个固定种子的随机文件
+bool write_random_file(const std::string& path, size_t bytes, uint32_t seed){
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    std::mt19937 rng(seed);
+    std::vector<uint32_t> buf(64 * 1024);
+    for(size_t done = 0; done < bytes;){
+        for(auto& w : buf) w = rng();
+        size_t k = std::min(bytes - done, buf.size() * 4);
+        ofs.write((const char*)buf.data(), (std::streamsize)k);
+        done += k;
+    }
+    return (bool)ofs;
+}
+
+// 洪泛模式各连接的接收统计（目标连接记录探测消息的到达时间，洪泛连接统计收到的限速通知和错误回复）
+struct FloodStats {
+    std::mutex mtx;
+    std::vector<std::chrono::steady_clock::time_point> sent, arrived;
+    std::atomic<uint64_t> throttled{0}, errors{0}, flood_frames{0};
+};
+
+void flood_reader(SimConn* c, uint32_t probe_id, FloodStats* st){
+    std::vector<uint8_t> payload;
+    while(true){
+        AppHeader hdr;
+        if(!c->down->read((uint8_t*)&hdr, sizeof(hdr))) return;
+        payload.resize(hdr.payload_len);
+        if(hdr.payload_len && !c->down->read(payload.data(), hdr.payload_len)) return;
+        auto now = std::chrono::steady_clock::now();
+        if(hdr.msg_type == MT_THROTTLED){ st->throttled++; continue; }
+        if(hdr.msg_type == MT_INVALID_SEMANTIC){ st->errors++; continue; }
+        uint32_t from = 0, idx = 0;
+        if(hdr.payload_len >= 8){ memcpy(&from, payload.data(), 4); memcpy(&idx, payload.data() + 4, 4); }
+        if(hdr.msg_type == MT_TEXT && from == probe_id){
+            std::lock_guard<std::mutex> lk(st->mtx);
+            if(idx < st->arrived.size()) st->arrived[idx] = now;
+        } else {
+            st->flood_frames++;
+        }
+    }
+}
+
+// 输出一个阶段的探测延迟分位数（毫秒），未到达的探测计入丢失
+void report_latency(const char* phase, FloodStats& st, size_t from, size_t to){
+    std::vector<double> ms;
+    size_t lost = 0;
+    {
+        std::lock_guard<std::mutex> lk(st.mtx);
+        for(size_t k = from; k < to; k++){
+            if(st.arrived[k] == std::chrono::steady_clock::time_point{}){ lost++; continue; }
+            ms.push_back(std::chrono::duration<double, std::milli>(st.arrived[k] - st.sent[k]).count());
+        }
+    }
+    std::sort(ms.begin(), ms.end());
+    auto pct = [&](double q){ return ms.empty() ? 0.0 : ms[std::min(ms.size() - 1, (size_t)(q * ms.size()))]; };
+    std::cout<<phase<<": probes "<<ms.size()<<", lost "<<lost<<", latency p50 "<<pct(0.5)<<" ms, p99 "<<pct(0.99)
+             <<" ms, max "<<(ms.empty() ? 0.0 : ms.back())<<" ms\n";
+}
+
+// 洪泛下的延迟：连接0为正常客户端，每100ms给连接1发一条短文本（低于文本限速）；
+// 先在空闲时发送一半探测，然后其余连接同时以最快速度向连接1发送文件分块、文本和CRC错误的帧，再发送另一半
+// 限速与公平调度正常时两个阶段的延迟应基本一致
+int run_flood(size_t n, size_t probes){
+    if(n < 3) n = 3;
+    configure_relay(true);
+
+    // 1. 建立连接，启动接收线程
+    std::vector<std::unique_ptr<SimConn>> conns;
+    for(size_t k = 0; k < n; k++){
+        auto c = std::make_unique<SimConn>();
+        if(!start_conn(*c)){ std::cerr<<"no ack\n"; return 1; }
+        conns.push_back(std::move(c));
+    }
+    std::vector<std::unique_ptr<FloodStats>> stats;
+    for(size_t k = 0; k < n; k++){
+        stats.push_back(std::make_unique<FloodStats>());
+        stats[k]->sent.resize(probes);
+        stats[k]->arrived.resize(probes);
+        conns[k]->reader = std::thread(flood_reader, conns[k].get(), conns[0]->id, stats[k].get());
+    }
+    FloodStats& target = *stats[1];
+
+    // 2. 洪泛连接预先构造报文：4KB文件分块、短文本、CRC错误的文本
+    std::vector<uint8_t> body(4 + 4096, 0x5a);
+    memcpy(body.data(), &conns[1]->id, 4);
+    auto chunk = build_frame(MT_FILE_CHUNK, body.data(), body.size());
+    auto text = build_frame(MT_TEXT, body.data(), 64);
+    auto bad = text;
+    bad[sizeof(AppHeader) + 8] ^= 1;
+    std::atomic<bool> flooding{false}, stop{false};
+    std::atomic<uint64_t> flood_written{0};
+    std::vector<std::thread> flooders;
+    for(size_t k = 2; k < n; k++){
+        SimConn* c = conns[k].get();
+        flooders.emplace_back([&, c]{
+            while(!flooding && !stop) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            while(!stop){
+                if(!c->up->write(chunk.data(), chunk.size()) || !c->up->write(text.data(), text.size())
+                   || !c->up->write(bad.data(), bad.size())) return;
+                flood_written += 3;
+            }
+        });
+    }
+
+    // 3. 发送探测：前一半在空闲时，后一半在洪泛中
+    std::vector<uint8_t> probe(8);
+    memcpy(probe.data(), &conns[1]->id, 4);
+    for(uint32_t k = 0; k < probes; k++){
+        if(k == probes / 2){
+            flooding = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));   // 等洪泛填满各队列
+        }
+        memcpy(probe.data() + 4, &k, 4);
+        auto f = build_frame(MT_TEXT, probe.data(), probe.size());
+        {
+            std::lock_guard<std::mutex> lk(target.mtx);
+            target.sent[k] = std::chrono::steady_clock::now();
+        }
+        if(!conns[0]->up->write(f.data(), f.size())){ std::cerr<<"write fail\n"; return 1; }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // 4. 输出统计
+    uint64_t throttled = 0, errors = 0;
+    for(size_t k = 2; k < n; k++){ throttled += stats[k]->throttled; errors += stats[k]->errors; }
+    std::cout<<"connections "<<n<<" ("<<n - 2<<" flooding), probes "<<probes<<" at 10/s\n";
+    report_latency("idle ", target, 0, probes / 2);
+    report_latency("flood", target, probes / 2, probes);
+    std::cout<<"flood: written "<<flood_written<<" frames, delivered "<<target.flood_frames<<", throttle notices "<<throttled
+             <<", error replies "<<errors<<"\n";
+
+    // 5. 关闭连接，等待各线程退出
+    stop = true;
+    for(auto& c : conns) c->up->close();
+    for(auto& t : flooders) t.join();
+    for(auto& c : conns){ c->relay.join(); c->reader.join(); }
+    return 0;
+}
+
+// 界面吞吐：经仿真转发把一个文件从端点A传给端点B，比较B端三种处理传输状态的方式下的接收速率
+//   headless：不更新界面
+//   batched ：与GUI客户端相同，进度千分比变化时投递到LogBuffer，界面线程每16ms合并一次并"绘制"可见行
+//   per-event sync：每个状态都同步等待界面线程处理（改为批量前每块一次SendMessageW的做法）
+// 绘制只模拟遍历可见行，Win32控件本身的开销不在其中
+int run_gui(size_t mb, bool encrypt){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path dir = fs::temp_directory_path(ec) / "relay_sim_gui";
+    fs::remove_all(dir, ec);
+    fs::create_directories(dir, ec);
+    fs::current_path(dir, ec);
+    if(!write_random_file("payload.bin", mb * 1024 * 1024, 7)){ std::cerr<<"write file fail\n"; return 1; }
+    if(!configure_relay(false)) return 1;
+    std::cout<<"file "<<mb<<" MB"<<(encrypt ? " (encrypted)" : " (plaintext)")<<"\n";
+
+    const char* names[] = {"headless      ", "batched       ", "per-event sync"};
+    for(int round = -1; round < 3; round++){
+        // 1. 每轮使用新的分块仓库，保证全部分块都经网络传输（第一轮为预热，不输出）
+        int mode = std::max(round, 0);
+        SimPeer a, b;
+        std::string tag = std::to_string(round + 1);
+        if(!start_peer(a, "a_chunks" + tag, encrypt) || !start_peer(b, "b_chunks" + tag, encrypt)){ std::cerr<<"connect fail\n"; return 1; }
+
+        // 2. 界面线程
+        LogBuffer view(5000);
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done = false, stop = false;
+        uint64_t pending = 0, handled = 0, events = 0, frames = 0;
+        uint32_t reported = UINT32_MAX;
+        std::thread ui([&]{
+            if(mode == 0) return;
+            size_t painted = 0;
+            while(true){
+                std::unique_lock<std::mutex> lk(mtx);
+                if(mode == 1) cv.wait_for(lk, std::chrono::milliseconds(16), [&]{ return stop; });
+                else cv.wait(lk, [&]{ return stop || pending > handled; });
+                if(stop) return;
+                size_t evicted;
+                if(mode == 2) handled = pending;
+                lk.unlock();
+                if(view.drain(evicted)){
+                    frames++;
+                    for(size_t k = view.size() > 40 ? view.size() - 40 : 0; k < view.size(); k++) painted += view.line(k).size();
+                }
+                cv.notify_all();
+            }
+        });
+
+        // 3. 传输状态回调（B的接收线程）
+        b.on_status = [&](const TransferStatus& st){
+            if(mode == 1){
+                uint32_t permille = st.size ? (uint32_t)(st.have * 1000 / st.size) : 1000;
+                if(permille != reported || st.done){
+                    reported = permille;
+                    events++;
+                    view.progress("xfer", L"receiving " + std::to_wstring(st.have / 1024) + L" KB (" + std::to_wstring(permille / 10) + L"%)", st.done);
+                }
+            } else if(mode == 2){
+                events++;
+                view.append(L"chunk " + std::to_wstring(st.fetched));
+                std::unique_lock<std::mutex> lk(mtx);
+                uint64_t mine = ++pending;
+                cv.notify_all();
+                cv.wait(lk, [&]{ return handled >= mine; });
+            }
+            if(st.done){
+                std::lock_guard<std::mutex> lk(mtx);
+                done = true;
+                cv.notify_all();
+            }
+        };
+
+        // 4. 发送并计时到接收完成
+        auto start = std::chrono::steady_clock::now();
+        TransferStatus st;
+        std::string err;
+        if(!a.transfers->send_file(b.c.id, "payload.bin", st, err)){ std::cerr<<"send fail: "<<err<<"\n"; return 1; }
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            if(!cv.wait_for(lk, std::chrono::seconds(120), [&]{ return done; })){ std::cerr<<"transfer timed out\n"; return 1; }
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        ui.join();
+        if(round >= 0) std::cout<<names[mode]<<": "<<secs * 1000<<" ms, "<<mb / secs<<" MB/s, ui events "<<events<<", ui refreshes "<<frames<<"\n";
+        stop_peer(a);
+        stop_peer(b);
+    }
+    fs::current_path(dir.parent_path(), ec);
+    fs::remove_all(dir, ec);
+    return 0;
+}
+
+// 单条消息延迟：连接A逐条给连接B发文本，B收到后A才发下一条（无排队），
+// 计时覆盖客户端加密、服务器解密再加密、转发和B端解密的完整路径；前100条为预热，不计入
+int run_latency(size_t count, size_t bytes, bool encrypt){
+    if(!configure_relay(false)) return 1;
+    SimConn a, b;
+    if(!start_conn(a, encrypt) || !start_conn(b, encrypt)){ std::cerr<<"connect fail\n"; return 1; }
+
+    // 1. B的接收线程：解密（或校验CRC）后通知到达
+    std::mutex mtx;
+    std::condition_variable cv;
+    uint32_t arrived = UINT32_MAX;
+    std::atomic<uint64_t> bad{0};
+    std::thread reader([&]{
+        std::vector<uint8_t> payload;
+        while(true){
+            AppHeader hdr;
+            if(!b.down->read((uint8_t*)&hdr, sizeof(hdr))) return;
+            payload.resize(hdr.payload_len);
+            if(hdr.payload_len && !b.down->read(payload.data(), hdr.payload_len)) return;
+            uint32_t plain_len = hdr.payload_len;
+            if(b.secure){
+                if(!b.rx.open(hdr, payload.data(), plain_len)){ bad++; return; }
+            } else {
+                AppHeader h = hdr;
+                h.crc32 = 0;
+                std::vector<uint8_t> f(sizeof(h) + plain_len);
+                memcpy(f.data(), &h, sizeof(h));
+                if(plain_len) memcpy(f.data() + sizeof(h), payload.data(), plain_len);
+                if(crc32_calc(f.data(), f.size()) != hdr.crc32) bad++;
+            }
+            if(hdr.msg_type != MT_TEXT || plain_len < 8) continue;
+            uint32_t idx;
+            memcpy(&idx, payload.data() + 4, 4);
+            std::lock_guard<std::mutex> lk(mtx);
+            arrived = idx;
+            cv.notify_all();
+        }
+    });
+
+    // 2. 逐条发送：加密连接与客户端相同，载荷直接加密写入复用的发送缓冲区
+    std::vector<uint8_t> payload(std::max<size_t>(8, 4 + bytes)), frame;
+    memcpy(payload.data(), &b.id, 4);
+    for(size_t k = 8; k < payload.size(); k++) payload[k] = (uint8_t)k;
+    std::vector<double> us;
+    const size_t warm = 100;
+    for(uint32_t k = 0; k < warm + count; k++){
+        memcpy(payload.data() + 4, &k, 4);
+        auto t0 = std::chrono::steady_clock::now();
+        if(a.secure){
+            AppHeader h{};
+            h.magic = PROTO_MAGIC; h.version = 1; h.msg_type = MT_TEXT; h.payload_len = (uint32_t)payload.size();
+            a.tx.seal_into(h, payload.data(), payload.size(), frame);
+        } else {
+            frame = build_frame(MT_TEXT, payload.data(), payload.size());
+        }
+        if(!a.up->write(frame.data(), frame.size())){ std::cerr<<"write fail\n"; return 1; }
+        std::unique_lock<std::mutex> lk(mtx);
+        if(!cv.wait_for(lk, std::chrono::seconds(5), [&]{ return arrived == k; })){ std::cerr<<"message "<<k<<" lost\n"; return 1; }
+        if(k >= warm) us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    // 3. 输出分位数
+    std::sort(us.begin(), us.end());
+    double sum = 0;
+    for(double v : us) sum += v;
+    auto pct = [&](double q){ return us[std::min(us.size() - 1, (size_t)(q * us.size()))]; };
+    std::cout<<"messages "<<count<<" x "<<payload.size()<<" B"<<(encrypt ? " (encrypted)" : " (plaintext)")
+             <<": latency mean "<<sum / us.size()<<" us, p50 "<<pct(0.5)<<" us, p99 "<<pct(0.99)<<" us, max "<<us.back()<<" us\n";
+    if(bad) std::cout<<"BAD FRAMES: "<<bad<<"\n";
+
+    a.up->close();
+    b.up->close();
+    a.relay.join();
+    b.relay.join();
+    reader.join();
+    return bad ? 1 : 0;
+}
+
+// 伪造控制消息：连接A给明文和加密的两个目标各发送N轮 [握手][ACK][限速通知][错误回复][文本]，
+// 服务器应丢弃前四种，目标只收到N条能通过CRC校验（或解密）的文本；最后检查载荷长度超限的帧使连接断开；任一检查失败时返回1
+int run_control(size_t rounds, bool encrypt){
+    if(!configure_relay(false)) return 1;
+    SimConn a, plain, secure;
+    if(!start_conn(a, encrypt) || !start_conn(plain, false) || !start_conn(secure, true)){ std::cerr<<"connect fail\n"; return 1; }
+
+    // 1. 目标的接收线程：读取N帧，统计文本、其他类型和校验失败的帧
+    struct Seen { uint64_t texts = 0, other = 0, bad = 0; };
+    auto read_n = [rounds](SimConn* c, Seen* seen){
+        std::vector<uint8_t> payload;
+        for(size_t k = 0; k < rounds; k++){
+            AppHeader hdr;
+            if(!c->down->read((uint8_t*)&hdr, sizeof(hdr))) return;
+            payload.resize(hdr.payload_len);
+            if(hdr.payload_len && !c->down->read(payload.data(), hdr.payload_len)) return;
+            uint32_t plain_len = hdr.payload_len;
+            if(c->secure){
+                if(!c->rx.open(hdr, payload.data(), plain_len)){ seen->bad++; return; }
+            } else {
+                AppHeader h = hdr;
+                h.crc32 = 0;
+                std::vector<uint8_t> f(sizeof(h) + plain_len);
+                memcpy(f.data(), &h, sizeof(h));
+                if(plain_len) memcpy(f.data() + sizeof(h), payload.data(), plain_len);
+                if(crc32_calc(f.data(), f.size()) != hdr.crc32){ seen->bad++; continue; }
+            }
+            if(hdr.msg_type == MT_TEXT) seen->texts++;
+            else seen->other++;
+        }
+    };
+    Seen seen[2];
+    SimConn* targets[2] = {&plain, &secure};
+    std::thread readers[2];
+    for(int t = 0; t < 2; t++) readers[t] = std::thread(read_n, targets[t], &seen[t]);
+
+    // 2. 按轮次发送，握手帧带一个随机的32字节公钥
+    const uint8_t types[] = {MT_HANDSHAKE, MT_ACK, MT_THROTTLED, MT_INVALID_SEMANTIC, MT_TEXT};
+    std::mt19937 rng(3);
+    std::vector<uint8_t> payload(4 + 32), frame;
+    for(size_t k = 0; k < rounds; k++){
+        for(SimConn* t : targets){
+            memcpy(payload.data(), &t->id, 4);
+            for(size_t j = 4; j < payload.size(); j++) payload[j] = (uint8_t)rng();
+            for(uint8_t type : types){
+                if(a.secure){
+                    AppHeader h{};
+                    h.magic = PROTO_MAGIC; h.version = 1; h.msg_type = type; h.payload_len = (uint32_t)payload.size();
+                    a.tx.seal_into(h, payload.data(), payload.size(), frame);
+                } else {
+                    frame = build_frame(type, payload.data(), payload.size());
+                }
+                if(!a.up->write(frame.data(), frame.size())){ std::cerr<<"write fail\n"; return 1; }
+            }
+        }
+    }
+    for(auto& r : readers) r.join();
+
+    // 3. 输出统计：每个目标恰好收到N条有效文本
+    const char* names[] = {"plaintext target", "encrypted target"};
+    int failures = 0;
+    std::cout<<"sender "<<(encrypt ? "encrypted" : "plaintext")<<", "<<rounds<<" rounds of handshake/ack/throttled/error/text\n";
+    for(int t = 0; t < 2; t++){
+        bool ok = seen[t].texts == rounds && !seen[t].other && !seen[t].bad;
+        std::cout<<"  "<<names[t]<<": text "<<seen[t].texts<<", control "<<seen[t].other<<", bad "<<seen[t].bad<<(ok ? "  OK" : "  FAIL")<<"\n";
+        if(!ok) failures++;
+    }
+
+    // 4. 载荷长度超过上限的帧：服务器不分配缓冲区，直接断开该连接
+    SimConn big;
+    if(!start_conn(big, false)){ std::cerr<<"connect fail\n"; return 1; }
+    AppHeader h{};
+    h.magic = PROTO_MAGIC; h.version = 1; h.msg_type = MT_TEXT; h.payload_len = UINT32_MAX;
+    big.up->write((const uint8_t*)&h, sizeof(h));
+    uint8_t byte;
+    bool closed = !big.down->read(&byte, 1);
+    std::cout<<"  oversized frame: connection "<<(closed ? "closed  OK" : "still open  FAIL")<<"\n";
+    if(!closed) failures++;
+    big.up->close();
+    big.relay.join();
+
+    a.up->close();
+    plain.up->close();
+    secure.up->close();
+    a.relay.join();
+    plain.relay.join();
+    secure.relay.join();
+    return failures ? 1 : 0;
+}
+
+// 线路流量：经仿真转发的去重传输，统计各阶段发送端上行和接收端下行的字节数
+//   cold     ：接收端仓库为空，发送整个文件
+//   resend   ：再次发送同一文件，接收端只需清单
+//   modified ：文件中间插入100字节、前部改写16字节后发送，只传输受影响的分块
+//   fan-out  ：同一个新文件同时发给两个接收端，服务器缓存使发送端只上传一次
+//   wide     ：另一个发送端把小文件发给超过发送上限的接收端，进行中的传输全部完成，超出的发送被拒绝
+// 最后输出接收端pack文件大小（-c限制仓库容量时检查压缩是否生效）
+int run_dedup(size_t mb, size_t store_mb, bool encrypt){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path dir = fs::temp_directory_path(ec) / "relay_sim_dedup";
+    fs::remove_all(dir, ec);
+    fs::create_directories(dir, ec);
+    fs::current_path(dir, ec);
+    size_t bytes = mb * 1024 * 1024;
+    if(!write_random_file("f.bin", bytes, 11) || !write_random_file("g_b.bin", bytes, 12) || !write_random_file("g_c.bin", bytes, 12)){
+        std::cerr<<"write file fail\n"; return 1;
+    }
+    auto load = [](const std::string& path){
+        std::ifstream ifs(path, std::ios::binary);
+        return std::vector<uint8_t>((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    };
+    {
+        std::vector<uint8_t> f = load("f.bin");
+        memset(f.data() + f.size() / 4, 0x5A, 16);
+        f.insert(f.begin() + f.size() / 2, 100, 0xA5);
+        std::ofstream("f_mod.bin", std::ios::binary).write((const char*)f.data(), (std::streamsize)f.size());
+    }
+    if(!configure_relay(false)) return 1;
+    uint64_t store_bytes = store_mb ? (uint64_t)store_mb * 1024 * 1024 : CHUNK_STORE_BYTES;
+    std::cout<<"file "<<mb<<" MB"<<(encrypt ? " (encrypted)" : " (plaintext)");
+    if(store_mb) std::cout<<", receiver chunk store capped at "<<store_mb<<" MB";
+    std::cout<<"\n";
+
+    // 1. 一个发送端、两个接收端；接收端完成一个传输时记录结果
+    SimPeer a, b, c;
+    if(!start_peer(a, "a_chunks", encrypt) || !start_peer(b, "b_chunks", encrypt, store_bytes) || !start_peer(c, "c_chunks", encrypt, store_bytes)){
+        std::cerr<<"connect fail\n"; return 1;
+    }
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<TransferStatus> finished;
+    auto on_status = [&](const TransferStatus& st){
+        if(!st.done) return;
+        std::lock_guard<std::mutex> lk(mtx);
+        finished.push_back(st);
+        cv.notify_all();
+    };
+    b.on_status = on_status;
+    c.on_status = on_status;
+
+    // 2. 每个阶段：发送，等待全部接收端完成，核对输出文件与源文件一致
+    int failures = 0;
+    auto phase = [&](const char* name, std::vector<std::pair<SimPeer*, std::string>> sends){
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            finished.clear();
+        }
+        uint64_t up0 = a.c.up->bytes_written(), down0 = b.c.down->bytes_written() + c.c.down->bytes_written();
+        auto start = std::chrono::steady_clock::now();
+        for(auto& sd : sends){
+            TransferStatus st;
+            std::string err;
+            if(!a.transfers->send_file(sd.first->c.id, sd.second, st, err)){ std::cerr<<"send fail: "<<err<<"\n"; failures++; return; }
+        }
+        bool all;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            all = cv.wait_for(lk, std::chrono::seconds(120), [&]{ return finished.size() == sends.size(); });
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t up = a.c.up->bytes_written() - up0, down = b.c.down->bytes_written() + c.c.down->bytes_written() - down0;
+        uint64_t fetched = 0;
+        bool ok = all;
+        std::lock_guard<std::mutex> lk(mtx);
+        for(auto& st : finished){
+            fetched += st.fetched;
+            ok = ok && st.ok && load(st.out) == load(st.name);
+        }
+        if(!ok) failures++;
+        std::cout<<name<<": sender up "<<up / 1024<<" KB, receivers down "<<down / 1024<<" KB, chunks fetched "
+                 <<fetched / 1024<<" KB, "<<secs * 1000<<" ms"<<(ok ? "" : "  FAILED")<<"\n";
+    };
+    phase("cold    ", {{&b, "f.bin"}});
+    phase("resend  ", {{&b, "f.bin"}});
+    phase("modified", {{&b, "f_mod.bin"}});
+    phase("fan-out ", {{&b, "g_b.bin"}, {&c, "g_c.bin"}});
+    std::cout<<"receiver pack.dat: "<<fs::file_size("b_chunks/pack.dat", ec) / 1024<<" KB, "
+             <<fs::file_size("c_chunks/pack.dat", ec) / 1024<<" KB\n";
+
+    // 3. 宽扇出：另一个发送端把同一个小文件发给超过发送上限的接收端，
+    //    前MAX_OUTGOING_TRANSFERS个全部完成（进行中的清单不被挤掉），其余发送当即被拒绝并给出原因
+    {
+        SimPeer w;
+        std::vector<std::unique_ptr<SimPeer>> rs;
+        if(!start_peer(w, "w_chunks", encrypt) || !write_random_file("h.bin", 256 * 1024, 13)){ std::cerr<<"connect fail\n"; return 1; }
+        std::vector<TransferStatus> wide;
+        for(size_t k = 0; k < MAX_OUTGOING_TRANSFERS + 4; k++){
+            rs.push_back(std::make_unique<SimPeer>());
+            rs.back()->on_status = [&](const TransferStatus& st){
+                if(!st.done) return;
+                std::lock_guard<std::mutex> lk(mtx);
+                wide.push_back(st);
+                cv.notify_all();
+            };
+            if(!start_peer(*rs.back(), "r" + std::to_string(k) + "_chunks", encrypt)){ std::cerr<<"connect fail\n"; return 1; }
+        }
+        size_t accepted = 0, refused = 0;
+        std::string refusal;
+        for(auto& r : rs){
+            TransferStatus st;
+            std::string err;
+            if(w.transfers->send_file(r->c.id, "h.bin", st, err)) accepted++;
+            else { refused++; refusal = err; }
+        }
+        bool all;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            all = cv.wait_for(lk, std::chrono::seconds(120), [&]{ return wide.size() >= accepted; });
+        }
+        std::vector<uint8_t> src = load("h.bin");
+        bool ok = all && accepted == MAX_OUTGOING_TRANSFERS && refused == 4;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            for(auto& st : wide) ok = ok && st.ok && load(st.out) == src;
+        }
+        if(!ok) failures++;
+        std::cout<<"wide    : "<<rs.size()<<" receivers, "<<accepted<<" sent, "<<wide.size()<<" received, "<<refused
+                 <<" refused ("<<refusal<<")"<<(ok ? "" : "  FAILED")<<"\n";
+        for(auto& r : rs) stop_peer(*r);
+        stop_peer(w);
+    }
+
+    stop_peer(a);
+    stop_peer(b);
+    stop_peer(c);
+    fs::current_path(dir.parent_path(), ec);
+    fs::remove_all(dir, ec);
+    if(failures) std::cout<<"FAILED: "<<failures<<" phase(s)\n";
+    return failures ? 1 : 0;
+}
+
+// 回执与发送窗口：两个端点的下行各注入delay_ms延迟（RTT约为两倍），检查
+//   texts   ：A给B发100条文本，丢弃第7条的全部发送和10~48中偶数序号的首次发送（同时超过16个空缺）。
+//             B的回执中cum不能越过未收到的序号（第7条只在A放弃之后才能越过），
+//             除第7条报告未送达外全部送达，A放弃后B的cum到达100
+//   window  ：A给B发送文件，按5ms采样A到B的链路：在途字节不超过窗口加一个分块（窗口刚缩小时只允许减少），窗口从初始值增大，
+//             平滑RTT不低于注入的RTT，接收的文件与源文件一致
+//   offline ：再发一个文件，中途B断开，服务器回复B不在线后A的文件发送以失败结束，A与B的链路状态被清除
+int run_receipts(size_t delay_ms, bool encrypt){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path dir = fs::temp_directory_path(ec) / "relay_sim_receipts";
+    fs::remove_all(dir, ec);
+    fs::create_directories(dir, ec);
+    fs::current_path(dir, ec);
+    const size_t file_mb = 16;
+    if(!write_random_file("w.bin", file_mb * 1024 * 1024, 21) || !write_random_file("x.bin", file_mb * 1024 * 1024, 22)){
+        std::cerr<<"write file fail\n"; return 1;
+    }
+    if(!configure_relay(false)) return 1;
+    auto delay = std::chrono::milliseconds(delay_ms);
+    SimPeer a, b;
+    if(!start_peer(a, "a_chunks", encrypt, CHUNK_STORE_BYTES, delay) || !start_peer(b, "b_chunks", encrypt, CHUNK_STORE_BYTES, delay)){
+        std::cerr<<"connect fail\n"; return 1;
+    }
+    std::cout<<"one-way delay "<<delay_ms<<" ms"<<(encrypt ? " (encrypted)" : " (plaintext)")<<"\n";
+    int failures = 0;
+    auto check = [&](bool ok, const std::string& what){
+        std::cout<<(ok ? "ok   " : "FAIL ")<<what<<"\n";
+        if(!ok) failures++;
+    };
+    using Clock = std::chrono::steady_clock;
+
+    // 1. 文本：A端丢弃指定序号的发送，B端记录收到的序号，A端检查每个回执的cum
+    const uint32_t N = 100, LOST = 7, GIVE_UP_SENDS = 6;   // 首次发送 + 5次重传
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::set<uint32_t> got, settled, failed;
+    std::map<uint32_t, int> drops;
+    uint32_t max_cum = 0;
+    int violations = 0;
+    auto lossy = [](uint32_t seq){ return seq >= 10 && seq <= 48 && seq % 2 == 0; };
+    a.drop = [&](uint8_t type, const std::vector<uint8_t>& p){
+        if(type != MT_TEXT || p.size() < 8) return false;
+        uint32_t seq; memcpy(&seq, p.data() + 4, 4);
+        std::lock_guard<std::mutex> lk(mtx);
+        int k = drops[seq]++;
+        return seq == LOST || (lossy(seq) && k == 0);
+    };
+    b.tap = [&](const AppHeader& hdr, const std::vector<uint8_t>& p){
+        if(hdr.msg_type != MT_TEXT || !(hdr.flags & FLAG_SEQ) || p.size() < 8) return;
+        uint32_t seq; memcpy(&seq, p.data() + 4, 4);
+        std::lock_guard<std::mutex> lk(mtx);
+        got.insert(seq);
+    };
+    a.tap = [&](const AppHeader& hdr, const std::vector<uint8_t>& p){
+        if(hdr.msg_type != MT_RECEIPT || p.size() < 8) return;
+        uint32_t cum; memcpy(&cum, p.data() + 4, 4);
+        std::lock_guard<std::mutex> lk(mtx);
+        for(uint32_t s = max_cum + 1; s <= cum; s++){
+            bool skipped = s == LOST && drops[LOST] >= (int)GIVE_UP_SENDS;
+            if(!got.count(s) && !skipped) violations++;
+        }
+        max_cum = std::max(max_cum, cum);
+        cv.notify_all();
+    };
+    a.on_receipt = [&](uint32_t, uint32_t seq, ReceiptState st){
+        std::lock_guard<std::mutex> lk(mtx);
+        if(st == ReceiptState::FAILED) failed.insert(seq);
+        else settled.insert(seq);
+        cv.notify_all();
+    };
+    auto t0 = Clock::now();
+    for(uint32_t k = 1; k <= N; k++){
+        std::string text = "receipt test " + std::to_string(k);
+        a.delivery->send_text(b.c.id, MT_TEXT, (const uint8_t*)text.data(), text.size());
+    }
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        bool done = cv.wait_for(lk, std::chrono::seconds(60), [&]{ return settled.size() + failed.size() >= N && max_cum >= N; });
+        double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+        std::cout<<"texts: "<<settled.size()<<" delivered, "<<failed.size()<<" failed, receiver cum "<<max_cum<<" after "<<secs<<" s\n";
+        check(done, "every text settles and the receiver passes the abandoned gap");
+        check(violations == 0, "cum never skips a gap the sender has not abandoned (" + std::to_string(violations) + " violations)");
+        check(failed.size() == 1 && failed.count(LOST) && !settled.count(LOST), "only the dropped text is reported failed");
+        check(settled.size() == N - 1, "texts behind more than 16 gaps are all delivered");
+    }
+    a.drop = nullptr;
+
+    // 2. 窗口：传输期间按5ms采样A到B的链路状态
+    std::vector<TransferStatus> finished, send_failed;
+    auto on_status = [&](const TransferStatus& st){
+        if(!st.done) return;
+        std::lock_guard<std::mutex> lk(mtx);
+        (st.sending ? send_failed : finished).push_back(st);
+        cv.notify_all();
+    };
+    a.on_status = on_status;
+    b.on_status = on_status;
+    {
+        TransferStatus st;
+        std::string err;
+        t0 = Clock::now();
+        if(!a.transfers->send_file(b.c.id, "w.bin", st, err)){ std::cerr<<"send fail: "<<err<<"\n"; return 1; }
+        size_t first_cwnd = 0, max_cwnd = 0, max_inflight = 0, prev_inflight = 0, samples = 0, over = 0;
+        double srtt = 0;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                if(cv.wait_for(lk, std::chrono::milliseconds(5), [&]{ return !finished.empty(); })) break;
+                if(Clock::now() - t0 > std::chrono::seconds(120)) break;
+            }
+            LinkStats ls;
+            if(!a.delivery->stats(b.c.id, ls) || (ls.inflight == 0 && ls.queued == 0)) continue;
+            if(!first_cwnd) first_cwnd = ls.cwnd;
+            samples++;
+            max_cwnd = std::max(max_cwnd, ls.cwnd);
+            max_inflight = std::max(max_inflight, ls.inflight);
+            // 窗口缩小后已在途的分块只会减少：超出窗口时在途字节不能比上次采样增加
+            if(ls.inflight > ls.cwnd + 36 + CDC_MAX && ls.inflight > prev_inflight) over++;
+            prev_inflight = ls.inflight;
+            srtt = ls.srtt_ms;
+        }
+        double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+        std::lock_guard<std::mutex> lk(mtx);
+        bool ok = finished.size() == 1 && finished[0].ok;
+        std::ifstream f1("w.bin", std::ios::binary), f2(ok ? finished[0].out : "", std::ios::binary);
+        ok = ok && std::equal(std::istreambuf_iterator<char>(f1), std::istreambuf_iterator<char>(),
+                              std::istreambuf_iterator<char>(f2), std::istreambuf_iterator<char>());
+        std::cout<<"window: "<<file_mb<<" MB in "<<secs * 1000<<" ms ("<<file_mb / secs<<" MB/s), "<<samples<<" samples, cwnd "
+                 <<first_cwnd / 1024<<" -> max "<<max_cwnd / 1024<<" KB, max inflight "<<max_inflight / 1024<<" KB, srtt "<<srtt<<" ms\n";
+        check(ok, "file arrives intact");
+        check(samples > 0 && over == 0, "inflight stays within the window (" + std::to_string(over) + " samples over)");
+        check(max_cwnd > first_cwnd, "window grows from its initial size");
+        check(srtt >= 2.0 * delay_ms, "smoothed RTT covers the injected delay");
+    }
+
+    // 3. 离线：发送途中B断开
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        finished.clear();
+    }
+    TransferStatus st;
+    std::string err;
+    if(!a.transfers->send_file(b.c.id, "x.bin", st, err)){ std::cerr<<"send fail: "<<err<<"\n"; return 1; }
+    uint32_t b_id = b.c.id;
+    while(true){
+        LinkStats ls;
+        if(a.delivery->stats(b_id, ls) && ls.inflight > 0) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop_peer(b);
+    t0 = Clock::now();
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        bool done = cv.wait_for(lk, std::chrono::seconds(10), [&]{ return !send_failed.empty(); });
+        std::cout<<"offline: sender notified after "<<std::chrono::duration<double, std::milli>(Clock::now() - t0).count()<<" ms\n";
+        check(done && send_failed.size() == 1 && send_failed[0].name == "x.bin", "file send fails once when the receiver goes offline");
+    }
+    LinkStats ls;
+    check(!a.delivery->stats(b_id, ls), "link state for the offline peer is dropped");
+
+    stop_peer(a);
+    fs::current_path(dir.parent_path(), ec);
+    fs::remove_all(dir, ec);
+    std::cout<<(failures ? "FAILED: " + std::to_string(failures) + " check(s)\n" : std::string("all checks passed\n"));
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char** argv){
+    // 1. 解析参数
+    std::string path;
+    size_t n = 0, msgs = 10000, size = 256, probes = 0, gui_mb = 0, dedup_mb = 0, store_mb = 0, latency_msgs = 0, delay_ms = 0, control_rounds = 0;
+    bool encrypt = false;
+    int i = 1;
+    if(argc > 1 && argv[1][0] != '-') path = argv[i++];
+    for(; i < argc; i++){
+        std::string k = argv[i];
+        if(k == "-e"){ encrypt = true; continue; }
+        if(i + 1 >= argc) break;
+        if(k == "-n") n = (size_t)atoi(argv[++i]);
+        else if(k == "-m") msgs = (size_t)atoi(argv[++i]);
+        else if(k == "-b") size = (size_t)atoi(argv[++i]);
+        else if(k == "-f") probes = (size_t)atoi(argv[++i]);
+        else if(k == "-g") gui_mb = (size_t)atoi(argv[++i]);
+        else if(k == "-d") dedup_mb = (size_t)atoi(argv[++i]);
+        else if(k == "-c") store_mb = (size_t)atoi(argv[++i]);
+        else if(k == "-l") latency_msgs = (size_t)atoi(argv[++i]);
+        else if(k == "-r") delay_ms = (size_t)atoi(argv[++i]);
+        else if(k == "-x") control_rounds = (size_t)atoi(argv[++i]);
+    }
+    if(probes) return run_flood(n, probes);
+    if(gui_mb) return run_gui(gui_mb, encrypt);
+    if(dedup_mb) return run_dedup(dedup_mb, store_mb, encrypt);
+    if(latency_msgs) return run_latency(latency_msgs, size, encrypt);
+    if(delay_ms) return run_receipts(delay_ms, encrypt);
+    if(control_rounds) return run_control(control_rounds, encrypt);
+
+    // 2. 准备输入：录制文件，或固定种子的随机文本流量
+    std::vector<SimFrame> work;
+    if(!path.empty()){
+        std::vector<TraceRecord> recs;
+        if(!read_trace(path, recs)){ std::cerr<<"read trace fail\n"; return 1; }
+        if(n == 0) n = trace_assign_slots(recs, SIZE_MAX).size();
+        if(n == 0){ std::cerr<<"empty trace\n"; return 1; }
+        auto slots = trace_assign_slots(recs, n);
+        for(auto& r : recs){
+            if(r.kind != TR_FRAME || trace_is_handshake(r)) continue;
+            long dst = -1;
+            if(r.frame.size() >= sizeof(AppHeader) + 4){
+                uint32_t orig;
+                memcpy(&orig, r.frame.data() + sizeof(AppHeader), 4);
+                auto it = slots.find(orig);
+                if(it != slots.end()) dst = (long)it->second;
+            }
+            work.push_back({slots[r.conn], dst, std::move(r.frame)});
+        }
+    } else {
+        if(n < 2) n = 8;
+        std::mt19937 rng(1);
+        std::vector<uint8_t> payload(4 + size);
+        for(size_t k = 0; k < msgs * n; k++){
+            size_t src = k % n;
+            size_t dst = (src + 1 + rng() % (n - 1)) % n;
+            for(size_t j = 4; j < payload.size(); j++) payload[j] = (uint8_t)rng();
+            work.push_back({src, (long)dst, build_frame(MT_TEXT, payload.data(), payload.size())});
+        }
+    }
+
+    // 3. 启动转发：每个连接一个relay_client线程，读取ACK得到ID（加密模式下同时完成握手）
+    if(!configure_relay(false)) return 1;
+    std::vector<std::unique_ptr<SimConn>> conns;
+    for(size_t k = 0; k < n; k++){
+        auto c = std::make_unique<SimConn>();
+        if(!start_conn(*c, encrypt)){ std::cerr<<"no ack\n"; return 1; }
+        conns.push_back(std::move(c));
+    }
+
+    // 4. 目标ID改写为仿真连接的ID（在计时开始前完成），并追加每对(来源,目标)的结束标记
+    uint64_t in_bytes = 0;
+    for(auto& f : work){
+        retarget_frame(f.frame, f.dst >= 0 ? conns[f.dst]->id : 0);
+        in_bytes += f.frame.size();
+    }
+    size_t work_frames = work.size();
+    for(size_t s = 0; s < n; s++){
+        for(size_t d = 0; d < n; d++){
+            std::vector<uint8_t> p(4 + sizeof(FENCE));
+            memcpy(p.data(), &conns[d]->id, 4);
+            memcpy(p.data() + 4, FENCE, sizeof(FENCE));
+            work.push_back({s, (long)d, build_frame(MT_HEARTBEAT, p.data(), p.size())});
+        }
+    }
+    if(encrypt){
+        for(auto& f : work) conns[f.src]->tx.seal(f.frame);   // 按发送顺序预先加密，序号与写入顺序一致
+    }
+    for(auto& c : conns) c->reader = std::thread(reader_loop, c.get(), n);
+
+    // 5. 按输入顺序写入各连接，等待所有连接收齐结束标记（同一来源到同一目标按序转发，标记到达即之前的报文全部送达）
+    auto start = std::chrono::steady_clock::now();
+    for(auto& f : work){
+        if(!conns[f.src]->up->write(f.frame.data(), f.frame.size())){ std::cerr<<"write fail\n"; return 1; }
+    }
+    {
+        std::unique_lock<std::mutex> lk(done_mtx);
+        done_cv.wait(lk, [&]{ return conns_done == conns.size(); });
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // 6. 排空迟到的服务器回复后输出统计
+    drain_conns(conns, std::chrono::milliseconds(100));
+    uint64_t out_frames = 0, out_bytes = 0, errors = 0, auth_fail = 0;
+    for(auto& c : conns){ out_frames += c->frames; out_bytes += c->bytes; errors += c->errors; auth_fail += c->auth_fail; }
+    std::cout<<"connections "<<n<<(encrypt ? " (encrypted)" : " (plaintext)")<<", input "<<work_frames<<" frames ("<<in_bytes/1024<<" KB)\n";
+    if(auth_fail) std::cout<<"AUTH FAILURES: "<<auth_fail<<"\n";
+    std::cout<<"delivered "<<out_frames<<" frames ("<<out_bytes/1024<<" KB) in "<<secs*1000<<" ms, server error replies "<<errors<<"\n";
+    std::cout<<"throughput "<<(uint64_t)(work_frames / secs)<<" frames/s, "<<in_bytes / secs / (1024*1024)<<" MB/s\n";
+
+    // 7. 关闭连接，等待转发线程退出
+    for(auto& c : conns) c->up->close();
+    for(auto& c : conns){ c->relay.join(); c->reader.join(); }
+    return 0;
+}
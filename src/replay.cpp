@@ -0,0 +1,168 @@
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+#include "../include/protocol.hpp"
+#include "../include/trace.hpp"
+#include "../include/crc32.hpp"
+
+#pragma comment(lib, "ws2_32.lib")
+
+// 回放工具：把服务器 --capture 录制的报文按原时间间隔（可加速）经N个合成连接重新注入服务器
+// 用法：replay <录制文件> [-n 连接数] [-s 倍速，0为不等待] [-h 服务器IP] [-p 端口]
+
+// 合成连接：接收线程只统计收到的报文
+struct Conn {
+    SOCKET sock = INVALID_SOCKET;
+    uint32_t id = 0;
+    std::thread reader;
+    std::atomic<uint64_t> frames{0}, bytes{0}, throttled{0}, invalid{0};
+};
+
+bool recv_all(SOCKET s, void* buf, int len){
+    char* p = (char*)buf; int rem = len;
+    while(rem>0){ int r = recv(s, p, rem, 0); if(r<=0) return false; rem -= r; p += r; }
+    return true;
+}
+bool send_all(SOCKET s, const void* buf, int len){
+    const char* p = (const char*)buf; int rem = len;
+    while(rem>0){ int r = send(s, p, rem, 0); if(r<=0) return false; rem -= r; p += r; }
+    return true;
+}
+
+void reader_loop(Conn* c){
+    std::vector<uint8_t> payload;
+    while(true){
+        AppHeader hdr;
+        if(!recv_all(c->sock, &hdr, sizeof(hdr))) return;
+        if(hdr.magic != PROTO_MAGIC) return;
+        payload.resize(hdr.payload_len);
+        if(hdr.payload_len && !recv_all(c->sock, payload.data(), hdr.payload_len)) return;
+        c->frames++;
+        c->bytes += sizeof(hdr) + hdr.payload_len;
+        if(hdr.msg_type == MT_THROTTLED) c->throttled++;
+        else if(hdr.msg_type == MT_INVALID_SEMANTIC) c->invalid++;
+    }
+}
+
+int main(int argc, char** argv){
+    // 1. 解析参数
+    if(argc < 2){
+        std::cerr<<"usage: replay <trace> [-n conns] [-s speed] [-h host] [-p port]\n";
+        return 1;
+    }
+    std::string path = argv[1], host = "127.0.0.1";
+    size_t n = 0;
+    double speed = 1.0;
+    int port = 8000;
+    for(int i = 2; i + 1 < argc; i += 2){
+        std::string k = argv[i];
+        if(k == "-n") n = (size_t)atoi(argv[i+1]);
+        else if(k == "-s") speed = atof(argv[i+1]);
+        else if(k == "-h") host = argv[i+1];
+        else if(k == "-p") port = atoi(argv[i+1]);
+    }
+
+    // 2. 读取录制文件，默认每个录制连接对应一个合成连接
+    std::vector<TraceRecord> recs;
+    if(!read_trace(path, recs)){ std::cerr<<"read trace fail\n"; return 1; }
+    if(n == 0) n = trace_assign_slots(recs, SIZE_MAX).size();
+    if(n == 0){ std::cerr<<"empty trace\n"; return 1; }
+    auto slots = trace_assign_slots(recs, n);
+
+    // 3. 建立合成连接，读取服务器分配的ID
+    WSADATA w;
+    if(WSAStartup(MAKEWORD(2,2), &w) != 0){ std::cerr<<"WSAStartup fail\n"; return 1; }
+    sockaddr_in srv{};
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons((u_short)port);
+    inet_pton(AF_INET, host.c_str(), &srv.sin_addr);
+    std::vector<std::unique_ptr<Conn>> conns;
+    for(size_t i = 0; i < n; i++){
+        auto c = std::make_unique<Conn>();
+        c->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(c->sock == INVALID_SOCKET || connect(c->sock, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR){
+            std::cerr<<"connect fail\n"; return 1;
+        }
+        AppHeader hdr;
+        if(!recv_all(c->sock, &hdr, sizeof(hdr)) || hdr.msg_type != MT_ACK || hdr.payload_len < 4
+           || !recv_all(c->sock, &c->id, 4)){
+            std::cerr<<"no ack from server\n"; return 1;
+        }
+        std::vector<uint8_t> rest(hdr.payload_len - 4);
+        if(!rest.empty()) recv_all(c->sock, rest.data(), (int)rest.size());
+        // 有身份的服务器在连接发出第一帧（或握手）之前暂缓转发给它的报文，先发一个空心跳结束等待，
+        // 否则只接收的连接在前5秒收不到任何报文，发送端因目标队列满而阻塞，测得的速率和延迟都失真
+        AppHeader hb{};
+        hb.magic = PROTO_MAGIC; hb.version = 1; hb.msg_type = MT_HEARTBEAT;
+        hb.crc32 = crc32_calc(&hb, sizeof(hb));
+        if(!send_all(c->sock, &hb, (int)sizeof(hb))){ std::cerr<<"send fail\n"; return 1; }
+        c->reader = std::thread(reader_loop, c.get());
+        conns.push_back(std::move(c));
+    }
+    std::cout<<"replaying "<<recs.size()<<" records over "<<n<<" connections, speed "<<speed<<"x\n";
+
+    // 4. 按录制时间发送，目标ID映射为对应合成连接的新ID（录制中不存在的目标映射为0，仍然得到"不在线"）
+    auto start = std::chrono::steady_clock::now();
+    uint64_t sent = 0, sent_bytes = 0;
+    int64_t max_lag_us = 0, total_lag_us = 0;
+    std::vector<uint8_t> frame;
+    for(auto& r : recs){
+        if(r.kind != TR_FRAME || trace_is_handshake(r)) continue;
+        if(speed > 0){
+            auto due = start + std::chrono::microseconds((int64_t)(r.t_us / speed));
+            std::this_thread::sleep_until(due);
+            int64_t lag = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - due).count();
+            if(lag > max_lag_us) max_lag_us = lag;
+            total_lag_us += lag;
+        }
+        frame = r.frame;
+        if(frame.size() >= sizeof(AppHeader) + 4){
+            uint32_t orig;
+            memcpy(&orig, frame.data() + sizeof(AppHeader), 4);
+            auto it = slots.find(orig);
+            retarget_frame(frame, it != slots.end() ? conns[it->second]->id : 0);
+        }
+        if(!send_all(conns[slots[r.conn]]->sock, frame.data(), (int)frame.size())){
+            std::cerr<<"send fail\n"; break;
+        }
+        sent++;
+        sent_bytes += frame.size();
+    }
+    double send_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // 5. 等待转发完成（接收计数连续0.5秒不变，最多10秒）
+    auto total_recv = [&]{ uint64_t t = 0; for(auto& c : conns) t += c->frames; return t; };
+    uint64_t prev = total_recv();
+    for(int i = 0; i < 20; i++){
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        uint64_t now = total_recv();
+        if(now == prev) break;
+        prev = now;
+    }
+
+    // 6. 输出统计
+    uint64_t rf = 0, rb = 0, thr = 0, inv = 0;
+    for(auto& c : conns){ rf += c->frames; rb += c->bytes; thr += c->throttled; inv += c->invalid; }
+    std::cout<<"sent "<<sent<<" frames ("<<sent_bytes/1024<<" KB) in "<<send_s<<" s, "
+             <<(send_s > 0 ? sent / send_s : 0)<<" frames/s\n";
+    if(speed > 0 && sent)
+        std::cout<<"schedule lag: avg "<<total_lag_us / (int64_t)sent<<" us, max "<<max_lag_us<<" us\n";
+    std::cout<<"received "<<rf<<" frames ("<<rb/1024<<" KB), throttled "<<thr<<", invalid "<<inv<<"\n";
+
+    // 7. 关闭连接
+    for(auto& c : conns) shutdown(c->sock, SD_BOTH);
+    for(auto& c : conns){ c->reader.join(); closesocket(c->sock); }
+    WSACleanup();
+    return 0;
+}
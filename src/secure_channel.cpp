@@ -0,0 +1,195 @@
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+
+#include "../include/secure_channel.hpp"
+#include "../include/crc32.hpp"
+#include "../include/sha256.hpp"
+
+namespace fs = std::filesystem;
+
+static const char HS_LABEL[] = "LANChat handshake v1";
+
+// 随机数：4字节0 + 64位小端序号
+static void make_nonce(uint64_t seq, uint8_t nonce[AEAD_NONCE_BYTES]){
+    memset(nonce, 0, 4);
+    memcpy(nonce + 4, &seq, 8);
+}
+
+void CipherState::seal(std::vector<uint8_t>& frame){
+    AppHeader hdr;
+    memcpy(&hdr, frame.data(), sizeof(hdr));
+    size_t plain = frame.size() - sizeof(hdr);
+    hdr.flags |= FLAG_ENCRYPTED;
+    hdr.payload_len = (uint32_t)(plain + AEAD_TAG_BYTES);
+    hdr.crc32 = 0;
+    memcpy(frame.data(), &hdr, sizeof(hdr));
+
+    uint8_t nonce[AEAD_NONCE_BYTES], tag[AEAD_TAG_BYTES];
+    make_nonce(seq++, nonce);
+    aead_seal(key, nonce, frame.data(), sizeof(hdr), frame.data() + sizeof(hdr), plain, tag);
+    frame.insert(frame.end(), tag, tag + AEAD_TAG_BYTES);
+}
+
+void CipherState::seal_into(AppHeader hdr, const uint8_t* payload, size_t len, std::vector<uint8_t>& frame){
+    hdr.flags |= FLAG_ENCRYPTED;
+    hdr.payload_len = (uint32_t)(len + AEAD_TAG_BYTES);
+    hdr.crc32 = 0;
+    frame.resize(sizeof(hdr) + len + AEAD_TAG_BYTES);
+    memcpy(frame.data(), &hdr, sizeof(hdr));
+
+    uint8_t nonce[AEAD_NONCE_BYTES];
+    make_nonce(seq++, nonce);
+    uint8_t* out = frame.data() + sizeof(hdr);
+    aead_seal(key, nonce, frame.data(), sizeof(hdr), payload, out, len, out + len);
+}
+
+bool CipherState::open(const AppHeader& hdr, uint8_t* data, uint32_t& plain_len){
+    if(!(hdr.flags & FLAG_ENCRYPTED) || hdr.payload_len < AEAD_TAG_BYTES) return false;
+    plain_len = hdr.payload_len - (uint32_t)AEAD_TAG_BYTES;
+    uint8_t nonce[AEAD_NONCE_BYTES];
+    make_nonce(seq++, nonce);
+    return aead_open(key, nonce, (const uint8_t*)&hdr, sizeof(hdr), data, plain_len, data + plain_len);
+}
+
+// ---------- 服务器密钥 ----------
+
+bool ServerIdentity::generate(){
+    if(!random_bytes(priv, sizeof(priv))) return false;
+    x25519_public(pub, priv);
+    return true;
+}
+
+bool ServerIdentity::load_or_create(const std::string& path, std::string& err){
+    // 1. 已有密钥文件：必须正好是一个私钥。损坏时不能重新生成，否则客户端记录的公钥全部失效，原文件留给管理员处理
+    std::error_code ec;
+    if(fs::exists(path, ec) || ec){
+        std::ifstream ifs(path, std::ios::binary);
+        uint8_t extra, any = 0;
+        if(!ifs){ err = "cannot read " + path; return false; }
+        if(!ifs.read((char*)priv, sizeof(priv)) || ifs.read((char*)&extra, 1)){
+            err = path + " is not a " + std::to_string(sizeof(priv)) + "-byte key; restore it from a backup or delete it to create a new identity";
+            return false;
+        }
+        for(uint8_t b : priv) any |= b;
+        if(!any){ err = path + " holds an all-zero key; restore it from a backup or delete it to create a new identity"; return false; }
+        x25519_public(pub, priv);
+        return true;
+    }
+
+    // 2. 首次启动：生成后先写临时文件再改名，中途失败不会留下不完整的密钥文件
+    if(!generate()){ err = "random source unavailable"; return false; }
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        ofs.write((const char*)priv, sizeof(priv));
+        if(!ofs){ err = "cannot write " + tmp; return false; }
+    }
+    fs::rename(tmp, path, ec);
+    if(ec){ err = "cannot create " + path + ": " + ec.message(); return false; }
+    return true;
+}
+
+// ---------- 握手 ----------
+
+// 由握手记录和两次DH结果导出两个方向的密钥
+static void derive_keys(uint32_t client_id, const uint8_t e_c[32], const uint8_t e_s[32], const uint8_t s_s[32],
+                        const uint8_t dh1[32], const uint8_t dh2[32], uint8_t transcript[32],
+                        CipherState& c2s, CipherState& s2c){
+    Sha256 h;
+    h.update(HS_LABEL, sizeof(HS_LABEL) - 1);
+    h.update(&client_id, 4);
+    h.update(e_c, 32);
+    h.update(e_s, 32);
+    h.update(s_s, 32);
+    h.final(transcript);
+
+    uint8_t ikm[64], okm[64];
+    memcpy(ikm, dh1, 32);
+    memcpy(ikm + 32, dh2, 32);
+    static const char info[] = "c2s/s2c";
+    hkdf_sha256(transcript, 32, ikm, 64, (const uint8_t*)info, sizeof(info) - 1, okm, 64);
+    memcpy(c2s.key, okm, 32);
+    memcpy(s2c.key, okm + 32, 32);
+    c2s.seq = s2c.seq = 0;
+}
+
+// 确认标签：下行密钥、序号0、以握手记录为附加数据的空消息
+static void confirm_tag(CipherState& s2c, const uint8_t transcript[32], uint8_t tag[AEAD_TAG_BYTES]){
+    uint8_t nonce[AEAD_NONCE_BYTES];
+    make_nonce(s2c.seq++, nonce);
+    aead_seal(s2c.key, nonce, transcript, 32, nullptr, 0, tag);
+}
+
+bool handshake_respond(const ServerIdentity& id, uint32_t client_id, const uint8_t* hello, size_t len,
+                       std::vector<uint8_t>& reply, CipherState& rx, CipherState& tx){
+    if(len != X25519_BYTES) return false;
+    uint8_t e_priv[32], e_pub[32], dh1[32], dh2[32], transcript[32];
+    if(!random_bytes(e_priv, 32)) return false;
+    x25519_public(e_pub, e_priv);
+    if(!x25519(dh1, e_priv, hello) || !x25519(dh2, id.priv, hello)) return false;
+    derive_keys(client_id, hello, e_pub, id.pub, dh1, dh2, transcript, rx, tx);
+
+    reply.resize(32 + 32 + AEAD_TAG_BYTES);
+    memcpy(reply.data(), e_pub, 32);
+    memcpy(reply.data() + 32, id.pub, 32);
+    confirm_tag(tx, transcript, reply.data() + 64);
+    return true;
+}
+
+// 检查（或首次记录）服务器公钥
+static bool check_pin(const std::string& path, const uint8_t pub[32]){
+    if(path.empty()) return true;
+    uint8_t known[32];
+    std::ifstream ifs(path, std::ios::binary);
+    if(ifs && ifs.read((char*)known, 32) && ifs.gcount() == 32) return ct_equal(known, pub, 32);
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    ofs.write((const char*)pub, 32);
+    return true;
+}
+
+bool client_handshake(const ChannelRecv& recv_fn, const ChannelSend& send_fn, const std::string& pin_path,
+                      uint32_t& my_id, CipherState& tx, CipherState& rx, std::string& err){
+    // 1. 读取ACK得到ID
+    AppHeader hdr;
+    std::vector<uint8_t> payload;
+    if(!recv_fn(&hdr, sizeof(hdr)) || hdr.magic != PROTO_MAGIC || hdr.msg_type != MT_ACK || hdr.payload_len != 4
+       || !recv_fn(&my_id, 4)){
+        err = "no ack from server"; return false;
+    }
+
+    // 2. 发送临时公钥（明文帧，带CRC）
+    uint8_t e_priv[32], e_pub[32];
+    if(!random_bytes(e_priv, 32)){ err = "random source unavailable"; return false; }
+    x25519_public(e_pub, e_priv);
+    AppHeader h{};
+    h.magic = PROTO_MAGIC; h.version = 1; h.msg_type = MT_HANDSHAKE; h.payload_len = 32; h.crc32 = 0;
+    uint8_t frame[sizeof(AppHeader) + 32];
+    memcpy(frame, &h, sizeof(h));
+    memcpy(frame + sizeof(h), e_pub, 32);
+    h.crc32 = crc32_calc(frame, sizeof(frame));
+    memcpy(frame + offsetof(AppHeader, crc32), &h.crc32, 4);
+    if(!send_fn(frame, sizeof(frame))){ err = "send failed"; return false; }
+
+    // 3. 读取回复（服务器在握手完成前暂缓转发其他客户端的报文，此前只可能收到限速通知等控制消息，跳过）
+    while(true){
+        if(!recv_fn(&hdr, sizeof(hdr)) || hdr.magic != PROTO_MAGIC){ err = "connection closed"; return false; }
+        payload.resize(hdr.payload_len);
+        if(hdr.payload_len && !recv_fn(payload.data(), hdr.payload_len)){ err = "connection closed"; return false; }
+        if(hdr.msg_type == MT_HANDSHAKE) break;
+        if(hdr.msg_type == MT_INVALID_SEMANTIC){ err = "server does not support encryption"; return false; }
+    }
+    if(payload.size() != 32 + 32 + AEAD_TAG_BYTES){ err = "bad handshake reply"; return false; }
+    const uint8_t* e_s = payload.data();
+    const uint8_t* s_s = payload.data() + 32;
+
+    // 4. 导出密钥并验证确认标签（证明对方持有S_s的私钥），再与记录的服务器公钥比对
+    uint8_t dh1[32], dh2[32], transcript[32], tag[AEAD_TAG_BYTES];
+    if(!x25519(dh1, e_priv, e_s) || !x25519(dh2, e_priv, s_s)){ err = "bad server key"; return false; }
+    derive_keys(my_id, e_pub, e_s, s_s, dh1, dh2, transcript, tx, rx);
+    confirm_tag(rx, transcript, tag);
+    if(!ct_equal(tag, payload.data() + 64, AEAD_TAG_BYTES)){ err = "handshake authentication failed"; return false; }
+    if(!check_pin(pin_path, s_s)){ err = "server key changed (delete " + pin_path + " if expected)"; return false; }
+    return true;
+}
@@ -0,0 +1,167 @@
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "../include/trace.hpp"
+#include "../include/crc32.hpp"
+
+static constexpr size_t TRACE_BUF_BYTES = 1024 * 1024;
+
+// 变长整数（每字节7位，最高位表示后面还有字节）
+static void put_varint(FILE* fp, uint64_t v){
+    uint8_t b[10];
+    int n = 0;
+    while(v >= 0x80){
+        b[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    b[n++] = (uint8_t)v;
+    fwrite(b, 1, n, fp);
+}
+
+static bool get_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v){
+    v = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        if(p >= end) return false;
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if(!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// ---------- 录制 ----------
+
+TraceWriter::~TraceWriter(){ close(); }
+
+bool TraceWriter::open(const std::string& path){
+    close();
+    std::lock_guard<std::mutex> lk(mtx);
+    fp = fopen(path.c_str(), "wb");
+    if(!fp) return false;
+    buf.resize(TRACE_BUF_BYTES);
+    setvbuf(fp, buf.data(), _IOFBF, buf.size());
+    uint32_t magic = TRACE_MAGIC;
+    uint16_t ver = TRACE_VERSION, reserved = 0;
+    fwrite(&magic, 4, 1, fp);
+    fwrite(&ver, 2, 1, fp);
+    fwrite(&reserved, 2, 1, fp);
+    last = last_flush = std::chrono::steady_clock::now();
+    return true;
+}
+
+void TraceWriter::close(){
+    std::lock_guard<std::mutex> lk(mtx);
+    if(fp) fclose(fp);
+    fp = nullptr;
+}
+
+void TraceWriter::begin(uint8_t kind, uint32_t conn){
+    auto now = std::chrono::steady_clock::now();
+    uint64_t dt = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+    last = now;
+    fputc(kind, fp);
+    put_varint(fp, dt);
+    put_varint(fp, conn);
+}
+
+void TraceWriter::maybe_flush(){
+    if(last - last_flush >= std::chrono::seconds(1)){
+        fflush(fp);
+        last_flush = last;
+    }
+}
+
+void TraceWriter::connect(uint32_t conn){
+    std::lock_guard<std::mutex> lk(mtx);
+    if(!fp) return;
+    begin(TR_CONNECT, conn);
+    maybe_flush();
+}
+
+void TraceWriter::disconnect(uint32_t conn){
+    std::lock_guard<std::mutex> lk(mtx);
+    if(!fp) return;
+    begin(TR_DISCONNECT, conn);
+    fflush(fp);
+    last_flush = last;
+}
+
+void TraceWriter::frame(uint32_t conn, const AppHeader& hdr, const uint8_t* payload){
+    std::lock_guard<std::mutex> lk(mtx);
+    if(!fp) return;
+    begin(TR_FRAME, conn);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    if(hdr.payload_len) fwrite(payload, 1, hdr.payload_len, fp);
+    maybe_flush();
+}
+
+// ---------- 读取 ----------
+
+bool read_trace(const std::string& path, std::vector<TraceRecord>& out){
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs) return false;
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if(data.size() < 8) return false;
+    uint32_t magic;
+    uint16_t ver;
+    memcpy(&magic, data.data(), 4);
+    memcpy(&ver, data.data()+4, 2);
+    if(magic != TRACE_MAGIC || ver != TRACE_VERSION) return false;
+
+    out.clear();
+    const uint8_t* p = data.data() + 8;
+    const uint8_t* end = data.data() + data.size();
+    uint64_t t = 0;
+    while(p < end){
+        TraceRecord r;
+        r.kind = *p++;
+        uint64_t dt, conn;
+        if(!get_varint(p, end, dt) || !get_varint(p, end, conn)) break;
+        t += dt;
+        r.t_us = t;
+        r.conn = (uint32_t)conn;
+        if(r.kind == TR_FRAME){
+            if((size_t)(end - p) < sizeof(AppHeader)) break;
+            AppHeader hdr;
+            memcpy(&hdr, p, sizeof(hdr));
+            if((size_t)(end - p) - sizeof(hdr) < hdr.payload_len) break;
+            r.frame.assign(p, p + sizeof(hdr) + hdr.payload_len);
+            p += r.frame.size();
+        } else if(r.kind != TR_CONNECT && r.kind != TR_DISCONNECT){
+            break;
+        }
+        out.push_back(std::move(r));
+    }
+    return true;
+}
+
+std::map<uint32_t, size_t> trace_assign_slots(const std::vector<TraceRecord>& recs, size_t n){
+    std::map<uint32_t, size_t> slots;
+    if(n == 0) return slots;
+    size_t next = 0;
+    for(auto& r : recs){
+        if(slots.count(r.conn)) continue;
+        slots[r.conn] = next % n;
+        next++;
+    }
+    return slots;
+}
+
+void retarget_frame(std::vector<uint8_t>& frame, uint32_t target){
+    if(frame.size() < sizeof(AppHeader) + 4) return;
+    uint8_t* crc_field = frame.data() + offsetof(AppHeader, crc32);
+    uint32_t orig, c = 0;
+    memcpy(&orig, crc_field, 4);
+    memcpy(crc_field, &c, 4);
+    bool was_valid = crc32_calc(frame.data(), frame.size()) == orig;
+    memcpy(frame.data() + sizeof(AppHeader), &target, 4);
+    c = crc32_calc(frame.data(), frame.size());
+    if(!was_valid) c ^= 1;   // 录制时就校验失败的报文，回放时仍保持校验失败
+    memcpy(crc_field, &c, 4);
+}
+
+bool trace_is_handshake(const TraceRecord& r){
+    return r.kind == TR_FRAME && r.frame.size() >= sizeof(AppHeader) && r.frame[offsetof(AppHeader, msg_type)] == MT_HANDSHAKE;
+}